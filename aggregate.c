@@ -0,0 +1,237 @@
+#include "logix2mqtt.h"
+
+/* statistics of one contiguous run of values, reduced with a typed loop per data type */
+#define REDUCE_RUN(type) do { \
+	const type *v = (const type *)values; \
+	for (i = 0; i < n; i++) { \
+		x = (double)v[i]; \
+		sum += x; \
+		min = (x < min) ? x : min; \
+		max = (x > max) ? x : max; \
+	} \
+	mean = sum/n; \
+	for (i = 0; i < n; i++) { \
+		x = (double)v[i]-mean; \
+		m2 += x*x; \
+	} \
+} while (0)
+
+/* give every numeric tag of an aggregating scan class its running statistics */
+int aggregate_setup(struct plc_t *plc)
+{
+	struct scan_t *scan = NULL;
+	struct tag_t *tag = NULL;
+	int i = 0, j = 0;
+
+	for (j = 0; j < plc->sched.num_scans; j++) {
+		scan = &plc->sched.scans[j];
+		if (scan->window <= 0) {
+			continue;
+		}
+		scan->window_end = 0;
+		for (i = 0; i < scan->num_tags; i++) {
+			tag = scan->tags[i];
+			/* hidden tags only feed derived tags, they are never published */
+			if (tag->data_size == 0 || tag->data_type == STRING || tag->data_type == STRUCT || tag->hidden || tag->agg != NULL) {
+				continue;
+			}
+			tag->agg = my_malloc(sizeof(struct agg_t));
+			if (tag->agg == NULL) {
+				fprintf(stderr, "%s: Failed to allocate memory for aggregates of %s\n", plc->name, tag->name);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+void aggregate_free(struct plc_t *plc)
+{
+	int i = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		free(plc->tags[i].agg);
+		plc->tags[i].agg = NULL;
+	}
+}
+
+/* merge a run's count, mean and squared deviations into the window, Chan's pairwise update keeps it stable */
+static void merge_run(struct agg_t *a, unsigned int n, double mean, double m2, double min, double max)
+{
+	double total = (double)a->count+n;
+	double delta = mean-a->mean;
+
+	if (a->count == 0 || min < a->min) {
+		a->min = min;
+	}
+	if (a->count == 0 || max > a->max) {
+		a->max = max;
+	}
+	a->mean += delta*n/total;
+	a->m2 += m2+delta*delta*(double)a->count*n/total;
+	a->count += n;
+}
+
+/* fold n consecutive values of a tag laid out size bytes apart */
+static void reduce_run(struct agg_t *a, struct tag_t *tag, const uint8_t *values, size_t size, unsigned int n)
+{
+	struct tag_t view = *tag;
+	double x = 0, sum = 0, mean = 0, m2 = 0, min = DBL_MAX, max = -DBL_MAX;
+	unsigned int i = 0;
+	plc_data_type_t type = tag->data_type;
+
+	if (n == 0) {
+		return;
+	}
+	/* bits and views narrower than their type go through the generic decode */
+	if (type == BIT || size != get_plc_data_type_size(type)) {
+		type = UNKNOWN;
+	}
+	switch (type) {
+	case BOOL:
+	case SINT:
+		REDUCE_RUN(int8_t);
+		break;
+	case INT:
+		REDUCE_RUN(int16_t);
+		break;
+	case DINT:
+		REDUCE_RUN(int32_t);
+		break;
+	case LINT:
+		REDUCE_RUN(int64_t);
+		break;
+	case REAL:
+		REDUCE_RUN(float);
+		break;
+	default:
+		for (i = 0; i < n; i++) {
+			view.data = (void *)(values+i*size);
+			get_tag_number(&view, &x);
+			sum += x;
+			min = (x < min) ? x : min;
+			max = (x > max) ? x : max;
+		}
+		mean = sum/n;
+		for (i = 0; i < n; i++) {
+			view.data = (void *)(values+i*size);
+			get_tag_number(&view, &x);
+			m2 += (x-mean)*(x-mean);
+		}
+		break;
+	}
+	merge_run(a, n, mean, m2, min, max);
+}
+
+/* fold a tag's values of this publish stamped before end into its window
+ * sampled tags fold their claimed ring in at most two runs, others fold the snapshot value when it is fresh */
+static void fold_tag(struct scan_t *scan, struct tag_t *tag, int64_t end)
+{
+	struct agg_t *a = tag->agg;
+	struct ring_t *r = tag->ring;
+	unsigned int k = 0, start = 0, run = 0;
+
+	if (r == NULL) {
+		if (a->pos == 0 && scan->stamp < end) {
+			a->pos = 1;
+			if (tag->data != NULL && tag_quality(tag) == QUALITY_GOOD) {
+				reduce_run(a, tag, tag->data, get_tag_value_size(tag), 1);
+			}
+		}
+		return;
+	}
+	k = a->pos;
+	while (k < r->taken && r->stamps[(r->tail+k) % r->cap] < end) {
+		k++;
+	}
+	if (k == a->pos) {
+		return;
+	}
+	start = (r->tail+a->pos) % r->cap;
+	run = (k-a->pos < r->cap-start) ? k-a->pos : r->cap-start;
+	reduce_run(a, tag, r->values+start*r->size, r->size, run);
+	reduce_run(a, tag, r->values, r->size, k-a->pos-run);
+	a->pos = k;
+}
+
+/* publish the statistics of a closed window as json and start the next one, empty windows are not published */
+static void publish_window(struct plc_t *plc, struct scan_t *scan)
+{
+	struct tag_t *tag = NULL;
+	struct agg_t *a = NULL;
+	cJSON *json = NULL, *tags = NULL, *node = NULL;
+	char topic[512];
+	char *buf = NULL;
+	int i = 0, count = 0, rc = 0;
+
+	json = cJSON_CreateObject();
+	cJSON_AddNumberToObject(json, "start", scan->window_end-scan->window);
+	cJSON_AddNumberToObject(json, "end", scan->window_end);
+	tags = cJSON_AddObjectToObject(json, "tags");
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = scan->tags[i];
+		a = tag->agg;
+		if (a == NULL || a->count == 0) {
+			continue;
+		}
+		node = cJSON_AddObjectToObject(tags, tag->name);
+		cJSON_AddNumberToObject(node, "count", a->count);
+		cJSON_AddNumberToObject(node, "min", a->min);
+		cJSON_AddNumberToObject(node, "max", a->max);
+		cJSON_AddNumberToObject(node, "mean", a->mean);
+		cJSON_AddNumberToObject(node, "stddev", sqrt(a->m2/a->count));
+		a->count = 0;
+		a->mean = 0;
+		a->m2 = 0;
+		count++;
+	}
+	buf = (count > 0) ? cJSON_PrintUnformatted(json) : NULL;
+	cJSON_Delete(json);
+	if (buf == NULL) {
+		return;
+	}
+
+	snprintf(topic, sizeof(topic), "%s/%s/%lld", plc->mqtt->aggtopic, plc->name, (long long)scan->window);
+	rc = publish_message(plc, topic, buf, strlen(buf));
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "%s: Error publishing aggregates: %s\n", plc->name, mosquitto_strerror(rc));
+	}
+	free(buf);
+}
+
+/* fold one published scan into its window, runs on the publishing thread
+ * windows are aligned to the wall clock so every gateway closes them at the same time */
+void aggregate_scan(struct plc_t *plc, struct scan_t *scan)
+{
+	struct tag_t *tag = NULL;
+	int i = 0;
+
+	if (scan->window_end == 0) {
+		scan->window_end = (scan->stamp/scan->window+1)*scan->window;
+	}
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = scan->tags[i];
+		if (tag->ring != NULL) {
+			sample_take(tag->ring);
+		}
+		if (tag->agg != NULL) {
+			tag->agg->pos = 0;
+			fold_tag(scan, tag, scan->window_end);
+		}
+	}
+	if (scan->stamp >= scan->window_end) {
+		publish_window(plc, scan);
+		/* windows that saw no reads at all are skipped */
+		scan->window_end = (scan->stamp/scan->window+1)*scan->window;
+		for (i = 0; i < scan->num_tags; i++) {
+			if (scan->tags[i]->agg != NULL) {
+				fold_tag(scan, scan->tags[i], scan->window_end);
+			}
+		}
+	}
+	for (i = 0; i < scan->num_tags; i++) {
+		if (scan->tags[i]->ring != NULL) {
+			sample_release(scan->tags[i]->ring);
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#include "logix2mqtt.h"
+
+/* build per tag topics and size the message batch for a scan class */
+int batch_compile(struct batch_t *b, struct tag_t **tags, int num_tags, const char *prefix)
+{
+	struct tag_t *tag = NULL;
+	size_t size = 0, len = 0;
+	int i = 0;
+
+	batch_free(b);
+	for (i = 0; i < num_tags; i++) {
+		tag = tags[i];
+		if (tag->name == NULL || tag->data == NULL || tag->hidden) {
+			continue;
+		}
+		if (tag->topic == NULL) {
+			len = strlen(prefix)+1+strlen(tag->name)+1;
+			tag->topic = my_malloc(len);
+			if (tag->topic == NULL) {
+				fprintf(stderr, "Failed to allocate memory for tag topic\n");
+				return 1;
+			}
+			snprintf(tag->topic, len, "%s/%s", prefix, tag->name);
+		}
+		size += payload_value_max(tag);
+	}
+	b->buf = my_malloc(size+1);
+	b->msgs = my_malloc(sizeof(struct batch_msg_t)*(num_tags+1));
+	if (b->buf == NULL || b->msgs == NULL) {
+		fprintf(stderr, "Failed to allocate memory for message batch\n");
+		batch_free(b);
+		return 1;
+	}
+	b->size = size+1;
+	b->max = num_tags;
+	return 0;
+}
+
+void batch_free(struct batch_t *b)
+{
+	if (b->buf != NULL) {
+		free(b->buf);
+	}
+	if (b->msgs != NULL) {
+		free(b->msgs);
+	}
+	memset(b, 0, sizeof(struct batch_t));
+}
+
+void batch_begin(struct batch_t *b)
+{
+	b->len = 0;
+	b->count = 0;
+}
+
+/* encode a tag value into the batch, returns 0 when the tag type cannot be published */
+int batch_add(struct batch_t *b, struct tag_t *tag, int format)
+{
+	size_t n = 0;
+
+	if (tag->topic == NULL || b->count >= b->max) {
+		return 0;
+	}
+	n = payload_write_value(b->buf+b->len, tag, format);
+	if (n == 0) {
+		return 0;
+	}
+	b->msgs[b->count].tag = tag;
+	b->msgs[b->count].offset = b->len;
+	b->msgs[b->count].len = n;
+	b->msgs[b->count].rc = MOSQ_ERR_SUCCESS;
+	b->count++;
+	b->len += n;
+	return 1;
+}
+
+/* hand the whole batch to libmosquitto in one burst, returns number of failed publishes */
+int batch_flush(struct batch_t *b, struct mosquitto *mosq, int qos, int retain)
+{
+	int i = 0, failed = 0;
+
+	if (b->count == 0) {
+		return 0;
+	}
+	for (i = 0; i < b->count; i++) {
+		b->msgs[i].rc = mosquitto_publish(mosq, NULL, b->msgs[i].tag->topic, b->msgs[i].len, b->buf+b->msgs[i].offset, qos, retain);
+		if (b->msgs[i].rc != MOSQ_ERR_SUCCESS) {
+			failed++;
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,72 @@
+/* time config loading for large tag lists: generate, parse, validate */
+#include "../logix2mqtt.h"
+
+/* write a config with num_tags tags spread over a few types */
+static int write_config(const char *fn, int num_tags)
+{
+	static const char *types[] = { "dint", "real", "bool", "int", "string" };
+	FILE *fd = NULL;
+	int i = 0;
+
+	fd = fopen(fn, "w");
+	if (fd == NULL) {
+		fprintf(stderr, "Failed to create %s\n", fn);
+		return -1;
+	}
+	fprintf(fd, "{\"mqtt\":{\"broker\":\"localhost\",\"pub_topic\":\"tele/logix2mqtt/STAT\"},\n");
+	fprintf(fd, "\"logix\":{\"gateway\":\"10.0.0.1\",\"path\":\"1,0\",\"coalesce\":true},\n\"tags\":[\n");
+	for (i = 0; i < num_tags; i++) {
+		if (i % 10 == 0) {
+			fprintf(fd, "[\"Line%d_Motor[%d]\",\"dint\"]", i/1000, i%1000);
+		} else {
+			fprintf(fd, "[\"Line%d_Motor%d.Current\",\"%s\",{\"deadband\":0.5}]", i/100, i%100, types[i % 5]);
+		}
+		fprintf(fd, (i < num_tags-1) ? ",\n" : "\n");
+	}
+	fprintf(fd, "]}\n");
+	fclose(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *fn = "/tmp/bench_config.json";
+	int num_tags = (argc > 1) ? atoi(argv[1]) : 100000;
+	struct mqtt_t mqtt = {0};
+	struct plc_t *plcs = NULL;
+	struct stat s = {0};
+	int64_t start = 0, parsed = 0, checked = 0;
+	int num_plcs = 0, i = 0;
+
+	if (num_tags <= 0) {
+		fprintf(stderr, "usage: %s [tags]\n", argv[0]);
+		return 1;
+	}
+	if (write_config(fn, num_tags) != 0) {
+		return 1;
+	}
+	stat(fn, &s);
+
+	start = time_us();
+	plcs = read_conf_file(fn, &mqtt, &num_plcs);
+	parsed = time_us();
+	if (plcs == NULL || check_config(&mqtt, plcs, num_plcs) != 0) {
+		fprintf(stderr, "Failed to load %s\n", fn);
+		return 1;
+	}
+	checked = time_us();
+
+	printf("%d tags, %lld bytes, %d controller(s)\n",
+		num_tags, (long long)s.st_size, num_plcs);
+	printf("parse %.1f ms, check %.1f ms, total %.1f ms\n",
+		(parsed-start)/1000.0, (checked-parsed)/1000.0, (checked-start)/1000.0);
+
+	for (i = 0; i < num_plcs; i++) {
+		config_free(&plcs[i]);
+	}
+	free(plcs);
+	free(mqtt.broker);
+	free(mqtt.pubtopic);
+	unlink(fn);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/* time derived tag evaluation: a unit conversion, a sum and an alarm combination over a few inputs */
+#include "../logix2mqtt.h"
+
+#define ROUNDS (1000000)
+
+static struct tag_t tags[] = {
+	{ .name = "flow1", .data_type = REAL },
+	{ .name = "flow2", .data_type = REAL },
+	{ .name = "temp_c", .data_type = DINT },
+	{ .name = "level", .data_type = INT },
+	{ .name = "pump_on", .data_type = BOOL },
+	{ .name = "flow_total", .data_type = REAL, .expr = "flow1 + flow2" },
+	{ .name = "temp_f", .data_type = REAL, .expr = "temp_c * 9 / 5 + 32" },
+	{ .name = "alarm", .data_type = BOOL, .expr = "(level > 90 && !pump_on) || abs(flow1 - flow2) > 0.1*max(flow1, flow2)" },
+};
+
+int main(int argc, char **argv)
+{
+	struct plc_t plc = {0};
+	struct scan_t scan = {0};
+	struct tag_t *derived[8];
+	int64_t values[8] = {0};
+	int64_t start = 0, us = 0;
+	double v = 0;
+	int i = 0, n = (int)(sizeof(tags)/sizeof(tags[0]));
+
+	plc.name = "bench";
+	plc.tags = tags;
+	plc.num_tags = n;
+	for (i = 0; i < n; i++) {
+		tags[i].data = &values[i];
+		tags[i].expr = (tags[i].expr != NULL) ? strdup(tags[i].expr) : NULL;
+	}
+	if (derive_compile(&plc) != 0) {
+		return 1;
+	}
+	*(float *)tags[0].data = 12.5f;
+	*(float *)tags[1].data = 11.0f;
+	*(int32_t *)tags[2].data = 21;
+	*(int16_t *)tags[3].data = 95;
+	*(int8_t *)tags[4].data = 0;
+	for (i = 0; i < n; i++) {
+		if (tags[i].code != NULL) {
+			derived[scan.num_derived++] = &tags[i];
+		}
+	}
+	scan.derived = derived;
+
+	start = time_us();
+	for (i = 0; i < ROUNDS; i++) {
+		/* keep the inputs moving so nothing is folded away */
+		*(float *)tags[0].data = (float)(i & 63);
+		derive_scan(&scan);
+	}
+	us = time_us()-start;
+
+	for (i = 0; i < n; i++) {
+		if (tags[i].code != NULL) {
+			get_tag_number(&tags[i], &v);
+			printf("%-12s %2d ops  %g (%s)\n", tags[i].name, tags[i].code->num_ops, v, get_quality_str(tag_quality(&tags[i])));
+		}
+	}
+	printf("%d rounds of %d expressions in %lld us, %.1f ns per expression\n",
+		ROUNDS, scan.num_derived, (long long)us, 1000.0*us/((double)ROUNDS*scan.num_derived));
+	derive_free(&plc);
+	return 0;
+}
@@ -0,0 +1,139 @@
+#!/bin/sh
+# end to end throughput against libplctag's ab_server simulator and a local mosquitto broker
+#
+# usage: bench_e2e.sh [tag counts...]
+# environment:
+#   AB_SERVER   path to ab_server (default: ab_server in PATH or ./ab_server)
+#   MOSQUITTO   path to mosquitto broker (default: mosquitto)
+#   MQTT_PORT   broker port (default: 18830)
+#   WARMUP      seconds before measuring (default: 5)
+#   DURATION    seconds measured per tag count (default: 20)
+#   INTERVAL    logix2mqtt scan interval in ms (default: 1)
+#   COALESCE    true to let logix2mqtt bulk read array elements (default: false)
+#   PUB_FORMAT  json or msgpack (default: json)
+
+set -u
+
+BIN=${BIN:-./logix2mqtt}
+AB_SERVER=${AB_SERVER:-$(command -v ab_server || echo ./ab_server)}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+MQTT_PORT=${MQTT_PORT:-18830}
+METRICS_PORT=${METRICS_PORT:-19464}
+WARMUP=${WARMUP:-5}
+DURATION=${DURATION:-20}
+INTERVAL=${INTERVAL:-1}
+COALESCE=${COALESCE:-false}
+PUB_FORMAT=${PUB_FORMAT:-json}
+COUNTS=${*:-10 100 1000 10000 50000}
+TOPIC=bench/logix2mqtt/STAT
+WORK=$(mktemp -d /tmp/bench_e2e.XXXXXX)
+CLK_TCK=$(getconf CLK_TCK)
+PIDS=""
+
+cleanup() {
+	for p in $PIDS; do
+		kill "$p" 2>/dev/null
+	done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+for tool in "$BIN" "$AB_SERVER" "$MOSQUITTO" mosquitto_sub curl; do
+	if ! command -v "$tool" >/dev/null 2>&1; then
+		echo "bench_e2e: $tool not found" >&2
+		exit 1
+	fi
+done
+
+# tags are elements of one array per type so ab_server needs only a handful of arguments
+TYPES="DINT REAL INT SINT"
+
+# per type element count for n tags
+per_type() {
+	echo $(( ($1 + 3) / 4 ))
+}
+
+write_config() {
+	n=$1
+	{
+		printf '{"mqtt":{"broker":"127.0.0.1","port":%d,"pub_topic":"%s","pub_format":"%s",' "$MQTT_PORT" "$TOPIC" "$PUB_FORMAT"
+		printf '"metrics_listen":"127.0.0.1:%d"},\n' "$METRICS_PORT"
+		printf '"logix":{"gateway":"127.0.0.1","path":"1,0","timeout":5000,"interval":%d,"coalesce":%s},\n' "$INTERVAL" "$COALESCE"
+		printf '"tags":[\n'
+		awk -v n="$n" -v types="$TYPES" 'BEGIN {
+			split(types, t, " ");
+			for (i = 0; i < n; i++) {
+				ty = t[i % 4 + 1];
+				printf "[\"Bench%s[%d]\",\"%s\"]%s\n", ty, int(i / 4), tolower(ty), (i < n - 1) ? "," : "";
+			}
+		}'
+		printf ']}\n'
+	} > "$WORK/config.json"
+}
+
+scrape() {
+	curl -s "http://127.0.0.1:$METRICS_PORT/metrics" > "$WORK/metrics.txt"
+}
+
+# value of a prometheus sample, matched on the metric name and label prefix
+sample() {
+	awk -v m="$1" 'index($0, m) == 1 { print $NF; exit }' "$WORK/metrics.txt"
+}
+
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+"$MOSQUITTO" -p "$MQTT_PORT" >"$WORK/mosquitto.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+mosquitto_sub -p "$MQTT_PORT" -t "$TOPIC/#" > "$WORK/sub.out" &
+PIDS="$PIDS $!"
+
+printf '%8s %10s %10s %10s %12s %12s\n' "tags" "cycles/s" "p50 ms" "p99 ms" "cpu us/tag" "bytes/s"
+for n in $COUNTS; do
+	args=""
+	for ty in $TYPES; do
+		args="$args --tag=Bench$ty:$ty[$(per_type "$n")]"
+	done
+	# shellcheck disable=SC2086
+	"$AB_SERVER" --plc=ControlLogix --path=1,0 $args >"$WORK/ab_server.log" 2>&1 &
+	ab=$!
+	sleep 1
+
+	write_config "$n"
+	"$BIN" "$WORK/config.json" >"$WORK/logix2mqtt.log" 2>&1 &
+	lm=$!
+	sleep "$WARMUP"
+	if ! kill -0 "$lm" 2>/dev/null; then
+		echo "bench_e2e: logix2mqtt exited, see log below" >&2
+		tail -20 "$WORK/logix2mqtt.log" >&2
+		kill "$ab" 2>/dev/null
+		exit 1
+	fi
+
+	scrape
+	c0=$(sample "logix2mqtt_cycles_total{")
+	t0=$(cpu_ticks "$lm")
+	b0=$(wc -c < "$WORK/sub.out")
+	sleep "$DURATION"
+	scrape
+	c1=$(sample "logix2mqtt_cycles_total{")
+	t1=$(cpu_ticks "$lm")
+	b1=$(wc -c < "$WORK/sub.out")
+	p50=$(sample 'logix2mqtt_cycle_seconds{plc="plc0",quantile="0.5"}')
+	p99=$(sample 'logix2mqtt_cycle_seconds{plc="plc0",quantile="0.99"}')
+
+	awk -v n="$n" -v c0="${c0:-0}" -v c1="${c1:-0}" -v t0="$t0" -v t1="$t1" -v b0="$b0" -v b1="$b1" \
+		-v p50="${p50:-0}" -v p99="${p99:-0}" -v d="$DURATION" -v hz="$CLK_TCK" 'BEGIN {
+		cycles = c1 - c0;
+		cpu = (cycles > 0) ? (t1 - t0) / hz * 1e6 / (cycles * n) : 0;
+		printf "%8d %10.1f %10.2f %10.2f %12.3f %12.0f\n", n, cycles / d, p50 * 1000, p99 * 1000, cpu, (b1 - b0) / d;
+	}'
+
+	kill "$lm" 2>/dev/null
+	wait "$lm" 2>/dev/null
+	kill "$ab" 2>/dev/null
+	wait "$ab" 2>/dev/null
+done
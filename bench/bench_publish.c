@@ -0,0 +1,130 @@
+/* compare single blob, per tag topic and sparkplug publishing: messages and mqtt bytes on the wire per cycle */
+#include "../logix2mqtt.h"
+
+static int64_t wire_msgs = 0;
+static int64_t wire_bytes = 0;
+
+/* mqtt publish packet size at qos 0: fixed header, remaining length, topic and payload */
+static int64_t publish_packet_size(const char *topic, int payloadlen)
+{
+	int64_t rem = 2+strlen(topic)+payloadlen;
+	int64_t len = 1+rem;
+
+	do {
+		len++;
+		rem /= 128;
+	} while (rem > 0);
+	return len;
+}
+
+/* stand in for the broker, counts what would be written to the socket */
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
+{
+	wire_msgs++;
+	wire_bytes += publish_packet_size(topic, payloadlen);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void commit(struct tag_t *tag)
+{
+	memcpy(tag->shadow, tag->data, get_tag_value_size(tag));
+	tag->published = 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *topic = "tele/logix2mqtt/STAT";
+	int num_tags = (argc > 1) ? atoi(argv[1]) : 2000;
+	double pct = (argc > 2) ? atof(argv[2]) : 1.0;
+	int cycles = (argc > 3) ? atoi(argv[3]) : 1000;
+	int changes = (int)(num_tags*pct/100.0);
+	struct tag_t *tags = NULL, **list = NULL;
+	struct payload_t payload = {0};
+	struct batch_t batch = {0};
+	char name[TAG_NAME_MAX_LEN];
+	int64_t start = 0, elapsed = 0;
+	int i = 0, c = 0, mode = 0;
+
+	if (num_tags <= 0 || cycles <= 0) {
+		fprintf(stderr, "usage: %s [tags] [change percent] [cycles]\n", argv[0]);
+		return 1;
+	}
+	tags = my_malloc(sizeof(struct tag_t)*num_tags);
+	list = my_malloc(sizeof(struct tag_t *)*num_tags);
+	for (i = 0; i < num_tags; i++) {
+		snprintf(name, sizeof(name), "Line%d_Motor%d.Current", i/100, i%100);
+		tags[i].name = strdup(name);
+		tags[i].index = i;
+		tags[i].data_type = (i % 2) ? REAL : DINT;
+		tags[i].elem_size = 4;
+		tags[i].elem_count = 1;
+		tags[i].data_size = 4;
+		tags[i].data = my_malloc(4);
+		tags[i].shadow = my_malloc(4);
+		list[i] = &tags[i];
+	}
+	payload_compile(&payload, list, num_tags, PUB_FORMAT_JSON, PUB_KEYS_NAME, 0);
+	batch_compile(&batch, list, num_tags, topic);
+
+	printf("%d tags, %d changes per cycle, %d cycles\n", num_tags, changes, cycles);
+	printf("%-14s %12s %14s %14s %12s\n", "mode", "msgs/cycle", "bytes/cycle", "msgs/s", "us/cycle");
+	for (mode = 0; mode < 4; mode++) {
+		if (mode == 3) {
+			/* sparkplug data messages carry aliases instead of names */
+			payload_compile(&payload, list, num_tags, PUB_FORMAT_SPARKPLUG, PUB_KEYS_NAME, 0);
+		}
+		for (i = 0; i < num_tags; i++) {
+			tags[i].published = 0;
+		}
+		wire_msgs = 0;
+		wire_bytes = 0;
+		start = time_us();
+		for (c = 0; c < cycles; c++) {
+			/* change a rolling window of tags */
+			for (i = 0; i < changes; i++) {
+				(*(int32_t *)tags[(c*changes+i) % num_tags].data)++;
+			}
+			if (mode == 2) {
+				batch_begin(&batch);
+				for (i = 0; i < num_tags; i++) {
+					if (tag_changed(&tags[i])) {
+						batch_add(&batch, &tags[i], PUB_FORMAT_JSON);
+					}
+				}
+				batch_flush(&batch, NULL, 0, 0);
+				for (i = 0; i < batch.count; i++) {
+					commit(batch.msgs[i].tag);
+				}
+			} else {
+				payload_begin(&payload, 1697000000000LL+c);
+				for (i = 0; i < num_tags; i++) {
+					if (mode == 0 || tag_changed(&tags[i])) {
+						payload_add(&payload, &tags[i]);
+						commit(&tags[i]);
+					}
+				}
+				payload_end(&payload);
+				mosquitto_publish(NULL, NULL, topic, payload.len, payload.buf, 0, 0);
+			}
+		}
+		elapsed = time_us()-start;
+		if (elapsed <= 0) {
+			elapsed = 1;
+		}
+		printf("%-14s %12.1f %14.1f %14.0f %12.1f\n", (mode == 0) ? "blob" : (mode == 1) ? "blob changes" : (mode == 2) ? "tag topics" : "sparkplug",
+			(double)wire_msgs/cycles, (double)wire_bytes/cycles, (double)wire_msgs*1000000/elapsed, (double)elapsed/cycles);
+	}
+
+	payload_free(&payload);
+	batch_free(&batch);
+	for (i = 0; i < num_tags; i++) {
+		free(tags[i].name);
+		free(tags[i].topic);
+		free(tags[i].key);
+		free(tags[i].data);
+		free(tags[i].shadow);
+	}
+	free(tags);
+	free(list);
+	return 0;
+}
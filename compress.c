@@ -0,0 +1,254 @@
+#include "logix2mqtt.h"
+
+/* append one sample payload to the growing sample buffer */
+static int add_sample(char **samples, size_t *total, size_t *cap, size_t *sizes, int n, struct payload_t *p)
+{
+	void *tmp = NULL;
+
+	if (*total+p->len > *cap) {
+		tmp = realloc(*samples, 2*(*cap)+p->len);
+		if (tmp == NULL) {
+			return 1;
+		}
+		*samples = tmp;
+		*cap = 2*(*cap)+p->len;
+	}
+	memcpy(*samples+*total, p->buf, p->len);
+	*total += p->len;
+	sizes[n] = p->len;
+	return 0;
+}
+
+/* format sample payloads from the tag set with the values of the initial read
+ * the first samples are full scans, the rest are windows of tags like change only publishes, returns the sample count */
+static int build_samples(struct plc_t *plc, char **samples, size_t *sizes, size_t *full)
+{
+	struct scan_t *scan = NULL;
+	struct payload_t *p = NULL;
+	size_t total = 0, cap = 0;
+	int k = 0, i = 0, n = 0, first = 0, count = 0, window = 0;
+
+	for (i = 0; i < plc->sched.num_scans; i++) {
+		pipe_fill(plc, &plc->sched.scans[i], 0);
+	}
+	for (k = 0; k < DICT_SAMPLES; k++) {
+		scan = &plc->sched.scans[k % plc->sched.num_scans];
+		p = &scan->payload;
+		if (scan->num_tags == 0 || p->buf == NULL) {
+			continue;
+		}
+		if (k < plc->sched.num_scans) {
+			first = 0;
+			count = scan->num_tags;
+		} else {
+			window = (scan->num_tags < 64) ? scan->num_tags : 64;
+			first = (k*131) % scan->num_tags;
+			count = 1 + (k*7) % window;
+		}
+		payload_begin(p, time_ms());
+		for (i = 0; i < count; i++) {
+			if (scan->tags[(first+i) % scan->num_tags]->data != NULL) {
+				payload_add(p, scan->tags[(first+i) % scan->num_tags]);
+			}
+		}
+		payload_end(p);
+		if (add_sample(samples, &total, &cap, sizes, n, p) != 0) {
+			return -1;
+		}
+		n++;
+		if (k < plc->sched.num_scans) {
+			*full = total;
+		}
+	}
+	return n;
+}
+
+/* dictionaries are kept next to the spool file, spooled payloads replayed after a restart need the one they were compressed with */
+static int dict_path(struct plc_t *plc, char *path, size_t size)
+{
+	int rc = 0;
+
+	if (plc->mqtt->spoolfile == NULL) {
+		return 1;
+	}
+	rc = snprintf(path, size, "%s.%s.dict", plc->mqtt->spoolfile, plc->name);
+	return (rc < 0 || (size_t)rc >= size);
+}
+
+/* reuse the dictionary saved by an earlier run, returns 0 when one was loaded */
+static int dict_load(struct plc_t *plc)
+{
+	struct compress_t *c = &plc->compress;
+	char path[PATH_MAX];
+	struct stat st;
+	FILE *f = NULL;
+
+	if (dict_path(plc, path, sizeof(path)) != 0) {
+		return 1;
+	}
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		return 1;
+	}
+	if (fstat(fileno(f), &st) != 0 || st.st_size <= 0 || st.st_size > INT_MAX) {
+		fprintf(stderr, "%s: Ignoring invalid compression dictionary %s\n", plc->name, path);
+		fclose(f);
+		return 1;
+	}
+	c->dict = my_malloc(st.st_size);
+	if (c->dict == NULL || fread(c->dict, 1, st.st_size, f) != (size_t)st.st_size) {
+		fprintf(stderr, "%s: Failed to read compression dictionary %s\n", plc->name, path);
+		free(c->dict);
+		c->dict = NULL;
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+	c->dict_len = st.st_size;
+	c->dict_id = ZDICT_getDictID(c->dict, c->dict_len);
+	return 0;
+}
+
+/* write a freshly trained dictionary through a temporary file so a crash never leaves half of one behind */
+static void dict_save(struct plc_t *plc)
+{
+	struct compress_t *c = &plc->compress;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f = NULL;
+	int rc = 0;
+
+	if (dict_path(plc, path, sizeof(path)) != 0) {
+		return;
+	}
+	rc = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (rc < 0 || (size_t)rc >= sizeof(tmp)) {
+		return;
+	}
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "%s: Failed to save compression dictionary [%d]: %s\n", plc->name, errno, strerror(errno));
+		return;
+	}
+	rc = (fwrite(c->dict, 1, c->dict_len, f) != c->dict_len || fflush(f) != 0 || fsync(fileno(f)) != 0);
+	rc |= (fclose(f) != 0);
+	if (rc != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "%s: Failed to save compression dictionary [%d]: %s\n", plc->name, errno, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/* train the controller's dictionary once its payloads are compiled, a tag set keeps its dictionary across controller reconnects
+ * when there is too little sample data to train, the tail of the full scans is used as a raw content dictionary
+ * with a spool a saved dictionary is reused across restarts instead, a changed tag set only costs compression ratio */
+int compress_train(struct plc_t *plc)
+{
+	struct compress_t *c = &plc->compress;
+	struct mqtt_t *mqtt = plc->mqtt;
+	char *samples = NULL;
+	size_t sizes[DICT_SAMPLES];
+	size_t full = 0, len = 0, max = 0;
+	int64_t start = 0;
+	int i = 0, n = 0;
+
+	if (!mqtt->compress || c->cdict != NULL || plc->sched.num_scans == 0) {
+		return 0;
+	}
+	start = mono_ms();
+	if (dict_load(plc) == 0) {
+		fprintf(stderr, "%s: Reusing %zu byte compression dictionary %u\n", plc->name, c->dict_len, c->dict_id);
+	} else {
+		n = build_samples(plc, &samples, sizes, &full);
+		if (n == 0) {
+			/* nothing publishable in this tag set */
+			free(samples);
+			return 0;
+		}
+		c->dict = my_malloc(mqtt->dictsize);
+		if (n < 0 || c->dict == NULL) {
+			fprintf(stderr, "%s: Failed to allocate memory for compression samples\n", plc->name);
+			free(samples);
+			return 1;
+		}
+
+		len = ZDICT_trainFromBuffer(c->dict, mqtt->dictsize, samples, sizes, n);
+		if (ZDICT_isError(len)) {
+			fprintf(stderr, "%s: Dictionary training failed (%s), using raw scan payloads\n", plc->name, ZDICT_getErrorName(len));
+			len = (full < (size_t)mqtt->dictsize) ? full : (size_t)mqtt->dictsize;
+			memcpy(c->dict, samples+full-len, len);
+			c->dict_id = 0;
+		} else {
+			c->dict_id = ZDICT_getDictID(c->dict, len);
+		}
+		free(samples);
+		c->dict_len = len;
+		dict_save(plc);
+		fprintf(stderr, "%s: Trained %zu byte compression dictionary %u from %d samples in %lld ms\n",
+			plc->name, c->dict_len, c->dict_id, n, (long long)(mono_ms()-start));
+	}
+
+	for (i = 0; i < plc->sched.num_scans; i++) {
+		if (plc->sched.scans[i].payload.size > max) {
+			max = plc->sched.scans[i].payload.size;
+		}
+	}
+	c->cdict = ZSTD_createCDict(c->dict, c->dict_len, mqtt->compresslevel);
+	if (c->cctx == NULL) {
+		c->cctx = ZSTD_createCCtx();
+	}
+	c->size = ZSTD_compressBound(max);
+	c->buf = my_malloc(c->size);
+	if (c->cdict == NULL || c->cctx == NULL || c->buf == NULL) {
+		fprintf(stderr, "%s: Failed to set up payload compression\n", plc->name);
+		compress_free(c);
+		return 1;
+	}
+	/* a new dictionary goes out before the next payload */
+	c->sent = -1;
+	return 0;
+}
+
+/* publish the dictionary retained on the metadata topic, subscribers need it before the first compressed payload */
+int compress_publish_dict(struct plc_t *plc)
+{
+	struct compress_t *c = &plc->compress;
+	char topic[512];
+	int rc = 0;
+
+	snprintf(topic, sizeof(topic), "%s/%s", plc->mqtt->dicttopic, plc->name);
+	rc = mosquitto_publish(plc->mosq, NULL, topic, (int)c->dict_len, c->dict, 1, true);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "%s: Error publishing compression dictionary: %s\n", plc->name, mosquitto_strerror(rc));
+	}
+	return rc;
+}
+
+/* compress a formatted payload into the preallocated buffer with the reused context, returns 0 on failure */
+size_t compress_payload(struct plc_t *plc, const void *src, size_t len)
+{
+	struct compress_t *c = &plc->compress;
+	int64_t start = time_us();
+	size_t n = 0;
+
+	n = ZSTD_compress_usingCDict(c->cctx, c->buf, c->size, src, len, c->cdict);
+	hist_record(&plc->metrics.compress, time_us()-start);
+	if (ZSTD_isError(n)) {
+		fprintf(stderr, "%s: Payload compression failed: %s\n", plc->name, ZSTD_getErrorName(n));
+		return 0;
+	}
+	metrics_add(&plc->metrics.raw_bytes, len);
+	metrics_add(&plc->metrics.compressed_bytes, n);
+	return n;
+}
+
+void compress_free(struct compress_t *c)
+{
+	if (c->cdict != NULL) {
+		ZSTD_freeCDict(c->cdict);
+	}
+	if (c->cctx != NULL) {
+		ZSTD_freeCCtx(c->cctx);
+	}
+	free(c->dict);
+	free(c->buf);
+	memset(c, 0, sizeof(struct compress_t));
+}
@@ -1,72 +1,673 @@
 #include "logix2mqtt.h"
+#include <sys/mman.h>
+#include <fcntl.h>
 
-struct tag_t *read_conf_file(const char *fn, struct mqtt_t *mqtt, struct plc_t *plc, int *num_tags)
+struct elem_ref_t {
+	struct tag_t *tag;
+	int base_len;
+	long index;
+};
+
+/* split an array element name like base[12] into base length and index */
+static int parse_elem_name(const char *name, int *base_len, long *index)
+{
+	const char *open = strrchr(name, '[');
+	const char *p = NULL;
+	char *end = NULL;
+
+	if (open == NULL || open == name) {
+		return 0;
+	}
+	for (p = open+1; *p != ']'; p++) {
+		if (!isdigit((unsigned char)*p)) {
+			return 0;
+		}
+	}
+	if (p == open+1 || *(p+1) != '\0') {
+		return 0;
+	}
+	*index = strtol(open+1, &end, 10);
+	*base_len = open-name;
+	return 1;
+}
+
+static int compare_elem_ref(const void *a, const void *b)
+{
+	const struct elem_ref_t *x = (const struct elem_ref_t *)a;
+	const struct elem_ref_t *y = (const struct elem_ref_t *)b;
+	int rc = 0;
+
+	if (x->base_len != y->base_len) {
+		return x->base_len-y->base_len;
+	}
+	rc = strncmp(x->tag->name, y->tag->name, x->base_len);
+	if (rc != 0) {
+		return rc;
+	}
+	if (x->tag->data_type != y->tag->data_type) {
+		return (int)x->tag->data_type-(int)y->tag->data_type;
+	}
+	if (x->tag->scan != y->tag->scan) {
+		return (x->tag->scan > y->tag->scan) - (x->tag->scan < y->tag->scan);
+	}
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+/* merge nearby elements of the same array and type into one bulk read, returns number of bulk reads */
+int coalesce_tags(struct tag_t *tags, int num_tags)
+{
+	struct elem_ref_t *refs = NULL;
+	struct tag_t *leader = NULL;
+	int i = 0, j = 0, k = 0, n = 0, groups = 0;
+	long first = 0;
+
+	if (tags == NULL || num_tags < 2) {
+		return 0;
+	}
+	refs = my_malloc(sizeof(struct elem_ref_t)*num_tags);
+	if (refs == NULL) {
+		fprintf(stderr, "Failed to allocate memory for tag coalescing\n");
+		return 0;
+	}
+
+	/* collect single dimension array elements of whole element types */
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i].name == NULL || tags[i].parent != NULL || tags[i].expr != NULL) {
+			continue;
+		}
+		switch (tags[i].data_type) {
+		case LINT:
+		case DINT:
+		case INT:
+		case SINT:
+		case REAL:
+		case STRING:
+			if (parse_elem_name(tags[i].name, &refs[n].base_len, &refs[n].index)) {
+				refs[n].tag = &tags[i];
+				n++;
+			}
+			break;
+		default:
+			/* bool arrays are packed bits, leave them alone */
+			break;
+		}
+	}
+	qsort(refs, n, sizeof(struct elem_ref_t), compare_elem_ref);
+
+	/* walk sorted runs and attach followers to the lowest element */
+	for (i = 0; i < n; i = j) {
+		first = refs[i].index;
+		for (j = i+1; j < n; j++) {
+			if (refs[j].base_len != refs[i].base_len || strncmp(refs[j].tag->name, refs[i].tag->name, refs[i].base_len) != 0 ||
+			    refs[j].tag->data_type != refs[i].tag->data_type || refs[j].tag->scan != refs[i].tag->scan || refs[j].tag->sample != refs[i].tag->sample ||
+			    refs[j].tag->aggregate != refs[i].tag->aggregate ||
+			    refs[j].index-refs[j-1].index > TAG_COALESCE_GAP) {
+				break;
+			}
+		}
+		if (j-i < 2) {
+			continue;
+		}
+		leader = refs[i].tag;
+		leader->elem_count = refs[j-1].index-first+1;
+		leader->elem_index = 0;
+		for (k = i+1; k < j; k++) {
+			refs[k].tag->parent = leader;
+			refs[k].tag->elem_index = refs[k].index-first;
+		}
+		groups++;
+	}
+
+	free(refs);
+	return groups;
+}
+
+/* control word bits count from bit 0 of the DINT at offset 0 */
+static struct field_t timer_fields[] = {
+	{"EN", BIT, 0, 31},
+	{"TT", BIT, 0, 30},
+	{"DN", BIT, 0, 29},
+	{"PRE", DINT, 4, 0},
+	{"ACC", DINT, 8, 0},
+};
+
+static struct field_t counter_fields[] = {
+	{"CU", BIT, 0, 31},
+	{"CD", BIT, 0, 30},
+	{"DN", BIT, 0, 29},
+	{"OV", BIT, 0, 28},
+	{"UN", BIT, 0, 27},
+	{"PRE", DINT, 4, 0},
+	{"ACC", DINT, 8, 0},
+};
+
+static struct schema_t builtin_schemas[] = {
+	{"timer", 12, timer_fields, sizeof(timer_fields)/sizeof(struct field_t), NULL},
+	{"counter", 12, counter_fields, sizeof(counter_fields)/sizeof(struct field_t), NULL},
+};
+
+/* layout of the structures every controller knows */
+struct schema_t *schema_builtin(const char *type)
+{
+	size_t i = 0;
+
+	for (i = 0; i < sizeof(builtin_schemas)/sizeof(struct schema_t); i++) {
+		if (strcmp(builtin_schemas[i].name, type) == 0) {
+			return &builtin_schemas[i];
+		}
+	}
+	return NULL;
+}
+
+void schema_free(struct schema_t *s)
+{
+	if (s == NULL) {
+		return;
+	}
+	free(s->name);
+	free(s->fields);
+	free(s->names);
+	memset(s, 0, sizeof(struct schema_t));
+}
+
+/* parse the schemas object, each schema is an array of [name, type, offset] or [name, "bit", offset, bit] */
+static struct schema_t *parse_schemas(cJSON *node, int *num_schemas)
+{
+	struct schema_t *schemas = NULL, *sc = NULL;
+	cJSON *schema = NULL, *field = NULL, *name = NULL, *type = NULL, *offset = NULL, *bit = NULL;
+	size_t arena = 0, used = 0, len = 0;
+	int n = 0;
+
+	*num_schemas = 0;
+	if (node == NULL) {
+		return NULL;
+	}
+	if (!cJSON_IsObject(node) || cJSON_GetArraySize(node) == 0) {
+		fprintf(stderr, "Schemas is not an object in config\n");
+		return NULL;
+	}
+	schemas = my_malloc(sizeof(struct schema_t)*cJSON_GetArraySize(node));
+	if (schemas == NULL) {
+		fprintf(stderr, "Failed to allocate memory for schemas\n");
+		return NULL;
+	}
+	cJSON_ArrayForEach(schema, node) {
+		if (!cJSON_IsArray(schema) || cJSON_GetArraySize(schema) == 0) {
+			fprintf(stderr, "Schema %s has no fields\n", schema->string);
+			continue;
+		}
+		sc = &schemas[n];
+		arena = 0;
+		cJSON_ArrayForEach(field, schema) {
+			if (cJSON_IsArray(field) && field->child != NULL && cJSON_IsString(field->child)) {
+				arena += strlen(field->child->valuestring)+1;
+			}
+		}
+		sc->name = strdup(schema->string);
+		sc->fields = my_malloc(sizeof(struct field_t)*cJSON_GetArraySize(schema));
+		sc->names = malloc(arena+1);
+		if (sc->name == NULL || sc->fields == NULL || sc->names == NULL) {
+			fprintf(stderr, "Failed to allocate memory for schema %s\n", schema->string);
+			schema_free(sc);
+			continue;
+		}
+		used = 0;
+		cJSON_ArrayForEach(field, schema) {
+			name = cJSON_IsArray(field) ? field->child : NULL;
+			type = (name != NULL) ? name->next : NULL;
+			offset = (type != NULL) ? type->next : NULL;
+			bit = (offset != NULL) ? offset->next : NULL;
+			if (name == NULL || !cJSON_IsString(name) || type == NULL || !cJSON_IsString(type) || offset == NULL || !cJSON_IsNumber(offset) || offset->valueint < 0) {
+				fprintf(stderr, "Schema %s: skipping invalid field\n", sc->name);
+				continue;
+			}
+			len = strlen(name->valuestring);
+			memcpy(sc->names+used, name->valuestring, len+1);
+			sc->fields[sc->num_fields].name = sc->names+used;
+			used += len+1;
+			sc->fields[sc->num_fields].type = get_plc_data_type(type->valuestring);
+			sc->fields[sc->num_fields].offset = offset->valueint;
+			/* only bit fields carry a bit number, other types sit at their byte offset */
+			if (sc->fields[sc->num_fields].type == BIT && bit != NULL && cJSON_IsNumber(bit) && bit->valueint >= 0) {
+				sc->fields[sc->num_fields].bit = bit->valueint;
+			}
+			if (sc->fields[sc->num_fields].type == UNKNOWN || sc->fields[sc->num_fields].type == STRUCT) {
+				fprintf(stderr, "Schema %s: field %s has an unsupported type\n", sc->name, name->valuestring);
+				continue;
+			}
+			sc->num_fields++;
+		}
+		n++;
+	}
+	*num_schemas = n;
+	return schemas;
+}
+
+/* field layout of a structure tag, built in types first and then config schemas, NULL when it comes from the controller
+ * tags are looked up once to size the arrays and again to fill them, only the second pass warns */
+static struct schema_t *tag_schema(cJSON *type, cJSON *opts, struct schema_t *schemas, int num_schemas, int warn)
+{
+	cJSON *opt = NULL;
+	int i = 0;
+
+	if (get_plc_data_type(type->valuestring) != STRUCT) {
+		return NULL;
+	}
+	if (schema_builtin(type->valuestring) != NULL) {
+		return schema_builtin(type->valuestring);
+	}
+	opt = (opts != NULL && cJSON_IsObject(opts)) ? cJSON_GetObjectItemCaseSensitive(opts, "schema") : NULL;
+	if (opt == NULL || !cJSON_IsString(opt)) {
+		return NULL;
+	}
+	for (i = 0; i < num_schemas; i++) {
+		if (strcmp(schemas[i].name, opt->valuestring) == 0) {
+			return &schemas[i];
+		}
+	}
+	if (warn) {
+		fprintf(stderr, "Unknown schema '%s', fields will come from the controller template\n", opt->valuestring);
+	}
+	return NULL;
+}
+
+/* turn a structure's fields into tags starting at first that view the structure's raw read, returns the number added */
+int expand_fields(struct tag_t *tags, int leader, int first, struct schema_t *sc, char *names, size_t *used)
+{
+	struct tag_t *tag = NULL;
+	size_t len = strlen(tags[leader].name), flen = 0;
+	int i = 0;
+
+	for (i = 0; i < sc->num_fields; i++) {
+		tag = &tags[first+i];
+		flen = strlen(sc->fields[i].name);
+		tag->name = names+*used;
+		memcpy(tag->name, tags[leader].name, len);
+		tag->name[len] = '.';
+		memcpy(tag->name+len+1, sc->fields[i].name, flen+1);
+		*used += len+1+flen+1;
+		tag->data_type = sc->fields[i].type;
+		tag->parent = &tags[leader];
+		tag->field = 1;
+		tag->field_offset = sc->fields[i].offset;
+		/* bits are kept as a byte offset and a bit within that byte */
+		if (sc->fields[i].type == BIT) {
+			tag->field_offset += sc->fields[i].bit/8;
+			tag->bit = sc->fields[i].bit % 8;
+		}
+		tag->scan = tags[leader].scan;
+		tag->sample = tags[leader].sample;
+		tag->aggregate = tags[leader].aggregate;
+		tag->hidden = tags[leader].hidden;
+	}
+	tags[leader].num_fields = sc->num_fields;
+	return sc->num_fields;
+}
+
+/* arena bytes needed for a structure's field names */
+size_t fields_name_len(const char *leader, struct schema_t *sc)
+{
+	size_t len = 0;
+	int i = 0;
+
+	for (i = 0; i < sc->num_fields; i++) {
+		len += strlen(leader)+1+strlen(sc->fields[i].name)+1;
+	}
+	return len;
+}
+
+/* validate a tag entry, returns the name length or 0 when the entry is skipped */
+static size_t tag_entry_name_len(cJSON *entry, cJSON **name, cJSON **type)
+{
+	size_t len = 0;
+
+	if (!cJSON_IsArray(entry)) {
+		return 0;
+	}
+	*name = entry->child;
+	*type = (*name != NULL) ? (*name)->next : NULL;
+	if (*name == NULL || !cJSON_IsString(*name) || *type == NULL || !cJSON_IsString(*type)) {
+		return 0;
+	}
+	len = strlen((*name)->valuestring);
+	if (len == 0 || len >= TAG_NAME_MAX_LEN-1) {
+		return 0;
+	}
+	return len;
+}
+
+/* parse tag array entries into one contiguous tag array, names share a single string arena
+ * structure tags are followed by one tag per field */
+static struct tag_t *parse_tags(cJSON *node, int *num_tags, char **names, struct schema_t *schemas, int num_schemas)
 {
 	struct tag_t *tags = NULL;
-	struct stat s = {0};
-	FILE *fd = NULL;
-	char *buf = NULL;
-	size_t bytes_read = 0;
-	cJSON *json = NULL, *node = NULL, *key = NULL, *val0 = NULL, *val1 = NULL;
-	int ix = 0;
+	struct schema_t *sc = NULL;
+	cJSON *key = NULL, *val0 = NULL, *val1 = NULL, *opts = NULL, *opt = NULL;
+	size_t arena = 0, len = 0, used = 0;
+	int ix = 0, count = 0;
 
-	/* parameter check */
-	if (mqtt == NULL || plc == NULL || num_tags == NULL) {
-		fprintf(stderr, "Invalid parameters passed to read_conf_file\n");
+	*num_tags = 0;
+	*names = NULL;
+	if (node == NULL) {
+		fprintf(stderr, "Failed to find 'tags' array in config\n");
 		return NULL;
 	}
-	if (strlen(fn) == 0) {
-		fprintf(stderr, "Config filename is empty\n");
+	if (!cJSON_IsArray(node)) {
+		fprintf(stderr, "Tags is not an array in config\n");
 		return NULL;
 	}
 
-	/* stat file for size */
-	if (stat(fn, &s) != 0) {
-		fprintf(stderr, "Failed to stat config file [%d]: %s\n", errno, strerror(errno));
+	/* size the tag array and name arena */
+	cJSON_ArrayForEach(key, node) {
+		len = tag_entry_name_len(key, &val0, &val1);
+		if (len > 0) {
+			arena += len+1;
+			count++;
+			sc = tag_schema(val1, val1->next, schemas, num_schemas, 0);
+			if (sc != NULL) {
+				arena += fields_name_len(val0->valuestring, sc);
+				count += sc->num_fields;
+			}
+		}
+	}
+	if (count == 0) {
+		fprintf(stderr, "No tags have been defined\n");
 		return NULL;
 	}
-	if (s.st_size == 0) {
-		fprintf(stderr, "Config file is zero length\n");
+	tags = my_malloc(sizeof(struct tag_t)*count);
+	*names = malloc(arena);
+	if (tags == NULL || *names == NULL) {
+		fprintf(stderr, "Failed to allocate memory for tags\n");
+		free(tags);
+		free(*names);
+		*names = NULL;
+		return NULL;
+	}
+
+	cJSON_ArrayForEach(key, node) {
+		len = tag_entry_name_len(key, &val0, &val1);
+		if (len == 0) {
+			continue;
+		}
+		tags[ix].name = *names+used;
+		memcpy(tags[ix].name, val0->valuestring, len+1);
+		used += len+1;
+		tags[ix].data_type = get_plc_data_type(val1->valuestring);
+		/* optional per tag settings */
+		opts = val1->next;
+		if (opts != NULL && cJSON_IsObject(opts)) {
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "deadband");
+			if (opt != NULL && cJSON_IsNumber(opt)) {
+				tags[ix].deadband = opt->valuedouble;
+			}
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "deadband_pct");
+			if (opt != NULL && cJSON_IsNumber(opt)) {
+				tags[ix].deadband_pct = opt->valuedouble;
+			}
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "scan");
+			if (opt != NULL && cJSON_IsNumber(opt) && opt->valueint > 0) {
+				tags[ix].scan = opt->valueint;
+			}
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "timeout");
+			if (opt != NULL && cJSON_IsNumber(opt) && opt->valueint > 0) {
+				tags[ix].timeout = opt->valueint;
+			}
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "sample");
+			if (opt != NULL && cJSON_IsNumber(opt) && opt->valueint > 0) {
+				tags[ix].sample = opt->valueint;
+			}
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "aggregate");
+			if (opt != NULL && cJSON_IsNumber(opt) && opt->valueint > 0) {
+				tags[ix].aggregate = opt->valueint;
+			}
+			/* derived tags are computed from other tags instead of being read */
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "expr");
+			if (opt != NULL && cJSON_IsString(opt) && strlen(opt->valuestring) > 0) {
+				tags[ix].expr = strdup(opt->valuestring);
+			}
+			/* inputs of derived tags can be read without being published */
+			opt = cJSON_GetObjectItemCaseSensitive(opts, "publish");
+			if (opt != NULL && cJSON_IsBool(opt)) {
+				tags[ix].hidden = cJSON_IsFalse(opt);
+			}
+		}
+		sc = tag_schema(val1, opts, schemas, num_schemas, 1);
+		if (sc != NULL) {
+			ix += expand_fields(tags, ix, ix+1, sc, *names, &used);
+		}
+		ix++;
+	}
+	*num_tags = ix;
+	return tags;
+}
+
+/* copy an array of pattern strings */
+static char **parse_patterns(cJSON *node, int *count)
+{
+	cJSON *item = NULL;
+	char **list = NULL;
+	int n = 0;
+
+	*count = 0;
+	if (node == NULL || !cJSON_IsArray(node) || cJSON_GetArraySize(node) == 0) {
 		return NULL;
 	}
-	if (s.st_size > CONFIG_MAX_LENGTH-1) {
-		fprintf(stderr, "Config file is greater than %d bytes\n", CONFIG_MAX_LENGTH);
+	list = my_malloc(sizeof(char *)*cJSON_GetArraySize(node));
+	if (list == NULL) {
 		return NULL;
 	}
+	cJSON_ArrayForEach(item, node) {
+		if (cJSON_IsString(item) && strlen(item->valuestring) > 0) {
+			list[n++] = strdup(item->valuestring);
+		}
+	}
+	*count = n;
+	return list;
+}
+
+/* parse symbol table discovery, true discovers everything */
+static void parse_discover(cJSON *node, struct discover_t *d)
+{
+	cJSON *key = NULL;
+
+	d->max_elems = DISCOVER_ELEMS_DEFAULT;
+	d->programs = 1;
+	if (cJSON_IsBool(node)) {
+		d->enabled = (cJSON_IsTrue(node) ? 1 : 0);
+		return;
+	}
+	if (!cJSON_IsObject(node)) {
+		fprintf(stderr, "Discover is not an object in config\n");
+		return;
+	}
+	d->enabled = 1;
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "include");
+	d->include = parse_patterns(key, &d->num_include);
 
-	/* allocate memory for buffer */
-	buf = my_malloc(s.st_size);
-	if (buf == NULL) {
-		fprintf(stderr, "Failed to allocate memory for config buffer\n");
+	key = cJSON_GetObjectItemCaseSensitive(node, "exclude");
+	d->exclude = parse_patterns(key, &d->num_exclude);
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "match");
+	if (key != NULL && cJSON_IsString(key)) {
+		d->regex = (strcmp(key->valuestring, "regex") == 0) ? 1 : 0;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "programs");
+	if (key != NULL && cJSON_IsBool(key)) {
+		d->programs = (cJSON_IsTrue(key) ? 1 : 0);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "max_elements");
+	if (key != NULL && cJSON_IsNumber(key) && key->valueint > 0) {
+		d->max_elems = key->valueint;
+	}
+}
+
+/* parse one controller object and its tags */
+static int parse_plc(cJSON *node, cJSON *tags, struct schema_t *schemas, int num_schemas, struct plc_t *plc)
+{
+	cJSON *key = NULL;
+
+	if (!cJSON_IsObject(node)) {
+		fprintf(stderr, "Controller entry is not an object in config\n");
+		return 1;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "name");
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		plc->name = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "gateway");
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		plc->gateway = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "path");
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		plc->path = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "pub_topic");
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		plc->pubtopic = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "timeout");
+	if (key != NULL && cJSON_IsNumber(key)) {
+		plc->timeout = key->valueint;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "interval");
+	if (key != NULL && cJSON_IsNumber(key)) {
+		plc->interval = key->valueint;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "coalesce");
+	plc->coalesce = 1;
+	if (key != NULL && cJSON_IsBool(key)) {
+		plc->coalesce = (cJSON_IsTrue(key) ? 1 : 0);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "catch_up");
+	if (key != NULL && cJSON_IsString(key)) {
+		plc->catchup = (strcmp(key->valuestring, "immediate") == 0) ? CATCHUP_IMMEDIATE : CATCHUP_SKIP;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "discover");
+	if (key != NULL) {
+		parse_discover(key, &plc->discover);
+	}
+
+	/* tags are optional when they are discovered */
+	if (tags == NULL && plc->discover.enabled) {
+		return 0;
+	}
+
+	/* parse tag array */
+	plc->tags = parse_tags(tags, &plc->num_tags, &plc->names, schemas, num_schemas);
+	if (plc->tags == NULL) {
+		return 1;
+	}
+
+	/* merge array elements into bulk reads, discovery coalesces once the tag set is complete */
+	if (plc->coalesce && !plc->discover.enabled) {
+		coalesce_tags(plc->tags, plc->num_tags);
+	}
+	return 0;
+}
+
+/* free what parsing a controller allocated, plc_free releases the runtime state first */
+void config_free(struct plc_t *plc)
+{
+	int i = 0;
+
+	if (plc->tags != NULL) {
+		for (i = 0; i < plc->num_tags; i++) {
+			free(plc->tags[i].expr);
+		}
+		free(plc->tags);
+		plc->tags = NULL;
+	}
+	if (plc->names != NULL) {
+		free(plc->names);
+		plc->names = NULL;
+	}
+	if (plc->name != NULL) {
+		free(plc->name);
+		plc->name = NULL;
+	}
+	if (plc->gateway != NULL) {
+		free(plc->gateway);
+		plc->gateway = NULL;
+	}
+	if (plc->path != NULL) {
+		free(plc->path);
+		plc->path = NULL;
+	}
+	if (plc->pubtopic != NULL) {
+		free(plc->pubtopic);
+		plc->pubtopic = NULL;
+	}
+	discover_free(&plc->discover);
+}
+
+struct plc_t *read_conf_file(const char *fn, struct mqtt_t *mqtt, int *num_plcs)
+{
+	struct plc_t *plcs = NULL;
+	struct schema_t *schemas = NULL;
+	struct stat s = {0};
+	int fd = -1;
+	char *buf = NULL;
+	cJSON *json = NULL, *node = NULL, *key = NULL;
+	int ix = 0, i = 0, num_schemas = 0;
+
+	/* parameter check */
+	if (mqtt == NULL || num_plcs == NULL) {
+		fprintf(stderr, "Invalid parameters passed to read_conf_file\n");
+		return NULL;
+	}
+	if (strlen(fn) == 0) {
+		fprintf(stderr, "Config filename is empty\n");
 		return NULL;
 	}
 
 	/* open file */
-	fd = fopen(fn, "r");
-	if (fd == NULL) {
-		fprintf(stderr, "Failed to open config file\n");
-		free(buf);
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open config file [%d]: %s\n", errno, strerror(errno));
 		return NULL;
 	}
 
-	/* read file into buffer */
-	bytes_read = fread(buf, 1, s.st_size, fd);
-	if (bytes_read != s.st_size) {
-		fprintf(stderr, "Error reading config file\n");
-		free(buf);
-		fclose(fd);
+	/* stat file for size */
+	if (fstat(fd, &s) != 0) {
+		fprintf(stderr, "Failed to stat config file [%d]: %s\n", errno, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (s.st_size == 0) {
+		fprintf(stderr, "Config file is zero length\n");
+		close(fd);
 		return NULL;
 	}
 
-	/* close file */
-	fclose(fd);
-	fd = NULL;
+	/* map file instead of copying it, any size is accepted */
+	buf = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	fd = -1;
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "Failed to map config file [%d]: %s\n", errno, strerror(errno));
+		return NULL;
+	}
+	madvise(buf, s.st_size, MADV_SEQUENTIAL);
 
-	/* parse json */
-	json = cJSON_Parse(buf);
+	/* parse json, strings are copied so the mapping can go right away */
+	json = cJSON_ParseWithLength(buf, s.st_size);
+	munmap(buf, s.st_size);
+	buf = NULL;
 	if (json == NULL) {
 		fprintf(stderr, "Failed to parse json in config file\n");
-		free(buf);
 		return NULL;
 	}
 
@@ -75,7 +676,6 @@ struct tag_t *read_conf_file(const char *fn, struct mqtt_t *mqtt, struct plc_t *
 	if (node == NULL) {
 		fprintf(stderr, "Failed to find 'mqtt' object in config\n");
 		cJSON_Delete(json);
-		free(buf);
 		return NULL;
 	}
 
@@ -135,98 +735,213 @@ struct tag_t *read_conf_file(const char *fn, struct mqtt_t *mqtt, struct plc_t *
 		mqtt->pubretain = (cJSON_IsTrue(key) ? 1 : 0);
 	}
 
-	/* parse logix object */
-	node = cJSON_GetObjectItemCaseSensitive(json, "logix");
-	if (node == NULL) {
-		fprintf(stderr, "Failed to find 'logix' object in config\n");
-		cJSON_Delete(json);
-		free(buf);
-		return NULL;
+	key = cJSON_GetObjectItemCaseSensitive(node, "pub_changes");
+	if (key != NULL && cJSON_IsBool(key)) {
+		mqtt->pubchanges = (cJSON_IsTrue(key) ? 1 : 0);
 	}
 
-	key = cJSON_GetObjectItemCaseSensitive(node, "gateway");
-	if (plc->gateway != NULL) {
-		free(plc->gateway);
-		plc->gateway = NULL;
+	key = cJSON_GetObjectItemCaseSensitive(node, "integrity");
+	if (key != NULL && cJSON_IsNumber(key)) {
+		mqtt->integrity = key->valueint;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "pub_format");
+	if (key != NULL && cJSON_IsString(key)) {
+		mqtt->pubformat = get_pub_format(key->valuestring);
+		if (strcmp(key->valuestring, get_pub_format_str(mqtt->pubformat)) != 0) {
+			fprintf(stderr, "Unknown publish format '%s', using json\n", key->valuestring);
+		}
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "spool_file");
+	if (mqtt->spoolfile != NULL) {
+		free(mqtt->spoolfile);
+		mqtt->spoolfile = NULL;
 	}
 	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
-		plc->gateway = strdup(key->valuestring);
+		mqtt->spoolfile = strdup(key->valuestring);
 	}
 
-	key = cJSON_GetObjectItemCaseSensitive(node, "path");
-	if (plc->path != NULL) {
-		free(plc->path);
-		plc->path = NULL;
+	key = cJSON_GetObjectItemCaseSensitive(node, "spool_size");
+	if (key != NULL && cJSON_IsNumber(key)) {
+		mqtt->spoolsize = key->valueint;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "replay_rate");
+	if (key != NULL && cJSON_IsNumber(key)) {
+		mqtt->replayrate = key->valueint;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "stats_topic");
+	if (mqtt->statstopic != NULL) {
+		free(mqtt->statstopic);
+		mqtt->statstopic = NULL;
 	}
 	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
-		plc->path = strdup(key->valuestring);
+		mqtt->statstopic = strdup(key->valuestring);
 	}
 
-	key = cJSON_GetObjectItemCaseSensitive(node, "timeout");
+	key = cJSON_GetObjectItemCaseSensitive(node, "stats_interval");
 	if (key != NULL && cJSON_IsNumber(key)) {
-		plc->timeout = key->valueint;
+		mqtt->statsinterval = key->valueint;
 	}
 
-	key = cJSON_GetObjectItemCaseSensitive(node, "interval");
+	key = cJSON_GetObjectItemCaseSensitive(node, "metrics_listen");
+	if (mqtt->metricslisten != NULL) {
+		free(mqtt->metricslisten);
+		mqtt->metricslisten = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->metricslisten = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "cmd_topic");
+	if (mqtt->cmdtopic != NULL) {
+		free(mqtt->cmdtopic);
+		mqtt->cmdtopic = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->cmdtopic = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "reply_topic");
+	if (mqtt->replytopic != NULL) {
+		free(mqtt->replytopic);
+		mqtt->replytopic = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->replytopic = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "sp_group");
+	if (mqtt->spgroup != NULL) {
+		free(mqtt->spgroup);
+		mqtt->spgroup = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->spgroup = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "sp_node");
+	if (mqtt->spnode != NULL) {
+		free(mqtt->spnode);
+		mqtt->spnode = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->spnode = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "compress");
+	if (key != NULL && cJSON_IsBool(key)) {
+		mqtt->compress = (cJSON_IsTrue(key) ? 1 : 0);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "compress_level");
 	if (key != NULL && cJSON_IsNumber(key)) {
-		plc->interval = key->valueint;
+		mqtt->compresslevel = key->valueint;
 	}
 
-	/* parse tag array */
-	node = cJSON_GetObjectItemCaseSensitive(json, "tags");
+	key = cJSON_GetObjectItemCaseSensitive(node, "dict_size");
+	if (key != NULL && cJSON_IsNumber(key)) {
+		mqtt->dictsize = key->valueint;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "dict_topic");
+	if (mqtt->dicttopic != NULL) {
+		free(mqtt->dicttopic);
+		mqtt->dicttopic = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->dicttopic = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "agg_topic");
+	if (mqtt->aggtopic != NULL) {
+		free(mqtt->aggtopic);
+		mqtt->aggtopic = NULL;
+	}
+	if (key != NULL && cJSON_IsString(key) && strlen(key->valuestring) > 0) {
+		mqtt->aggtopic = strdup(key->valuestring);
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "pub_mode");
+	if (key != NULL && cJSON_IsString(key)) {
+		mqtt->pubmode = (strcmp(key->valuestring, "tag") == 0) ? PUB_MODE_TAG : PUB_MODE_BLOB;
+	}
+
+	key = cJSON_GetObjectItemCaseSensitive(node, "pub_keys");
+	if (key != NULL && cJSON_IsString(key)) {
+		mqtt->pubkeys = (strcmp(key->valuestring, "index") == 0) ? PUB_KEYS_INDEX : PUB_KEYS_NAME;
+	}
+
+	/* parse logix object or array of controllers */
+	node = cJSON_GetObjectItemCaseSensitive(json, "logix");
 	if (node == NULL) {
-		fprintf(stderr, "Failed to find 'tags' array in config\n");
+		fprintf(stderr, "Failed to find 'logix' object in config\n");
 		cJSON_Delete(json);
-		free(buf);
 		return NULL;
 	}
-	if (!cJSON_IsArray(node)) {
-		fprintf(stderr, "Tags is not an array in config\n");
+	*num_plcs = cJSON_IsArray(node) ? cJSON_GetArraySize(node) : 1;
+	if (*num_plcs <= 0) {
+		fprintf(stderr, "No controllers defined in 'logix' array\n");
+		cJSON_Delete(json);
+		return NULL;
 	}
-	*num_tags = cJSON_GetArraySize(node);
-	if (*num_tags > 0) {
-		tags = my_malloc(sizeof(struct tag_t)*(*num_tags));
-		if (tags == NULL) {
-			fprintf(stderr, "Failed to allocate memory for tags\n");
-			cJSON_Delete(json);
-			free(buf);
-			return NULL;
-		}
+	plcs = my_malloc(sizeof(struct plc_t)*(*num_plcs));
+	if (plcs == NULL) {
+		fprintf(stderr, "Failed to allocate memory for controllers\n");
+		cJSON_Delete(json);
+		return NULL;
+	}
+	/* structure layouts shared by all controllers */
+	schemas = parse_schemas(cJSON_GetObjectItemCaseSensitive(json, "schemas"), &num_schemas);
+	if (cJSON_IsArray(node)) {
 		cJSON_ArrayForEach(key, node) {
-			if (cJSON_IsArray(key)) {
-				val0 = cJSON_GetArrayItem(key, 0);
-				val1 = cJSON_GetArrayItem(key, 1);
-				if (val0 != NULL && cJSON_IsString(val0) && strlen(val0->valuestring) > 0 && strlen(val0->valuestring) < TAG_NAME_MAX_LEN-1 && val1 != NULL && cJSON_IsString(val1)) {
-					tags[ix].name = strdup(val0->valuestring);
-					tags[ix].data_type = get_plc_data_type(val1->valuestring);
-					ix++;
-				}
+			if (parse_plc(key, cJSON_GetObjectItemCaseSensitive(key, "tags"), schemas, num_schemas, &plcs[ix]) != 0) {
+				break;
 			}
+			ix++;
+		}
+	} else if (parse_plc(node, cJSON_GetObjectItemCaseSensitive(json, "tags"), schemas, num_schemas, &plcs[ix]) == 0) {
+		ix++;
+	}
+	/* field names were copied into each controller's arena */
+	for (i = 0; i < num_schemas; i++) {
+		schema_free(&schemas[i]);
+	}
+	free(schemas);
+	if (ix != *num_plcs) {
+		for (ix = 0; ix < *num_plcs; ix++) {
+			config_free(&plcs[ix]);
 		}
+		free(plcs);
+		cJSON_Delete(json);
+		return NULL;
 	}
 
 	/* delete json data */
 	cJSON_Delete(json);
 	json = NULL;
-	/* free buffer */
-	free(buf);
-	buf = NULL;
 
-	return tags;
+	return plcs;
 }
 
-int check_config(struct mqtt_t *mqtt, struct plc_t *plc, struct tag_t *tags, int num_tags)
+/* sparkplug group, node and device ids become topic levels */
+static int sparkplug_id_valid(const char *id)
 {
-	int i = 0;
+	return (id != NULL && strlen(id) > 0 && strpbrk(id, "/+#") == NULL);
+}
+
+int check_config(struct mqtt_t *mqtt, struct plc_t *plcs, int num_plcs)
+{
+	struct plc_t *plc = NULL;
+	int i = 0, j = 0, k = 0;
+	char name[32];
 
-	if (mqtt == NULL || plc == NULL) {
+	if (mqtt == NULL || plcs == NULL || num_plcs <= 0) {
 		fprintf(stderr, "One or more parameters are null\n");
 		return 1;
 	}
-	if (tags == NULL || num_tags < 0) {
-		fprintf(stderr, "No tags have been defined\n");
-		i++;
-	}
 	if (mqtt->broker == NULL || strlen(mqtt->broker) == 0) {
 		fprintf(stderr, "MQTT broker has not been defined\n");
 		i++;
@@ -247,36 +962,141 @@ int check_config(struct mqtt_t *mqtt, struct plc_t *plc, struct tag_t *tags, int
 		fprintf(stderr, "Using default keepalive value of 60 seconds\n");
 		mqtt->keepalive = 60;
 	}
-	if (mqtt->pubtopic == NULL || strlen(mqtt->pubtopic) == 0) {
-		fprintf(stderr, "Publish topic has not been defined\n");
-		i++;
-	}
 	if (mqtt->pubqos < 0 || mqtt->pubqos > 2) {
 		fprintf(stderr, "Publish QOS is invalid\n");
 		i++;
 	}
-	if (plc->gateway == NULL || strlen(plc->gateway) == 0) {
-		fprintf(stderr, "PLC gateway has not been defined\n");
+	if (mqtt->integrity < 0) {
+		fprintf(stderr, "Integrity publish interval is invalid\n");
 		i++;
 	}
-	if (plc->path == NULL || strlen(plc->path) == 0) {
-		fprintf(stderr, "Using default PLC path 1,0\n");
-		plc->path = strdup("1,0");
+	if (mqtt->spoolfile != NULL) {
+		if (mqtt->spoolsize < 0) {
+			fprintf(stderr, "Spool size is invalid\n");
+			i++;
+		}
+		if (mqtt->spoolsize == 0) {
+			fprintf(stderr, "Using default spool size of %d MB\n", SPOOL_SIZE_DEFAULT);
+			mqtt->spoolsize = SPOOL_SIZE_DEFAULT;
+		}
+		if (mqtt->replayrate <= 0) {
+			fprintf(stderr, "Using default replay rate of %d messages per second\n", SPOOL_RATE_DEFAULT);
+			mqtt->replayrate = SPOOL_RATE_DEFAULT;
+		}
+	}
+	if (mqtt->statstopic != NULL && mqtt->statsinterval <= 0) {
+		fprintf(stderr, "Using default stats interval of %d seconds\n", STATS_INTERVAL_DEFAULT);
+		mqtt->statsinterval = STATS_INTERVAL_DEFAULT;
 	}
-	if (plc->timeout <= 0) {
-		fprintf(stderr, "Using default PLC timeout of %d ms\n", PLC_TIMEOUT_DEFAULT);
-		plc->timeout = PLC_TIMEOUT_DEFAULT;
+	if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG) {
+		if (!sparkplug_id_valid(mqtt->spgroup) || !sparkplug_id_valid(mqtt->spnode)) {
+			fprintf(stderr, "Sparkplug needs sp_group and sp_node without '/', '+' or '#'\n");
+			i++;
+		}
+		if (mqtt->pubmode == PUB_MODE_TAG) {
+			fprintf(stderr, "Sparkplug publishes one message per controller, ignoring tag mode\n");
+			mqtt->pubmode = PUB_MODE_BLOB;
+		}
+		/* replayed data would arrive after a newer birth with a stale sequence */
+		if (mqtt->spoolfile != NULL) {
+			fprintf(stderr, "Sparkplug hosts rely on births after a reconnect, spooling is disabled\n");
+			free(mqtt->spoolfile);
+			mqtt->spoolfile = NULL;
+		}
+		if (mqtt->pubqos != 0 || mqtt->pubretain) {
+			fprintf(stderr, "Sparkplug data is published at qos 0 without retain\n");
+			mqtt->pubqos = 0;
+			mqtt->pubretain = 0;
+		}
+		/* data messages only carry changed metrics */
+		mqtt->pubchanges = 1;
 	}
-	if (plc->interval <= 0)  {
-		fprintf(stderr, "Using default PLC interval of %d ms\n", PLC_INTERVAL_DEFAULT);
-		plc->interval = PLC_INTERVAL_DEFAULT;
+	if (mqtt->compress) {
+		if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG || mqtt->pubmode == PUB_MODE_TAG) {
+			fprintf(stderr, "Compression only applies to json and msgpack blobs, disabling it\n");
+			mqtt->compress = 0;
+		} else if (mqtt->dicttopic == NULL) {
+			fprintf(stderr, "Compression needs a dict_topic to publish its dictionary on\n");
+			i++;
+		}
+		if (mqtt->compresslevel <= 0 || mqtt->compresslevel > COMPRESS_LEVEL_MAX) {
+			fprintf(stderr, "Using default compression level %d\n", COMPRESS_LEVEL_DEFAULT);
+			mqtt->compresslevel = COMPRESS_LEVEL_DEFAULT;
+		}
+		if (mqtt->dictsize < DICT_SIZE_MIN) {
+			fprintf(stderr, "Using default dictionary size of %d bytes\n", DICT_SIZE_DEFAULT);
+			mqtt->dictsize = DICT_SIZE_DEFAULT;
+		}
+	}
+	for (j = 0; j < num_plcs; j++) {
+		plc = &plcs[j];
+		if (plc->name == NULL || strlen(plc->name) == 0) {
+			snprintf(name, sizeof(name), "plc%d", j);
+			plc->name = strdup(name);
+		}
+		/* controllers are told apart by name in topics, payloads and logs */
+		for (k = 0; k < j && plc->name != NULL; k++) {
+			if (plcs[k].name != NULL && strcmp(plcs[k].name, plc->name) == 0) {
+				fprintf(stderr, "%s: Duplicate controller name\n", plc->name);
+				i++;
+				break;
+			}
+		}
+		if ((plc->tags == NULL || plc->num_tags <= 0) && !plc->discover.enabled) {
+			fprintf(stderr, "%s: No tags have been defined\n", plc->name);
+			i++;
+		}
+		if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG && sparkplug_id_valid(mqtt->spgroup) && sparkplug_id_valid(mqtt->spnode)) {
+			/* every controller is a device of the node */
+			if (!sparkplug_id_valid(plc->name)) {
+				fprintf(stderr, "%s: Sparkplug device names cannot contain '/', '+' or '#'\n", plc->name);
+				i++;
+			}
+			free(plc->pubtopic);
+			plc->pubtopic = my_malloc(512);
+			if (plc->pubtopic != NULL) {
+				sparkplug_topic(plc->pubtopic, 512, mqtt, "DDATA", plc->name);
+			}
+		}
+		if (plc->pubtopic == NULL && mqtt->pubtopic != NULL && strlen(mqtt->pubtopic) > 0) {
+			plc->pubtopic = strdup(mqtt->pubtopic);
+		}
+		if (plc->pubtopic == NULL || strlen(plc->pubtopic) == 0) {
+			fprintf(stderr, "%s: Publish topic has not been defined\n", plc->name);
+			i++;
+		}
+		for (k = 0; k < plc->num_tags && mqtt->aggtopic == NULL; k++) {
+			if (plc->tags[k].aggregate > 0) {
+				fprintf(stderr, "%s: Tag aggregation needs an agg_topic to publish on\n", plc->name);
+				i++;
+				break;
+			}
+		}
+		if (plc->gateway == NULL || strlen(plc->gateway) == 0) {
+			fprintf(stderr, "%s: PLC gateway has not been defined\n", plc->name);
+			i++;
+		}
+		if (plc->path == NULL || strlen(plc->path) == 0) {
+			fprintf(stderr, "%s: Using default PLC path 1,0\n", plc->name);
+			plc->path = strdup("1,0");
+		}
+		if (plc->timeout <= 0) {
+			fprintf(stderr, "%s: Using default PLC timeout of %d ms\n", plc->name, PLC_TIMEOUT_DEFAULT);
+			plc->timeout = PLC_TIMEOUT_DEFAULT;
+		}
+		if (plc->interval <= 0)  {
+			fprintf(stderr, "%s: Using default PLC interval of %d ms\n", plc->name, PLC_INTERVAL_DEFAULT);
+			plc->interval = PLC_INTERVAL_DEFAULT;
+		}
 	}
 	return i;
 }
 
-void dump_config(struct mqtt_t *mqtt, struct plc_t *plc, struct tag_t *tags, int num_tags)
+void dump_config(struct mqtt_t *mqtt, struct plc_t *plcs, int num_plcs)
 {
-	int i = 0;
+	struct plc_t *plc = NULL;
+	struct tag_t *tags = NULL;
+	int i = 0, j = 0;
 	int len = 12;
 
 	fprintf(stderr, "broker       : %s\n", mqtt->broker);
@@ -291,21 +1111,112 @@ void dump_config(struct mqtt_t *mqtt, struct plc_t *plc, struct tag_t *tags, int
 	fprintf(stderr, "pub_topic    : %s\n", mqtt->pubtopic);
 	fprintf(stderr, "pub_qos      : %d\n", mqtt->pubqos);
 	fprintf(stderr, "pub_retain   : %d\n", mqtt->pubretain);
-	fprintf(stderr, "plc gateway  : %s\n", plc->gateway);
-	fprintf(stderr, "plc path     : %s\n", plc->path);
-	fprintf(stderr, "plc timeout  : %ld\n", plc->timeout);
-	fprintf(stderr, "plc interval : %ld\n", plc->interval);
-	fprintf(stderr, "num tags     : %d\n", num_tags);
-	for (i = 0; i < num_tags; i++) {
-		if (tags[i].name != NULL && strlen(tags[i].name) > len) {
-			len = strlen(tags[i].name);
-		}
+	fprintf(stderr, "pub_changes  : %d\n", mqtt->pubchanges);
+	fprintf(stderr, "integrity    : %d\n", mqtt->integrity);
+	fprintf(stderr, "pub_format   : %s\n", get_pub_format_str(mqtt->pubformat));
+	if (mqtt->compress) {
+		fprintf(stderr, "compress     : zstd level %d, %d byte dictionary\n", mqtt->compresslevel, mqtt->dictsize);
+		fprintf(stderr, "dict_topic   : %s\n", mqtt->dicttopic);
 	}
-	for (i = 0; i < num_tags; i++) {
-		if (tags[i].name != NULL) {
-			fprintf(stderr, "%s", tags[i].name);
-			pad_spaces(stderr, len-strlen(tags[i].name));
-			fprintf(stderr, " [%s]\n", get_plc_data_type_str(tags[i].data_type));
+	if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG) {
+		fprintf(stderr, "sp_group     : %s\n", mqtt->spgroup);
+		fprintf(stderr, "sp_node      : %s\n", mqtt->spnode);
+	}
+	if (mqtt->spoolfile != NULL) {
+		fprintf(stderr, "spool_file   : %s\n", mqtt->spoolfile);
+		fprintf(stderr, "spool_size   : %d MB\n", mqtt->spoolsize);
+		fprintf(stderr, "replay_rate  : %d\n", mqtt->replayrate);
+	}
+	if (mqtt->statstopic != NULL) {
+		fprintf(stderr, "stats_topic  : %s\n", mqtt->statstopic);
+		fprintf(stderr, "stats_every  : %d s\n", mqtt->statsinterval);
+	}
+	if (mqtt->metricslisten != NULL) {
+		fprintf(stderr, "metrics      : %s\n", mqtt->metricslisten);
+	}
+	if (mqtt->aggtopic != NULL) {
+		fprintf(stderr, "agg_topic    : %s/<plc>/<window>\n", mqtt->aggtopic);
+	}
+	if (mqtt->cmdtopic != NULL) {
+		fprintf(stderr, "cmd_topic    : %s/<plc>\n", mqtt->cmdtopic);
+		fprintf(stderr, "reply_topic  : %s\n", (mqtt->replytopic != NULL) ? mqtt->replytopic : "(none)");
+	}
+	fprintf(stderr, "pub_mode     : %s\n", (mqtt->pubmode == PUB_MODE_TAG) ? "tag" : "blob");
+	fprintf(stderr, "pub_keys     : %s\n", (mqtt->pubkeys == PUB_KEYS_INDEX) ? "index" : "name");
+	for (j = 0; j < num_plcs; j++) {
+		plc = &plcs[j];
+		tags = plc->tags;
+		fprintf(stderr, "\n");
+		fprintf(stderr, "plc name     : %s\n", plc->name);
+		fprintf(stderr, "plc gateway  : %s\n", plc->gateway);
+		fprintf(stderr, "plc path     : %s\n", plc->path);
+		fprintf(stderr, "plc topic    : %s\n", plc->pubtopic);
+		fprintf(stderr, "plc timeout  : %ld\n", plc->timeout);
+		fprintf(stderr, "plc interval : %ld\n", plc->interval);
+		fprintf(stderr, "plc coalesce : %d\n", plc->coalesce);
+		fprintf(stderr, "plc catch_up : %s\n", (plc->catchup == CATCHUP_IMMEDIATE) ? "immediate" : "skip");
+		if (plc->discover.enabled) {
+			fprintf(stderr, "plc discover : %s, %d include, %d exclude, programs %d, max %d elements\n", plc->discover.regex ? "regex" : "glob",
+				plc->discover.num_include, plc->discover.num_exclude, plc->discover.programs, plc->discover.max_elems);
+		}
+		fprintf(stderr, "num tags     : %d\n", plc->num_tags);
+		len = 12;
+		for (i = 0; i < plc->num_tags; i++) {
+			if (tags[i].name != NULL && strlen(tags[i].name) > len) {
+				len = strlen(tags[i].name);
+			}
+		}
+		if (plc->num_tags > DUMP_TAGS_MAX) {
+			fprintf(stderr, "(tag list not shown for more than %d tags)\n", DUMP_TAGS_MAX);
+			continue;
+		}
+		for (i = 0; i < plc->num_tags; i++) {
+			if (tags[i].name != NULL) {
+				if (mqtt->pubkeys == PUB_KEYS_INDEX) {
+					fprintf(stderr, "%5d ", i);
+				}
+				fprintf(stderr, "%s", tags[i].name);
+				pad_spaces(stderr, len-strlen(tags[i].name));
+				fprintf(stderr, " [%s]", get_plc_data_type_str(tags[i].data_type));
+				if (tags[i].field) {
+					fprintf(stderr, " (field at %d", tags[i].field_offset);
+					if (tags[i].data_type == BIT) {
+						fprintf(stderr, ".%d", tags[i].bit);
+					}
+					fprintf(stderr, ")");
+				} else if (tags[i].parent != NULL) {
+					fprintf(stderr, " (in %s+%d)", tags[i].parent->name, tags[i].elem_index);
+				} else if (tags[i].data_type == STRUCT) {
+					fprintf(stderr, " (%d fields)", tags[i].num_fields);
+				} else if (tags[i].elem_count > 1) {
+					fprintf(stderr, " (bulk %d)", tags[i].elem_count);
+				}
+				if (tags[i].scan > 0) {
+					fprintf(stderr, " scan %ld ms", tags[i].scan);
+				}
+				if (tags[i].timeout > 0) {
+					fprintf(stderr, " timeout %ld ms", tags[i].timeout);
+				}
+				if (tags[i].sample > 0) {
+					fprintf(stderr, " sample %ld ms", tags[i].sample);
+				}
+				if (tags[i].aggregate > 0) {
+					fprintf(stderr, " aggregate %ld ms", tags[i].aggregate);
+				}
+				if (tags[i].expr != NULL) {
+					fprintf(stderr, " = %s", tags[i].expr);
+				}
+				if (tags[i].hidden) {
+					fprintf(stderr, " (not published)");
+				}
+				if (tags[i].deadband > 0) {
+					fprintf(stderr, " deadband %g", tags[i].deadband);
+				}
+				if (tags[i].deadband_pct > 0) {
+					fprintf(stderr, " deadband %g%%", tags[i].deadband_pct);
+				}
+				fprintf(stderr, "\n");
+			}
 		}
 	}
 	fprintf(stderr, "\n");
@@ -0,0 +1,522 @@
+#include "logix2mqtt.h"
+
+/* derived tags are computed from other tags of their scan class by a small stack machine
+ * expressions are parsed once per tag set, evaluating one walks its ops without allocating */
+enum {
+	OP_CONST = 0, OP_LOAD, OP_NEG, OP_NOT, OP_ABS, OP_SQRT,
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_MIN, OP_MAX,
+	OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR
+};
+
+struct parser_t {
+	struct plc_t *plc;
+	struct tag_t *tag;
+	struct expr_t *e;
+	const char *s;
+	const char *err;
+	int depth;
+	int max_depth;
+	int64_t scan;
+	int64_t aggregate;
+};
+
+static int parse_or(struct parser_t *p);
+
+static void emit(struct parser_t *p, int code, double value, struct tag_t *tag)
+{
+	struct op_t *op = &p->e->ops[p->e->num_ops++];
+
+	op->code = code;
+	op->value = value;
+	op->tag = tag;
+	if (code == OP_CONST || code == OP_LOAD) {
+		p->depth++;
+	} else if (code >= OP_ADD) {
+		p->depth--;
+	}
+	if (p->depth > p->max_depth) {
+		p->max_depth = p->depth;
+	}
+}
+
+static void skip_space(struct parser_t *p)
+{
+	while (isspace((unsigned char)*p->s)) {
+		p->s++;
+	}
+}
+
+/* consume an operator when it comes next */
+static int match(struct parser_t *p, const char *op)
+{
+	size_t len = strlen(op);
+
+	skip_space(p);
+	if (strncmp(p->s, op, len) != 0) {
+		return 0;
+	}
+	/* keep < and > from eating the first half of <= and >=, and ! from eating != */
+	if (len == 1 && (*op == '<' || *op == '>' || *op == '!') && p->s[1] == '=') {
+		return 0;
+	}
+	p->s += len;
+	return 1;
+}
+
+static int fail(struct parser_t *p, const char *err)
+{
+	if (p->err == NULL) {
+		p->err = err;
+	}
+	return 1;
+}
+
+/* resolve a tag reference, every input has to be numeric and read in the same scan class */
+static int load_tag(struct parser_t *p, const char *name, size_t len)
+{
+	struct tag_t *tags = p->plc->tags, *in = NULL;
+	struct expr_t *e = p->e;
+	int64_t scan = 0;
+	int i = 0;
+
+	for (i = 0; i < p->plc->num_tags && in == NULL; i++) {
+		if (tags[i].name != NULL && strlen(tags[i].name) == len && strncmp(tags[i].name, name, len) == 0) {
+			in = &tags[i];
+		}
+	}
+	if (in == NULL) {
+		return fail(p, "unknown tag");
+	}
+	if (in == p->tag) {
+		return fail(p, "refers to itself");
+	}
+	/* derived tags are evaluated in config order */
+	if (in->expr != NULL && in > p->tag) {
+		return fail(p, "uses a derived tag defined after it");
+	}
+	if (in->data_type == STRING || in->data_type == STRUCT || in->data_type == UNKNOWN) {
+		return fail(p, "uses a tag that is not numeric");
+	}
+	if (in->sample > 0) {
+		return fail(p, "uses a sampled tag");
+	}
+	scan = (in->scan > 0) ? in->scan : p->plc->interval;
+	if (e->num_inputs == 0) {
+		p->scan = scan;
+		p->aggregate = in->aggregate;
+	} else if (scan != p->scan || in->aggregate != p->aggregate) {
+		return fail(p, "uses tags of different scan classes");
+	}
+	i = 0;
+	while (i < e->num_inputs && e->inputs[i] != in) {
+		i++;
+	}
+	if (i == e->num_inputs) {
+		e->inputs[e->num_inputs++] = in;
+	}
+	emit(p, OP_LOAD, 0, in);
+	return 0;
+}
+
+/* function call or tag reference, tag names may carry program scopes, members and subscripts */
+static int parse_name(struct parser_t *p)
+{
+	static const struct { const char *name; int code; int args; } funcs[] = {
+		{"abs", OP_ABS, 1}, {"sqrt", OP_SQRT, 1}, {"min", OP_MIN, 2}, {"max", OP_MAX, 2}
+	};
+	const char *name = p->s;
+	size_t len = 0;
+	int i = 0, j = 0;
+
+	while (p->s[len] != '\0' && (isalnum((unsigned char)p->s[len]) || strchr("_.:[]", p->s[len]) != NULL)) {
+		len++;
+	}
+	p->s += len;
+	skip_space(p);
+	if (*p->s != '(') {
+		if (len == 4 && strncmp(name, "true", 4) == 0) {
+			emit(p, OP_CONST, 1, NULL);
+			return 0;
+		}
+		if (len == 5 && strncmp(name, "false", 5) == 0) {
+			emit(p, OP_CONST, 0, NULL);
+			return 0;
+		}
+		if (load_tag(p, name, len) != 0) {
+			p->s = name;
+			return 1;
+		}
+		return 0;
+	}
+	for (i = 0; i < (int)(sizeof(funcs)/sizeof(funcs[0])); i++) {
+		if (strlen(funcs[i].name) != len || strncmp(funcs[i].name, name, len) != 0) {
+			continue;
+		}
+		p->s++;
+		for (j = 0; j < funcs[i].args; j++) {
+			if ((j > 0 && !match(p, ",")) || parse_or(p) != 0) {
+				return fail(p, "bad function arguments");
+			}
+		}
+		if (!match(p, ")")) {
+			return fail(p, "missing ')'");
+		}
+		emit(p, funcs[i].code, 0, NULL);
+		return 0;
+	}
+	p->s = name;
+	return fail(p, "unknown function");
+}
+
+static int parse_unary(struct parser_t *p)
+{
+	char *end = NULL;
+	double v = 0;
+
+	if (match(p, "-")) {
+		if (parse_unary(p) != 0) {
+			return 1;
+		}
+		emit(p, OP_NEG, 0, NULL);
+		return 0;
+	}
+	if (match(p, "!")) {
+		if (parse_unary(p) != 0) {
+			return 1;
+		}
+		emit(p, OP_NOT, 0, NULL);
+		return 0;
+	}
+	if (match(p, "(")) {
+		if (parse_or(p) != 0) {
+			return 1;
+		}
+		return match(p, ")") ? 0 : fail(p, "missing ')'");
+	}
+	skip_space(p);
+	if (isdigit((unsigned char)*p->s) || (*p->s == '.' && isdigit((unsigned char)p->s[1]))) {
+		v = strtod(p->s, &end);
+		p->s = end;
+		emit(p, OP_CONST, v, NULL);
+		return 0;
+	}
+	if (isalpha((unsigned char)*p->s) || *p->s == '_') {
+		return parse_name(p);
+	}
+	return fail(p, "expected a number, tag or '('");
+}
+
+/* one precedence level of left associative binary operators */
+static int parse_binary(struct parser_t *p, int (*next)(struct parser_t *), const char **ops, const int *codes, int n)
+{
+	int i = 0;
+
+	if (next(p) != 0) {
+		return 1;
+	}
+	/* start over after every operator so a level can mix them, as in a-b+c */
+	while (i < n) {
+		if (!match(p, ops[i])) {
+			i++;
+			continue;
+		}
+		if (next(p) != 0) {
+			return 1;
+		}
+		emit(p, codes[i], 0, NULL);
+		i = 0;
+	}
+	return 0;
+}
+
+static int parse_mul(struct parser_t *p)
+{
+	static const char *ops[] = {"*", "/", "%"};
+	static const int codes[] = {OP_MUL, OP_DIV, OP_MOD};
+
+	return parse_binary(p, parse_unary, ops, codes, 3);
+}
+
+static int parse_add(struct parser_t *p)
+{
+	static const char *ops[] = {"+", "-"};
+	static const int codes[] = {OP_ADD, OP_SUB};
+
+	return parse_binary(p, parse_mul, ops, codes, 2);
+}
+
+static int parse_cmp(struct parser_t *p)
+{
+	static const char *ops[] = {"<=", ">=", "==", "!=", "<", ">"};
+	static const int codes[] = {OP_LE, OP_GE, OP_EQ, OP_NE, OP_LT, OP_GT};
+
+	return parse_binary(p, parse_add, ops, codes, 6);
+}
+
+static int parse_and(struct parser_t *p)
+{
+	static const char *ops[] = {"&&"};
+	static const int codes[] = {OP_AND};
+
+	return parse_binary(p, parse_cmp, ops, codes, 1);
+}
+
+static int parse_or(struct parser_t *p)
+{
+	static const char *ops[] = {"||"};
+	static const int codes[] = {OP_OR};
+
+	return parse_binary(p, parse_and, ops, codes, 1);
+}
+
+/* compile one derived tag, the op and input arrays share the expression's allocation
+ * no expression needs more ops or inputs than it has characters */
+static int compile_tag(struct plc_t *plc, struct tag_t *tag)
+{
+	struct parser_t p = {0};
+	size_t len = strlen(tag->expr)+1;
+
+	switch (tag->data_type) {
+	case BOOL:
+	case SINT:
+	case INT:
+	case DINT:
+	case LINT:
+	case REAL:
+		break;
+	default:
+		fprintf(stderr, "%s: Derived tag %s must be bool, sint, int, dint, lint or real\n", plc->name, tag->name);
+		return 1;
+	}
+	free(tag->code);
+	tag->code = my_malloc(sizeof(struct expr_t)+len*(sizeof(struct op_t)+sizeof(struct tag_t *)));
+	if (tag->code == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for derived tag %s\n", plc->name, tag->name);
+		return 1;
+	}
+	tag->code->ops = (struct op_t *)(tag->code+1);
+	tag->code->inputs = (struct tag_t **)(tag->code->ops+len);
+
+	p.plc = plc;
+	p.tag = tag;
+	p.e = tag->code;
+	p.s = tag->expr;
+	if (parse_or(&p) == 0) {
+		skip_space(&p);
+		if (*p.s != '\0') {
+			fail(&p, "unexpected input");
+		} else if (p.e->num_inputs == 0) {
+			fail(&p, "uses no tags");
+		} else if (p.max_depth > EXPR_STACK_MAX) {
+			fail(&p, "is nested too deeply");
+		}
+	}
+	if (p.err != NULL) {
+		if (*p.s != '\0') {
+			fprintf(stderr, "%s: Derived tag %s %s at '%s'\n", plc->name, tag->name, p.err, p.s);
+		} else {
+			fprintf(stderr, "%s: Derived tag %s %s\n", plc->name, tag->name, p.err);
+		}
+		free(tag->code);
+		tag->code = NULL;
+		return 1;
+	}
+	/* a derived tag is published with the scan that reads its inputs */
+	tag->scan = p.scan;
+	tag->sample = 0;
+	tag->aggregate = p.aggregate;
+	return 0;
+}
+
+/* compile every derived tag of a tag set, runs before scan classes are formed, returns the number of failures */
+int derive_compile(struct plc_t *plc)
+{
+	int i = 0, failed = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		if (plc->tags[i].expr != NULL) {
+			failed += compile_tag(plc, &plc->tags[i]);
+		}
+	}
+	return failed;
+}
+
+void derive_free(struct plc_t *plc)
+{
+	int i = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		free(plc->tags[i].code);
+		plc->tags[i].code = NULL;
+		free(plc->tags[i].expr);
+		plc->tags[i].expr = NULL;
+	}
+}
+
+/* write a result in the tag's own type, returns 0 when it does not fit */
+static int store_value(struct tag_t *tag, double v)
+{
+	switch (tag->data_type) {
+	case REAL:
+		if (!isfinite(v)) {
+			return 0;
+		}
+		*(float *)tag->data = (float)v;
+		return 1;
+	case BOOL:
+		*(int8_t *)tag->data = (v != 0);
+		return !isnan(v);
+	default:
+		break;
+	}
+	v = round(v);
+	switch (tag->data_type) {
+	case LINT:
+		if (!(v >= -9223372036854775808.0 && v < 9223372036854775808.0)) {
+			return 0;
+		}
+		*(int64_t *)tag->data = (int64_t)v;
+		return 1;
+	case DINT:
+		if (!(v >= INT32_MIN && v <= INT32_MAX)) {
+			return 0;
+		}
+		*(int32_t *)tag->data = (int32_t)v;
+		return 1;
+	case INT:
+		if (!(v >= INT16_MIN && v <= INT16_MAX)) {
+			return 0;
+		}
+		*(int16_t *)tag->data = (int16_t)v;
+		return 1;
+	case SINT:
+		if (!(v >= INT8_MIN && v <= INT8_MAX)) {
+			return 0;
+		}
+		*(int8_t *)tag->data = (int8_t)v;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* evaluate one derived tag into the current snapshot, its quality is the worst of its inputs */
+static void derive_tag(struct tag_t *tag)
+{
+	struct expr_t *e = tag->code;
+	struct op_t *op = NULL, *end = e->ops+e->num_ops;
+	double stack[EXPR_STACK_MAX];
+	double *sp = stack-1, v = 0;
+	quality_t q = QUALITY_GOOD, iq = QUALITY_GOOD;
+	int i = 0;
+
+	for (i = 0; i < e->num_inputs; i++) {
+		iq = (e->inputs[i]->data != NULL) ? tag_quality(e->inputs[i]) : QUALITY_BAD;
+		q = (iq > q) ? iq : q;
+	}
+	if (q == QUALITY_BAD) {
+		tag->view_quality = QUALITY_BAD;
+		return;
+	}
+
+	for (op = e->ops; op < end; op++) {
+		switch (op->code) {
+		case OP_CONST:
+			*++sp = op->value;
+			break;
+		case OP_LOAD:
+			get_tag_number(op->tag, &v);
+			*++sp = v;
+			break;
+		case OP_NEG:
+			*sp = -*sp;
+			break;
+		case OP_NOT:
+			*sp = (*sp == 0);
+			break;
+		case OP_ABS:
+			*sp = fabs(*sp);
+			break;
+		case OP_SQRT:
+			*sp = sqrt(*sp);
+			break;
+		case OP_ADD:
+			sp--;
+			sp[0] += sp[1];
+			break;
+		case OP_SUB:
+			sp--;
+			sp[0] -= sp[1];
+			break;
+		case OP_MUL:
+			sp--;
+			sp[0] *= sp[1];
+			break;
+		case OP_DIV:
+			sp--;
+			sp[0] /= sp[1];
+			break;
+		case OP_MOD:
+			sp--;
+			sp[0] = fmod(sp[0], sp[1]);
+			break;
+		case OP_MIN:
+			sp--;
+			sp[0] = (sp[1] < sp[0]) ? sp[1] : sp[0];
+			break;
+		case OP_MAX:
+			sp--;
+			sp[0] = (sp[1] > sp[0]) ? sp[1] : sp[0];
+			break;
+		case OP_LT:
+			sp--;
+			sp[0] = (sp[0] < sp[1]);
+			break;
+		case OP_LE:
+			sp--;
+			sp[0] = (sp[0] <= sp[1]);
+			break;
+		case OP_GT:
+			sp--;
+			sp[0] = (sp[0] > sp[1]);
+			break;
+		case OP_GE:
+			sp--;
+			sp[0] = (sp[0] >= sp[1]);
+			break;
+		case OP_EQ:
+			sp--;
+			sp[0] = (sp[0] == sp[1]);
+			break;
+		case OP_NE:
+			sp--;
+			sp[0] = (sp[0] != sp[1]);
+			break;
+		case OP_AND:
+			sp--;
+			sp[0] = (sp[0] != 0 && sp[1] != 0);
+			break;
+		case OP_OR:
+			sp--;
+			sp[0] = (sp[0] != 0 || sp[1] != 0);
+			break;
+		}
+	}
+	/* division by zero and out of range results are bad rather than garbage */
+	if (!store_value(tag, stack[0])) {
+		q = QUALITY_BAD;
+	}
+	tag->view_quality = q;
+}
+
+/* compute a scan's derived tags from the snapshot being published, runs on the publishing thread before publish_tag_data */
+void derive_scan(struct scan_t *scan)
+{
+	int i = 0;
+
+	for (i = 0; i < scan->num_derived; i++) {
+		if (scan->derived[i]->data != NULL) {
+			derive_tag(scan->derived[i]);
+		}
+	}
+}
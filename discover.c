@@ -0,0 +1,656 @@
+#include "logix2mqtt.h"
+#include <fnmatch.h>
+#include <regex.h>
+
+/* symbol type word from the @tags listing */
+#define SYM_TYPE_STRUCT (0x8000)
+#define SYM_TYPE_SYSTEM (0x1000)
+#define SYM_TYPE_DIMS(t) (((t) >> 13) & 0x3)
+#define SYM_TYPE_ATOMIC(t) ((t) & 0x00ff)
+#define SYM_TYPE_TEMPLATE(t) ((t) & 0x0fff)
+#define SYM_STRING_TEMPLATE (0x0fce)
+/* instance id, type, element size, three dimensions and the name length */
+#define SYM_ENTRY_HEADER (22)
+
+struct symbol_t {
+	size_t name_off;
+	const char *name;
+	uint16_t type;
+	uint32_t dims[3];
+	plc_data_type_t data_type;
+};
+
+/* controller templates fetched during one discovery, by template id */
+struct template_t {
+	int id;
+	int ok;
+	struct schema_t schema;
+};
+
+struct tmplcache_t {
+	struct template_t *list;
+	int count;
+	int max;
+};
+
+/* growable symbol list, names live in one buffer and are resolved once listing is done */
+struct symtab_t {
+	struct symbol_t *syms;
+	int count;
+	int max;
+	char *names;
+	size_t len;
+	size_t size;
+};
+
+static plc_data_type_t symbol_data_type(uint16_t type)
+{
+	if (type & SYM_TYPE_STRUCT) {
+		return (SYM_TYPE_TEMPLATE(type) == SYM_STRING_TEMPLATE) ? STRING : STRUCT;
+	}
+	switch (SYM_TYPE_ATOMIC(type)) {
+	case 0xc1:
+		return BOOL;
+	case 0xc2:
+		return SINT;
+	case 0xc3:
+		return INT;
+	case 0xc4:
+		return DINT;
+	case 0xc5:
+		return LINT;
+	case 0xca:
+		return REAL;
+	case 0xd3:
+		/* bool arrays are stored as packed 32 bit words */
+		return DINT;
+	default:
+		return UNKNOWN;
+	}
+}
+
+static int symtab_add(struct symtab_t *st, const char *prefix, const char *name, size_t name_len, uint16_t type, uint32_t *dims)
+{
+	struct symbol_t *sym = NULL;
+	size_t prefix_len = (prefix != NULL) ? strlen(prefix)+1 : 0;
+	size_t need = prefix_len+name_len+1;
+	void *p = NULL;
+
+	if (st->count == st->max) {
+		p = realloc(st->syms, sizeof(struct symbol_t)*(st->max > 0 ? st->max*2 : 1024));
+		if (p == NULL) {
+			return 1;
+		}
+		st->syms = p;
+		st->max = (st->max > 0) ? st->max*2 : 1024;
+	}
+	if (st->len+need > st->size) {
+		p = realloc(st->names, (st->size+need)*2);
+		if (p == NULL) {
+			return 1;
+		}
+		st->names = p;
+		st->size = (st->size+need)*2;
+	}
+
+	sym = &st->syms[st->count++];
+	memset(sym, 0, sizeof(struct symbol_t));
+	sym->name_off = st->len;
+	if (prefix != NULL) {
+		/* program scoped tags are addressed as Program:Name.Tag */
+		memcpy(st->names+st->len, prefix, prefix_len-1);
+		st->names[st->len+prefix_len-1] = '.';
+	}
+	memcpy(st->names+st->len+prefix_len, name, name_len);
+	st->names[st->len+need-1] = '\0';
+	st->len += need;
+	sym->type = type;
+	memcpy(sym->dims, dims, sizeof(sym->dims));
+	sym->data_type = symbol_data_type(type);
+	return 0;
+}
+
+/* read one symbol listing, the controller scope or a program's scope */
+static int list_symbols(struct plc_t *plc, struct symtab_t *st, const char *program)
+{
+	char path[TAG_PATH_MAX_LEN], name[TAG_PATH_MAX_LEN];
+	uint32_t dims[3] = {0};
+	uint16_t type = 0, name_len = 0;
+	int32_t tag = 0;
+	int size = 0, off = 0, rc = 0;
+
+	snprintf(name, sizeof(name), "%s%s@tags", (program != NULL) ? program : "", (program != NULL) ? "." : "");
+	rc = snprintf(path, TAG_PATH_MAX_LEN-1, TAG_PATH_BASE, plc->gateway, plc->path, name);
+	if (rc < 0 || rc >= TAG_PATH_MAX_LEN-1) {
+		fprintf(stderr, "%s: Tag path for %s is too long\n", plc->name, name);
+		return 1;
+	}
+	tag = plc_tag_create(path, (int)plc->timeout);
+	if (tag < 0) {
+		fprintf(stderr, "%s: Could not list %s [%d]: %s\n", plc->name, name, tag, plc_tag_decode_error(tag));
+		return 1;
+	}
+	rc = plc_tag_read(tag, (int)plc->timeout);
+	if (rc != PLCTAG_STATUS_OK) {
+		fprintf(stderr, "%s: Could not read %s [%d]: %s\n", plc->name, name, rc, plc_tag_decode_error(rc));
+		plc_tag_destroy(tag);
+		return 1;
+	}
+
+	size = plc_tag_get_size(tag);
+	while (off+SYM_ENTRY_HEADER <= size) {
+		type = plc_tag_get_uint16(tag, off+4);
+		dims[0] = plc_tag_get_uint32(tag, off+8);
+		dims[1] = plc_tag_get_uint32(tag, off+12);
+		dims[2] = plc_tag_get_uint32(tag, off+16);
+		name_len = plc_tag_get_uint16(tag, off+20);
+		off += SYM_ENTRY_HEADER;
+		if (off+name_len > size || name_len >= sizeof(name)) {
+			break;
+		}
+		plc_tag_get_raw_bytes(tag, off, (uint8_t *)name, name_len);
+		off += name_len;
+		if (symtab_add(st, program, name, name_len, type, dims) != 0) {
+			fprintf(stderr, "%s: Failed to allocate memory for symbol table\n", plc->name);
+			plc_tag_destroy(tag);
+			return 1;
+		}
+	}
+	plc_tag_destroy(tag);
+	return 0;
+}
+
+/* decode a structure template: header, member entries, then the template name and member names
+ * nested structures, arrays and the hidden hosts of bool members are left out */
+static int read_template(struct plc_t *plc, int id, struct schema_t *sc)
+{
+	char path[TAG_PATH_MAX_LEN], name[32];
+	char *names = NULL, *p = NULL, *end = NULL;
+	uint16_t info = 0, type = 0;
+	int32_t tag = 0;
+	int size = 0, members = 0, off = 0, rc = 0, i = 0;
+	size_t used = 0, len = 0;
+
+	snprintf(name, sizeof(name), "@udt/%d", id);
+	rc = snprintf(path, TAG_PATH_MAX_LEN-1, TAG_PATH_BASE, plc->gateway, plc->path, name);
+	if (rc < 0 || rc >= TAG_PATH_MAX_LEN-1) {
+		fprintf(stderr, "%s: Tag path for template %d is too long\n", plc->name, id);
+		return 1;
+	}
+	tag = plc_tag_create(path, (int)plc->timeout);
+	if (tag < 0) {
+		fprintf(stderr, "%s: Could not create template %d [%d]: %s\n", plc->name, id, tag, plc_tag_decode_error(tag));
+		return 1;
+	}
+	rc = plc_tag_read(tag, (int)plc->timeout);
+	size = plc_tag_get_size(tag);
+	members = plc_tag_get_uint16(tag, 10);
+	off = 14+members*8;
+	if (rc != PLCTAG_STATUS_OK || off >= size) {
+		fprintf(stderr, "%s: Could not read template %d [%d]: %s\n", plc->name, id, rc, plc_tag_decode_error(rc));
+		plc_tag_destroy(tag);
+		return 1;
+	}
+
+	names = my_malloc(size-off+1);
+	sc->fields = my_malloc(sizeof(struct field_t)*(members > 0 ? members : 1));
+	sc->names = my_malloc(size-off+1);
+	if (names == NULL || sc->fields == NULL || sc->names == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for template %d\n", plc->name, id);
+		free(names);
+		schema_free(sc);
+		plc_tag_destroy(tag);
+		return 1;
+	}
+	sc->size = plc_tag_get_uint32(tag, 6);
+	plc_tag_get_raw_bytes(tag, off, (uint8_t *)names, size-off);
+	end = names+(size-off);
+
+	/* template name up to the ';', the member names follow the terminating nul */
+	p = names;
+	len = strnlen(p, end-p);
+	sc->name = strndup(p, strcspn(p, ";"));
+	p += len+1;
+	for (i = 0; i < members && p < end; i++) {
+		len = strnlen(p, end-p);
+		info = plc_tag_get_uint16(tag, 14+i*8);
+		type = plc_tag_get_uint16(tag, 14+i*8+2);
+		if (strncmp(p, "ZZZZZZZZZZ", 10) != 0 && strncmp(p, "__", 2) != 0 &&
+		    !(type & SYM_TYPE_STRUCT) && SYM_TYPE_DIMS(type) == 0 && symbol_data_type(type) != UNKNOWN) {
+			memcpy(sc->names+used, p, len);
+			sc->names[used+len] = '\0';
+			sc->fields[sc->num_fields].name = sc->names+used;
+			sc->fields[sc->num_fields].offset = (int)plc_tag_get_uint32(tag, 14+i*8+4);
+			if (SYM_TYPE_ATOMIC(type) == 0xc1) {
+				/* bool members live in a hidden host byte, info is the bit */
+				sc->fields[sc->num_fields].type = BIT;
+				sc->fields[sc->num_fields].bit = info;
+			} else {
+				sc->fields[sc->num_fields].type = symbol_data_type(type);
+			}
+			used += len+1;
+			sc->num_fields++;
+		}
+		p += len+1;
+	}
+	free(names);
+	plc_tag_destroy(tag);
+	return 0;
+}
+
+/* fetch a template once per discovery, returns NULL when it cannot be read */
+static struct schema_t *template_get(struct plc_t *plc, struct tmplcache_t *tc, int id)
+{
+	struct template_t *t = NULL;
+	void *p = NULL;
+	int i = 0;
+
+	for (i = 0; i < tc->count; i++) {
+		if (tc->list[i].id == id) {
+			return tc->list[i].ok ? &tc->list[i].schema : NULL;
+		}
+	}
+	if (tc->count == tc->max) {
+		p = realloc(tc->list, sizeof(struct template_t)*(tc->max > 0 ? tc->max*2 : 16));
+		if (p == NULL) {
+			return NULL;
+		}
+		tc->list = p;
+		tc->max = (tc->max > 0) ? tc->max*2 : 16;
+	}
+	t = &tc->list[tc->count++];
+	memset(t, 0, sizeof(struct template_t));
+	t->id = id;
+	t->ok = (read_template(plc, id, &t->schema) == 0 && t->schema.num_fields > 0);
+	return t->ok ? &t->schema : NULL;
+}
+
+static int compare_symbol(const void *a, const void *b)
+{
+	return strcmp(((const struct symbol_t *)a)->name, ((const struct symbol_t *)b)->name);
+}
+
+static int compare_name(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static struct symbol_t *find_symbol(struct symtab_t *st, const char *name)
+{
+	struct symbol_t key = {0};
+
+	key.name = name;
+	return bsearch(&key, st->syms, st->count, sizeof(struct symbol_t), compare_symbol);
+}
+
+static int pattern_match(struct discover_t *d, const char *pattern, regex_t *re, const char *name)
+{
+	if (d->regex) {
+		return regexec(re, name, 0, NULL, 0) == 0;
+	}
+	return fnmatch(pattern, name, 0) == 0;
+}
+
+/* a symbol is taken when it matches an include pattern (or there are none) and no exclude pattern */
+static int symbol_wanted(struct discover_t *d, regex_t *inc, regex_t *exc, const char *name)
+{
+	int i = 0, wanted = (d->num_include == 0);
+
+	for (i = 0; i < d->num_include && !wanted; i++) {
+		wanted = pattern_match(d, d->include[i], &inc[i], name);
+	}
+	for (i = 0; i < d->num_exclude && wanted; i++) {
+		wanted = !pattern_match(d, d->exclude[i], &exc[i], name);
+	}
+	return wanted;
+}
+
+/* number of tags a symbol expands into, arrays become one tag per element */
+static int64_t symbol_elems(struct symbol_t *sym)
+{
+	int i = 0, dims = SYM_TYPE_DIMS(sym->type);
+	int64_t n = 1;
+
+	for (i = 0; i < dims; i++) {
+		n *= (sym->dims[i] > 0) ? sym->dims[i] : 1;
+	}
+	return n;
+}
+
+/* system and internal symbols, and scopes other than programs (map, task, routine) */
+static int symbol_hidden(struct symbol_t *sym)
+{
+	if ((sym->type & SYM_TYPE_SYSTEM) || strncmp(sym->name, "__", 2) == 0) {
+		return 1;
+	}
+	if (strncmp(sym->name, "Program:", 8) == 0) {
+		/* program entries themselves only lead to the program's own listing */
+		return strchr(sym->name, '.') == NULL;
+	}
+	return strchr(sym->name, ':') != NULL;
+}
+
+/* element tag name in the controller's own syntax, name[i] or name[i,j,k] */
+static int symbol_elem_name(struct symbol_t *sym, int elem, char *out, size_t size)
+{
+	int dims = SYM_TYPE_DIMS(sym->type);
+	uint32_t d1 = (dims > 1 && sym->dims[1] > 0) ? sym->dims[1] : 1;
+	uint32_t d2 = (dims > 2 && sym->dims[2] > 0) ? sym->dims[2] : 1;
+
+	switch (dims) {
+	case 0:
+		return snprintf(out, size, "%s", sym->name);
+	case 1:
+		return snprintf(out, size, "%s[%d]", sym->name, elem);
+	case 2:
+		return snprintf(out, size, "%s[%u,%u]", sym->name, elem/d1, elem%d1);
+	default:
+		return snprintf(out, size, "%s[%u,%u,%u]", sym->name, elem/(d1*d2), (elem/d2)%d1, elem%d2);
+	}
+}
+
+/* warn about configured tags whose type does not match the controller's symbol table */
+static void check_types(struct plc_t *plc, struct symtab_t *st)
+{
+	struct symbol_t *sym = NULL;
+	char base[TAG_NAME_MAX_LEN];
+	char *open = NULL;
+	int i = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		if (plc->tags[i].data_type == BIT) {
+			continue;
+		}
+		snprintf(base, sizeof(base), "%s", plc->tags[i].name);
+		open = strchr(base, '[');
+		if (open != NULL) {
+			*open = '\0';
+		}
+		sym = find_symbol(st, base);
+		if (sym != NULL && sym->data_type != UNKNOWN && sym->data_type != plc->tags[i].data_type) {
+			fprintf(stderr, "%s: %s is %s in the controller but configured as %s\n", plc->name, plc->tags[i].name,
+				get_plc_data_type_str(sym->data_type), get_plc_data_type_str(plc->tags[i].data_type));
+		}
+	}
+}
+
+/* structure whose fields come from the controller, NULL when it is not a readable structure symbol */
+static struct schema_t *symbol_schema(struct plc_t *plc, struct tmplcache_t *tc, struct symbol_t *sym)
+{
+	if (sym == NULL || sym->data_type != STRUCT || SYM_TYPE_DIMS(sym->type) != 0) {
+		return NULL;
+	}
+	return template_get(plc, tc, SYM_TYPE_TEMPLATE(sym->type));
+}
+
+/* replace the tag set with the configured tags followed by every discovered element that is not configured
+ * structures get one tag per template field, configured structures without a schema are completed the same way */
+static int build_tags(struct plc_t *plc, struct symtab_t *st, regex_t *inc, regex_t *exc, struct tmplcache_t *tc)
+{
+	struct discover_t *d = &plc->discover;
+	struct tag_t *tags = NULL;
+	struct schema_t *sc = NULL;
+	char **configured = NULL;
+	char *names = NULL;
+	char name[TAG_PATH_MAX_LEN];
+	const char *key = name;
+	size_t arena = 0, used = 0;
+	int64_t n = 0, j = 0;
+	int i = 0, k = 0, len = 0, count = 0, resolved = 0;
+	int matched = 0, skipped = 0, truncated = 0, pass = 0;
+
+	configured = my_malloc(sizeof(char *)*(plc->num_tags > 0 ? plc->num_tags : 1));
+	if (configured == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for discovered tags\n", plc->name);
+		return 1;
+	}
+	for (i = 0; i < plc->num_tags; i++) {
+		configured[i] = plc->tags[i].name;
+		arena += strlen(plc->tags[i].name)+1;
+	}
+	qsort(configured, plc->num_tags, sizeof(char *), compare_name);
+
+	/* first pass sizes the tag array and name arena, second pass fills them */
+	count = plc->num_tags;
+	for (pass = 0; pass < 2; pass++) {
+		k = plc->num_tags;
+		for (i = 0; i < plc->num_tags; i++) {
+			if (plc->tags[i].data_type != STRUCT || plc->tags[i].num_fields > 0 || plc->tags[i].parent != NULL) {
+				continue;
+			}
+			sc = symbol_schema(plc, tc, find_symbol(st, plc->tags[i].name));
+			if (sc == NULL) {
+				continue;
+			}
+			if (pass == 0) {
+				arena += fields_name_len(plc->tags[i].name, sc);
+				count += sc->num_fields;
+				resolved++;
+				continue;
+			}
+			k += expand_fields(tags, i, k, sc, names, &used);
+		}
+		for (i = 0; i < st->count && d->enabled; i++) {
+			if (symbol_hidden(&st->syms[i]) || !symbol_wanted(d, inc, exc, st->syms[i].name)) {
+				continue;
+			}
+			sc = symbol_schema(plc, tc, &st->syms[i]);
+			if (st->syms[i].data_type == UNKNOWN || (st->syms[i].data_type == STRUCT && sc == NULL)) {
+				skipped += (pass == 0);
+				continue;
+			}
+			matched += (pass == 0);
+			n = symbol_elems(&st->syms[i]);
+			if (n > d->max_elems) {
+				truncated += (pass == 0);
+				n = d->max_elems;
+			}
+			for (j = 0; j < n; j++) {
+				len = symbol_elem_name(&st->syms[i], (int)j, name, sizeof(name));
+				if (len <= 0 || len >= TAG_NAME_MAX_LEN-1) {
+					skipped += (pass == 0);
+					continue;
+				}
+				if (bsearch(&key, configured, plc->num_tags, sizeof(char *), compare_name) != NULL) {
+					continue;
+				}
+				if (pass == 0) {
+					arena += len+1;
+					count++;
+					if (sc != NULL) {
+						arena += fields_name_len(name, sc);
+						count += sc->num_fields;
+					}
+					continue;
+				}
+				tags[k].name = names+used;
+				memcpy(tags[k].name, name, len+1);
+				used += len+1;
+				tags[k].data_type = st->syms[i].data_type;
+				if (sc != NULL) {
+					k += expand_fields(tags, k, k+1, sc, names, &used);
+				}
+				k++;
+			}
+		}
+		if (pass == 1) {
+			break;
+		}
+
+		tags = my_malloc(sizeof(struct tag_t)*(count > 0 ? count : 1));
+		names = malloc(arena > 0 ? arena : 1);
+		if (tags == NULL || names == NULL) {
+			fprintf(stderr, "%s: Failed to allocate memory for discovered tags\n", plc->name);
+			free(tags);
+			free(names);
+			free(configured);
+			return 1;
+		}
+		/* configured tags come first and keep their options, fields keep pointing at their structure */
+		for (i = 0; i < plc->num_tags; i++) {
+			tags[i] = plc->tags[i];
+			if (plc->tags[i].parent != NULL) {
+				tags[i].parent = tags+(plc->tags[i].parent-plc->tags);
+			}
+			len = strlen(plc->tags[i].name);
+			tags[i].name = names+used;
+			memcpy(tags[i].name, plc->tags[i].name, len+1);
+			used += len+1;
+		}
+	}
+	free(configured);
+
+	if (d->enabled) {
+		fprintf(stderr, "%s: Discovered %d symbols, %d matched, %d tags added, %d skipped, %d arrays truncated to %d elements\n",
+			plc->name, st->count, matched, k-plc->num_tags, skipped, truncated, d->max_elems);
+	}
+	if (resolved > 0) {
+		fprintf(stderr, "%s: Took the fields of %d structures from controller templates\n", plc->name, resolved);
+	}
+	free(plc->tags);
+	free(plc->names);
+	plc->tags = tags;
+	plc->names = names;
+	plc->num_tags = k;
+	return 0;
+}
+
+static void free_patterns(regex_t *re, int n)
+{
+	int i = 0;
+
+	for (i = 0; i < n && re != NULL; i++) {
+		regfree(&re[i]);
+	}
+	free(re);
+}
+
+static regex_t *compile_patterns(struct plc_t *plc, char **patterns, int n)
+{
+	regex_t *re = NULL;
+	char err[128];
+	int i = 0, rc = 0;
+
+	re = my_malloc(sizeof(regex_t)*(n > 0 ? n : 1));
+	if (re == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for discovery patterns\n", plc->name);
+		return NULL;
+	}
+	for (i = 0; i < n && plc->discover.regex; i++) {
+		rc = regcomp(&re[i], patterns[i], REG_EXTENDED|REG_NOSUB);
+		if (rc != 0) {
+			regerror(rc, &re[i], err, sizeof(err));
+			fprintf(stderr, "%s: Invalid discovery pattern '%s': %s\n", plc->name, patterns[i], err);
+			free_patterns(re, i);
+			return NULL;
+		}
+	}
+	return re;
+}
+
+/* build a controller's tag set from its symbol table */
+static int discover_tags(struct plc_t *plc)
+{
+	struct discover_t *d = &plc->discover;
+	struct symtab_t st = {0};
+	struct tmplcache_t tc = {0};
+	regex_t *inc = NULL, *exc = NULL;
+	char program[TAG_NAME_MAX_LEN*2];
+	int i = 0, n = 0, rc = 1;
+
+	inc = compile_patterns(plc, d->include, d->num_include);
+	exc = compile_patterns(plc, d->exclude, d->num_exclude);
+	if (inc == NULL || exc == NULL) {
+		goto cleanup;
+	}
+
+	if (list_symbols(plc, &st, NULL) != 0) {
+		goto cleanup;
+	}
+	n = st.count;
+	for (i = 0; i < n && (d->programs || !d->enabled); i++) {
+		/* program scoped tags have their own listing, the name is copied since listing grows the name buffer */
+		if (strncmp(st.names+st.syms[i].name_off, "Program:", 8) != 0) {
+			continue;
+		}
+		snprintf(program, sizeof(program), "%s", st.names+st.syms[i].name_off);
+		if (list_symbols(plc, &st, program) != 0) {
+			goto cleanup;
+		}
+	}
+
+	/* names no longer move, resolve them and sort for lookups */
+	for (i = 0; i < st.count; i++) {
+		st.syms[i].name = st.names+st.syms[i].name_off;
+	}
+	qsort(st.syms, st.count, sizeof(struct symbol_t), compare_symbol);
+
+	check_types(plc, &st);
+	rc = build_tags(plc, &st, inc, exc, &tc);
+
+cleanup:
+	for (i = 0; i < tc.count; i++) {
+		schema_free(&tc.list[i].schema);
+	}
+	free(tc.list);
+	free_patterns(inc, d->regex ? d->num_include : 0);
+	free_patterns(exc, d->regex ? d->num_exclude : 0);
+	free(st.syms);
+	free(st.names);
+	return rc;
+}
+
+/* structure tags with neither a built in layout nor a config schema */
+static int unresolved_structs(struct plc_t *plc)
+{
+	int i = 0, n = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		n += (plc->tags[i].data_type == STRUCT && plc->tags[i].num_fields == 0);
+	}
+	return n;
+}
+
+/* run discovery for controllers that ask for it or need structure templates, configured tags are kept when the controller cannot be listed */
+int discover_config(struct plc_t *plcs, int num_plcs)
+{
+	struct plc_t *plc = NULL;
+	int i = 0, errors = 0;
+
+	for (i = 0; i < num_plcs; i++) {
+		plc = &plcs[i];
+		if (!plc->discover.enabled && unresolved_structs(plc) == 0) {
+			continue;
+		}
+		if (discover_tags(plc) != 0) {
+			fprintf(stderr, "%s: Tag discovery failed%s\n", plc->name, (plc->num_tags > 0) ? ", using configured tags" : "");
+		}
+		if (plc->num_tags <= 0) {
+			fprintf(stderr, "%s: No tags have been defined or discovered\n", plc->name);
+			errors++;
+			continue;
+		}
+		if (unresolved_structs(plc) > 0) {
+			fprintf(stderr, "%s: %d structures have no schema and no readable template, they are not published\n", plc->name, unresolved_structs(plc));
+		}
+		if (plc->coalesce && plc->discover.enabled) {
+			coalesce_tags(plc->tags, plc->num_tags);
+		}
+	}
+	return errors;
+}
+
+void discover_free(struct discover_t *d)
+{
+	int i = 0;
+
+	for (i = 0; i < d->num_include; i++) {
+		free(d->include[i]);
+	}
+	for (i = 0; i < d->num_exclude; i++) {
+		free(d->exclude[i]);
+	}
+	free(d->include);
+	free(d->exclude);
+	memset(d, 0, sizeof(struct discover_t));
+}
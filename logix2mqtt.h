@@ -11,22 +11,88 @@
 #include <time.h>
 #include <errno.h>
 #include <ctype.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <libplctag.h>
 #include <mosquitto.h>
 #include <cjson/cJSON.h>
+#include <zstd.h>
+#include <zdict.h>
 
 #define TAG_PATH_BASE "protocol=ab-eip&plc=ControlLogix&gateway=%s&path=%s&name=%s"
 #define TAG_NAME_MAX_LEN (50)
 #define TAG_PATH_MAX_LEN (200)
-#define CONFIG_MAX_LENGTH (4096)
+#define DUMP_TAGS_MAX (1000)
 #define MQTT_PORT_DEFAULT (1883)
 #define PLC_TIMEOUT_DEFAULT (5000)
 #define PLC_INTERVAL_DEFAULT (1000)
+#define TAG_COALESCE_GAP (8)
+#define SCHED_REPORT_INTERVAL (60000)
+#define PLC_RETRY_DELAY (10000)
+#define SPOOL_SIZE_DEFAULT (64)
+#define SPOOL_RATE_DEFAULT (100)
+#define SPOOL_INFLIGHT (64)
+#define STATS_INTERVAL_DEFAULT (60)
+#define METRICS_HOST_DEFAULT "127.0.0.1"
+#define METRICS_TOP_TAGS (10)
+#define WRITE_QUEUE_MAX (1024)
+#define PIPE_RING_SIZE (64)
+#define SLAB_ALIGN (8)
+#define DISCOVER_ELEMS_DEFAULT (1000)
+#define QUARANTINE_FAILS (3)
+#define QUARANTINE_BACKOFF_MIN (1000)
+#define QUARANTINE_BACKOFF_MAX (300000)
+#define COMPRESS_LEVEL_DEFAULT (3)
+#define COMPRESS_LEVEL_MAX (19)
+#define DICT_SIZE_DEFAULT (16384)
+#define DICT_SIZE_MIN (1024)
+#define DICT_SAMPLES (256)
+#define EXPR_STACK_MAX (32)
+#define HIST_SUB_BITS (3)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((40-HIST_SUB_BITS+1)*HIST_SUB)
 
-typedef enum { UNKNOWN = 0, LINT, DINT, INT, SINT, REAL, STRING, BOOL, BIT } plc_data_type_t;
+typedef enum { UNKNOWN = 0, LINT, DINT, INT, SINT, REAL, STRING, BOOL, BIT, STRUCT } plc_data_type_t;
+typedef enum { PUB_FORMAT_JSON = 0, PUB_FORMAT_MSGPACK, PUB_FORMAT_SPARKPLUG } pub_format_t;
+typedef enum { PUB_KEYS_NAME = 0, PUB_KEYS_INDEX } pub_keys_t;
+typedef enum { PUB_MODE_BLOB = 0, PUB_MODE_TAG } pub_mode_t;
+typedef enum { CATCHUP_SKIP = 0, CATCHUP_IMMEDIATE } catchup_t;
+typedef enum { QUALITY_GOOD = 0, QUALITY_STALE, QUALITY_BAD } quality_t;
+
+/* a replayed record waiting for the broker, the tail only moves past it once it is acknowledged */
+struct spool_pending_t {
+	int mid;
+	int acked;
+	uint64_t end;
+};
+
+struct spool_t {
+	int open;
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	struct spool_hdr_t *hdr;
+	uint8_t *data;
+	int rate;
+	char topic[512];
+	uint64_t sent;
+	struct spool_pending_t pending[SPOOL_INFLIGHT];
+	int first_pending;
+	int num_pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int started;
+	int stop;
+	struct mosquitto *mosq;
+	struct mqtt_t *mqtt;
+};
 
 struct mqtt_t {
 	char *broker;
@@ -37,40 +103,502 @@ struct mqtt_t {
 	int keepalive;
 	int pubqos;
 	int pubretain;
+	int pubchanges;
+	int integrity;
+	pub_format_t pubformat;
+	pub_keys_t pubkeys;
+	pub_mode_t pubmode;
+	char *spoolfile;
+	int spoolsize;
+	int replayrate;
+	char *statstopic;
+	int statsinterval;
+	char *metricslisten;
+	char *cmdtopic;
+	char *replytopic;
+	char *spgroup;
+	char *spnode;
+	int compress;
+	int compresslevel;
+	int dictsize;
+	char *dicttopic;
+	char *aggtopic;
+	uint64_t bdseq;
+	unsigned int spseq;
+	pthread_mutex_t splock;
+	struct plc_t *plcs;
+	int num_plcs;
+	struct spool_t *spool;
+	int connects;
 	int connected;
 };
 
-struct plc_t {
-	char *gateway;
-	char *path;
-	int64_t timeout;
-	int64_t interval;
+/* log linear histogram of microsecond values, HIST_SUB buckets per power of two */
+struct hist_t {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t sum;
+	uint64_t max;
+};
+
+/* per controller counters, written by the polling thread and read lock free by exporters */
+struct metrics_t {
+	struct hist_t cycle;
+	struct hist_t first;
+	struct hist_t last;
+	struct hist_t read;
+	struct hist_t publish;
+	struct hist_t compress;
+	uint64_t cycles;
+	uint64_t overruns;
+	uint64_t missed;
+	uint64_t timeouts;
+	uint64_t read_errors;
+	uint64_t dropped;
+	uint64_t quarantines;
+	uint64_t raw_bytes;
+	uint64_t compressed_bytes;
+	uint64_t samples_dropped;
+	int64_t last_stats;
+};
+
+struct metrics_srv_t {
+	int fd;
+	struct plc_t *plcs;
+	int num_plcs;
+	pthread_t thread;
+	int started;
+	volatile int stop;
+};
+
+/* samples of a fast read tag waiting for the next publish, the polling thread fills it and the publisher drains it */
+struct ring_t {
+	int64_t *stamps;
+	uint8_t *values;
+	size_t size;
+	unsigned int cap;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int taken;
+};
+
+/* running statistics of a tag over one aggregation window, mean and squared deviations are kept the Welford way
+ * pos counts the values of the publish being folded that already went into a window */
+struct agg_t {
+	uint64_t count;
+	double min;
+	double max;
+	double mean;
+	double m2;
+	unsigned int pos;
+};
+
+/* one instruction of a derived tag's expression, run on a stack of doubles */
+struct op_t {
+	int code;
+	double value;
+	struct tag_t *tag;
+};
+
+/* compiled expression of a derived tag, its inputs are read in the same scan class */
+struct expr_t {
+	struct op_t *ops;
+	int num_ops;
+	struct tag_t **inputs;
+	int num_inputs;
+};
+
+/* zstd compression of blob payloads with a dictionary trained on the controller's own tag set */
+struct compress_t {
+	ZSTD_CCtx *cctx;
+	ZSTD_CDict *cdict;
+	uint8_t *dict;
+	size_t dict_len;
+	unsigned int dict_id;
+	char *buf;
+	size_t size;
+	int sent;
+};
+
+/* one member of a structure, bit fields name the bit counted from the offset */
+struct field_t {
+	const char *name;
+	plc_data_type_t type;
+	int offset;
+	int bit;
+};
+
+/* field layout of a built in structure, a config schema or a controller template */
+struct schema_t {
+	char *name;
+	int size;
+	struct field_t *fields;
+	int num_fields;
+	char *names;
+};
+
+/* symbol table discovery for one controller, patterns are globs unless regex is set */
+struct discover_t {
+	int enabled;
+	int regex;
+	int programs;
+	int max_elems;
+	char **include;
+	int num_include;
+	char **exclude;
+	int num_exclude;
+};
+
+struct waiter_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;
+};
+
+struct payload_t {
+	char *buf;
+	size_t size;
+	size_t len;
+	int count;
+	pub_format_t format;
+	uint64_t seq;
 };
 
 struct tag_t {
 	char *name;
-	char *path;
+	int index;
+	char *key;
+	size_t key_len;
+	char *topic;
 	int status;
+	int pending;
+	struct waiter_t *waiter;
+	int keep;
+	int wslot;
+	struct tag_t *writer;
+	int64_t read_start;
+	int64_t read_done;
+	int64_t read_max;
+	int64_t timeout;
+	int64_t deadline;
+	quality_t quality;
+	quality_t view_quality;
+	quality_t pub_quality;
+	int fails;
+	int64_t backoff;
+	int64_t retry_at;
 	int elem_count;
 	int elem_size;
 	plc_data_type_t data_type;
 	size_t data_size;
 	int32_t plctag;
 	void *data;
+	size_t offset;
+	struct tag_t *parent;
+	int elem_index;
+	int field;
+	int field_offset;
+	int bit;
+	int num_fields;
+	int64_t scan;
+	int64_t sample;
+	struct ring_t *ring;
+	int64_t aggregate;
+	struct agg_t *agg;
+	char *expr;
+	struct expr_t *code;
+	int hidden;
+	double deadband;
+	double deadband_pct;
+	void *shadow;
+	double last_value;
+	int published;
+	int changed;
+};
+
+/* a queued write, only the last value per tag is kept until the queue is flushed */
+struct write_t {
+	struct tag_t *tag;
+	double value;
+	char *str;
+	char *id;
 };
 
+struct batch_msg_t {
+	struct tag_t *tag;
+	size_t offset;
+	size_t len;
+	int rc;
+};
+
+struct batch_t {
+	char *buf;
+	size_t size;
+	size_t len;
+	struct batch_msg_t *msgs;
+	int count;
+	int max;
+};
+
+struct scan_t {
+	int64_t rate;
+	int64_t next;
+	int64_t publish;
+	int64_t next_publish;
+	int64_t window;
+	int64_t window_end;
+	int num_tags;
+	struct tag_t **tags;
+	int connects;
+	int64_t last_full;
+	int64_t stamp;
+	int slot;
+	int busy[2];
+	int num_hot;
+	int num_derived;
+	struct tag_t **derived;
+	int32_t *handles;
+	uint32_t *offsets;
+	uint32_t *sizes;
+	uint8_t *types;
+	uint8_t *qualities;
+	struct payload_t payload;
+	struct batch_t batch;
+	int64_t stat_start;
+	int cycles;
+	int overruns;
+	int missed;
+	int failures;
+};
+
+/* one scan whose reads completed into snapshot buffer slot, waiting to be published */
+struct pipe_job_t {
+	struct scan_t *scan;
+	int slot;
+	int64_t stamp;
+};
+
+/* single producer single consumer ring from the polling thread to the publisher thread */
+struct pipe_t {
+	struct pipe_job_t jobs[PIPE_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	sem_t sem;
+	uint64_t pushed;
+	uint64_t done;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	pthread_t thread;
+	int started;
+	volatile int stop;
+};
+
+struct sched_t {
+	struct scan_t *scans;
+	int num_scans;
+	struct scan_t **heap;
+	int count;
+	struct scan_t **ready;
+	int num_ready;
+	struct tag_t **due;
+	int num_due;
+	int64_t last_report;
+	catchup_t catchup;
+};
+
+struct plc_t {
+	char *name;
+	char *gateway;
+	char *path;
+	char *pubtopic;
+	int number;
+	int64_t timeout;
+	int64_t interval;
+	int coalesce;
+	catchup_t catchup;
+	struct discover_t discover;
+	struct tag_t *tags;
+	int num_tags;
+	char *names;
+	struct tag_t **all;
+	struct tag_t **index;
+	uint8_t *slab;
+	size_t slab_len;
+	uint8_t *slab_prev;
+	struct sched_t sched;
+	struct waiter_t waiter;
+	struct metrics_t metrics;
+	struct pipe_t pipe;
+	struct payload_t birth;
+	int births;
+	struct compress_t compress;
+	struct mosquitto *mosq;
+	struct mqtt_t *mqtt;
+	pthread_mutex_t lock;
+	pthread_cond_t wcond;
+	struct write_t *wq;
+	int wq_count;
+	struct write_t *wbatch;
+	struct tag_t **wtags;
+	struct plc_t *next;
+	pthread_t thread;
+	int started;
+};
+
+/* defined in main.c */
+extern volatile sig_atomic_t run;
+extern volatile sig_atomic_t reload;
+int publish_message(struct plc_t *plc, const char *topic, const void *buf, int len);
+void publish_tag_data(struct plc_t *plc, struct scan_t *scan);
+
 /* defined in util.c */
 int sleep_ms(int ms);
 int64_t time_ms(void);
+int64_t time_us(void);
+int64_t mono_ms(void);
 void *my_malloc(size_t size);
 char *strlower(char * s);
 plc_data_type_t get_plc_data_type(const char * s);
 const char *get_plc_data_type_str(plc_data_type_t t);
 void pad_spaces(FILE *fd, int n);
+pub_format_t get_pub_format(const char * s);
+const char *get_pub_format_str(pub_format_t f);
+int get_tag_number(struct tag_t *tag, double *value);
+size_t get_plc_data_type_size(plc_data_type_t t);
+int get_tag_bit(struct tag_t *tag);
+size_t get_tag_value_size(struct tag_t *tag);
+int tag_changed(struct tag_t *tag);
+quality_t tag_quality(struct tag_t *tag);
+const char *get_quality_str(quality_t q);
+
+/* defined in waiter.c */
+int cond_init_mono(pthread_cond_t *cond);
+int waiter_init(struct waiter_t *w);
+void waiter_destroy(struct waiter_t *w);
+void waiter_arm(struct waiter_t *w, struct tag_t *tag);
+void waiter_done(struct waiter_t *w, struct tag_t *tag, int status);
+int waiter_wait(struct waiter_t *w, struct tag_t **tags, int num_tags, int64_t deadline);
+void waiter_reset(struct waiter_t *w, struct tag_t **tags, int num_tags);
+void waiter_callback(int32_t tag_id, int event, int status, void *userdata);
+int read_tags(struct waiter_t *w, struct tag_t **tags, int num_tags, int64_t deadline, struct metrics_t *m);
+
+/* defined in sched.c */
+int sched_init(struct sched_t *s, struct tag_t *tags, int num_tags, int64_t interval);
+void sched_free(struct sched_t *s);
+void sched_push(struct sched_t *s, struct scan_t *scan);
+struct scan_t *sched_peek(struct sched_t *s);
+struct scan_t *sched_pop(struct sched_t *s);
+void sched_start(struct sched_t *s, int64_t now);
+int sched_collect(struct sched_t *s, int64_t now);
+int sched_done(struct sched_t *s, struct scan_t *scan, int64_t end);
+void sched_report(struct sched_t *s, const char *name, int64_t now);
+
+/* defined in payload.c */
+int payload_compile(struct payload_t *p, struct tag_t **tags, int num_tags, int format, int keys, uint64_t alias);
+int payload_compile_birth(struct payload_t *p, struct tag_t *tags, int num_tags);
+void payload_free(struct payload_t *p);
+void payload_begin(struct payload_t *p, int64_t stamp);
+int payload_add(struct payload_t *p, struct tag_t *tag);
+int payload_birth_add(struct payload_t *p, struct tag_t *tag, const void *data);
+int payload_add_samples(struct payload_t *p, struct tag_t *tag);
+int payload_quality(struct payload_t *p, struct tag_t **tags, int num_tags);
+size_t payload_end(struct payload_t *p);
+size_t payload_write_value(char *out, struct tag_t *tag, int format);
+size_t payload_value_max(struct tag_t *tag);
+size_t payload_node(char *out, int64_t stamp, uint64_t bdseq, int birth);
+
+/* defined in batch.c */
+int batch_compile(struct batch_t *b, struct tag_t **tags, int num_tags, const char *prefix);
+void batch_free(struct batch_t *b);
+void batch_begin(struct batch_t *b);
+int batch_add(struct batch_t *b, struct tag_t *tag, int format);
+int batch_flush(struct batch_t *b, struct mosquitto *mosq, int qos, int retain);
+
+/* defined in spool.c */
+int spool_open(struct spool_t *s, const char *fn, uint64_t capacity, int rate);
+int spool_append(struct spool_t *s, const char *topic, const void *payload, int payload_len);
+int spool_start(struct spool_t *s, struct mosquitto *mosq, struct mqtt_t *mqtt);
+void spool_wake(struct spool_t *s);
+void spool_ack(struct spool_t *s, int mid);
+void spool_close(struct spool_t *s);
+
+/* defined in metrics.c */
+void metrics_add(uint64_t *counter, uint64_t n);
+void hist_record(struct hist_t *h, int64_t us);
+uint64_t hist_count(struct hist_t *h);
+int64_t hist_percentile(struct hist_t *h, double pct);
+void metrics_publish(struct plc_t *plc, int64_t now);
+int metrics_start(struct metrics_srv_t *s, const char *listen, struct plc_t *plcs, int num_plcs);
+void metrics_stop(struct metrics_srv_t *s);
+
+/* defined in write.c */
+void write_message(struct mqtt_t *mqtt, const char *topic, const void *payload, int len);
+int write_wait(struct plc_t *plc, int64_t deadline);
+void write_flush(struct plc_t *plc);
+void write_discard(struct plc_t *plc, const char *reason);
+void write_release(struct tag_t *tag);
+
+/* defined in pipe.c */
+int pipe_start(struct plc_t *plc);
+void pipe_fill(struct plc_t *plc, struct scan_t *scan, int slot);
+int pipe_push(struct plc_t *plc, struct scan_t *scan, int64_t stamp);
+void pipe_drain(struct plc_t *plc);
+void pipe_stop(struct plc_t *plc);
+
+/* defined in plc.c */
+int plc_init(struct plc_t *plc, struct mosquitto *mosq, struct mqtt_t *mqtt);
+int plc_setup(struct plc_t *plc);
+void plc_release(struct plc_t *plc);
+void plc_free(struct plc_t *plc);
+int plc_prepare(struct plc_t *plc, struct plc_t *next);
+struct tag_t *plc_find_tag(struct plc_t *plc, const char *name);
+void *plc_thread(void *arg);
+
+/* defined in sparkplug.c */
+int sparkplug_topic(char *buf, size_t size, struct mqtt_t *mqtt, const char *type, const char *device);
+int sparkplug_will(struct mosquitto *mosq, struct mqtt_t *mqtt);
+int sparkplug_node_birth(struct mosquitto *mosq, struct mqtt_t *mqtt);
+int sparkplug_node_death(struct mosquitto *mosq, struct mqtt_t *mqtt);
+int sparkplug_birth(struct plc_t *plc, struct scan_t *scan);
+void sparkplug_death(struct plc_t *plc);
+int sparkplug_command(struct mosquitto *mosq, struct mqtt_t *mqtt, const char *topic, const void *payload, int len);
+uint64_t sparkplug_seq(struct mqtt_t *mqtt);
+
+/* defined in sample.c */
+int sample_setup(struct plc_t *plc);
+void sample_free(struct plc_t *plc);
+void sample_push(struct plc_t *plc, struct scan_t *scan, int64_t cycle, int64_t clock);
+unsigned int sample_take(struct ring_t *r);
+void sample_release(struct ring_t *r);
+
+/* defined in aggregate.c */
+int aggregate_setup(struct plc_t *plc);
+void aggregate_free(struct plc_t *plc);
+void aggregate_scan(struct plc_t *plc, struct scan_t *scan);
+
+/* defined in derive.c */
+int derive_compile(struct plc_t *plc);
+void derive_free(struct plc_t *plc);
+void derive_scan(struct scan_t *scan);
+
+/* defined in compress.c */
+int compress_train(struct plc_t *plc);
+int compress_publish_dict(struct plc_t *plc);
+size_t compress_payload(struct plc_t *plc, const void *src, size_t len);
+void compress_free(struct compress_t *c);
+
+/* defined in discover.c */
+int discover_config(struct plc_t *plcs, int num_plcs);
+void discover_free(struct discover_t *d);
 
 /* defined in config.c */
-struct tag_t *read_conf_file(const char *fn, struct mqtt_t *mqtt, struct plc_t *plc, int *num_tags);
-int check_config(struct mqtt_t *mqtt, struct plc_t *plc, struct tag_t *tags, int num_tags);
-void dump_config(struct mqtt_t *mqtt, struct plc_t *plc, struct tag_t *tags, int num_tags);
+int coalesce_tags(struct tag_t *tags, int num_tags);
+struct schema_t *schema_builtin(const char *type);
+void schema_free(struct schema_t *s);
+size_t fields_name_len(const char *leader, struct schema_t *sc);
+int expand_fields(struct tag_t *tags, int leader, int first, struct schema_t *sc, char *names, size_t *used);
+struct plc_t *read_conf_file(const char *fn, struct mqtt_t *mqtt, int *num_plcs);
+int check_config(struct mqtt_t *mqtt, struct plc_t *plcs, int num_plcs);
+void config_free(struct plc_t *plc);
+void dump_config(struct mqtt_t *mqtt, struct plc_t *plcs, int num_plcs);
 
 #endif
@@ -3,7 +3,8 @@
 const char *program = "logix2mqtt";
 const char *version = "2023.10.24";
 
-static volatile sig_atomic_t run = 1;
+volatile sig_atomic_t run = 1;
+volatile sig_atomic_t reload = 0;
 
 void sig_handler(int signum)
 {
@@ -14,7 +15,7 @@ void sig_handler(int signum)
 		run = 0;
 		break;
 	case SIGHUP:
-		/* do nothing */
+		reload = 1;
 		break;
 	default:
 		break;
@@ -24,6 +25,7 @@ void sig_handler(int signum)
 void on_connect(struct mosquitto *mosq, void *obj, int rc)
 {
 	struct mqtt_t *mqtt = (struct mqtt_t *)obj;
+	char topic[512];
 
 	if (rc != 0) {
 		fprintf(stderr, "Failed to connect to MQTT broker: %s\n", mosquitto_connack_string(rc));
@@ -35,7 +37,28 @@ void on_connect(struct mosquitto *mosq, void *obj, int rc)
 	}
 	fprintf(stderr, "Connected to MQTT broker\n");
 	if (mqtt != NULL) {
+		/* the node is born before any controller publishes its own birth and data */
+		if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG) {
+			sparkplug_node_birth(mosq, mqtt);
+			sparkplug_topic(topic, sizeof(topic), mqtt, "NCMD", NULL);
+			rc = mosquitto_subscribe(mosq, NULL, topic, 1);
+			if (rc != MOSQ_ERR_SUCCESS) {
+				fprintf(stderr, "Failed to subscribe to %s: %s\n", topic, mosquitto_strerror(rc));
+			}
+		}
+		/* send everything after a reconnect */
+		__atomic_add_fetch(&mqtt->connects, 1, __ATOMIC_RELEASE);
 		mqtt->connected = 1;
+		/* start replaying anything spooled while disconnected */
+		spool_wake(mqtt->spool);
+		/* subscriptions do not survive a clean session reconnect */
+		if (mqtt->cmdtopic != NULL) {
+			snprintf(topic, sizeof(topic), "%s/+", mqtt->cmdtopic);
+			rc = mosquitto_subscribe(mosq, NULL, topic, mqtt->pubqos);
+			if (rc != MOSQ_ERR_SUCCESS) {
+				fprintf(stderr, "Failed to subscribe to %s: %s\n", topic, mosquitto_strerror(rc));
+			}
+		}
 	}
 }
 
@@ -48,72 +71,352 @@ void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
 			fprintf(stderr, "Disconnected from MQTT broker\n");
 		}
 		mqtt->connected = 0;
+		/* every session gets a new bdSeq, the will for the next connect has to match its birth */
+		if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG) {
+			mqtt->bdseq = (mqtt->bdseq+1) & 0xff;
+			sparkplug_will(mosq, mqtt);
+		}
+	}
+}
+
+/* replayed spool records are released once the broker has them */
+void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	struct mqtt_t *mqtt = (struct mqtt_t *)obj;
+
+	if (mqtt != NULL) {
+		spool_ack(mqtt->spool, mid);
 	}
 }
 
-void publish_tag_data(struct mosquitto *mosq, struct mqtt_t *mqtt, struct tag_t *tags, int num_tags)
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
 {
-	int i = 0, rc = 0;
-	cJSON *obj = NULL, *val = NULL;
-	char *str = NULL;
+	struct mqtt_t *mqtt = (struct mqtt_t *)obj;
+
+	if (mqtt != NULL && msg->payloadlen > 0) {
+		if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG && sparkplug_command(mosq, mqtt, msg->topic, msg->payload, msg->payloadlen)) {
+			return;
+		}
+		write_message(mqtt, msg->topic, msg->payload, msg->payloadlen);
+	}
+}
+
+/* publish a message, falling back to the spool while the broker is unreachable */
+int publish_message(struct plc_t *plc, const char *topic, const void *buf, int len)
+{
+	struct mqtt_t *mqtt = plc->mqtt;
+	int rc = MOSQ_ERR_NO_CONN;
+
+	if (mqtt->connected) {
+		rc = mosquitto_publish(plc->mosq, NULL, topic, len, buf, mqtt->pubqos, mqtt->pubretain);
+	}
+	if (rc != MOSQ_ERR_SUCCESS && mqtt->spool != NULL && spool_append(mqtt->spool, topic, buf, len) == 0) {
+		rc = MOSQ_ERR_SUCCESS;
+	}
+	return rc;
+}
 
-	if (mosq == NULL || mqtt == NULL || tags == NULL || !mqtt->connected || num_tags < 0) {
+/* publish changed tags to their own topics as one batch */
+static void publish_tag_topics(struct plc_t *plc, struct scan_t *scan, int full)
+{
+	struct mqtt_t *mqtt = plc->mqtt;
+	struct batch_t *batch = &scan->batch;
+	struct tag_t *tag = NULL;
+	int i = 0, failed = 0;
+
+	if (batch->buf == NULL) {
+		fprintf(stderr, "Message batch has not been compiled\n");
 		return;
 	}
+	batch_begin(batch);
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = scan->tags[i];
+		/* per tag topics have nowhere to carry a quality flag, so they only get fresh values */
+		if (tag->data != NULL && tag_quality(tag) == QUALITY_GOOD && (full || tag_changed(tag))) {
+			batch_add(batch, tag, mqtt->pubformat);
+		}
+	}
+	if (mqtt->connected) {
+		failed = batch_flush(batch, plc->mosq, mqtt->pubqos, mqtt->pubretain);
+	} else {
+		for (i = 0; i < batch->count; i++) {
+			batch->msgs[i].rc = MOSQ_ERR_NO_CONN;
+		}
+		failed = batch->count;
+	}
 
-	obj = cJSON_CreateObject();
-	if (obj == NULL) {
-		fprintf(stderr, "Failed to create json object for publish\n");
+	/* keep failed messages for replay */
+	if (failed > 0 && mqtt->spool != NULL) {
+		for (i = 0; i < batch->count; i++) {
+			if (batch->msgs[i].rc != MOSQ_ERR_SUCCESS &&
+			    spool_append(mqtt->spool, batch->msgs[i].tag->topic, batch->buf+batch->msgs[i].offset, batch->msgs[i].len) == 0) {
+				batch->msgs[i].rc = MOSQ_ERR_SUCCESS;
+				failed--;
+			}
+		}
+	}
+	if (failed > 0 && mqtt->connected) {
+		fprintf(stderr, "Error publishing %d of %d tag messages\n", failed, batch->count);
+	}
+
+	/* remember what subscribers have seen */
+	for (i = 0; i < batch->count; i++) {
+		tag = batch->msgs[i].tag;
+		if (batch->msgs[i].rc == MOSQ_ERR_SUCCESS && tag->shadow != NULL) {
+			memcpy(tag->shadow, tag->data, get_tag_value_size(tag));
+			get_tag_number(tag, &tag->last_value);
+			tag->published = 1;
+		}
+	}
+}
+
+/* publish a finished blob payload, compressed when a dictionary has been trained */
+static int publish_payload(struct plc_t *plc, struct payload_t *payload, int connects)
+{
+	const char *buf = payload->buf;
+	size_t len = payload->len;
+
+	if (plc->compress.cdict != NULL) {
+		/* subscribers need the dictionary first, it is retained and sent again after every reconnect */
+		if (plc->compress.sent != connects && compress_publish_dict(plc) == MOSQ_ERR_SUCCESS) {
+			plc->compress.sent = connects;
+		}
+		len = compress_payload(plc, payload->buf, payload->len);
+		if (len == 0) {
+			return MOSQ_ERR_INVAL;
+		}
+		buf = plc->compress.buf;
+	}
+	return publish_message(plc, plc->pubtopic, buf, len);
+}
+
+/* publish every sample taken since the last publish as columns, one blob even in tag mode */
+static void publish_samples(struct plc_t *plc, struct scan_t *scan, int connects)
+{
+	struct payload_t *payload = &scan->payload;
+	struct tag_t *tag = NULL;
+	int i = 0, rc = 0, count = 0;
+
+	if (payload->buf == NULL) {
+		fprintf(stderr, "Payload buffer has not been compiled\n");
+		return;
+	}
+	payload_begin(payload, scan->stamp);
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = scan->tags[i];
+		if (tag->ring != NULL && sample_take(tag->ring) > 0) {
+			count += payload_add_samples(payload, tag);
+		}
+	}
+	if (count > 0) {
+		if (payload->format == PUB_FORMAT_SPARKPLUG) {
+			pthread_mutex_lock(&plc->mqtt->splock);
+			payload->seq = sparkplug_seq(plc->mqtt);
+		}
+		payload_end(payload);
+		rc = publish_payload(plc, payload, connects);
+		if (payload->format == PUB_FORMAT_SPARKPLUG) {
+			pthread_mutex_unlock(&plc->mqtt->splock);
+		}
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error publishing samples: %s\n", mosquitto_strerror(rc));
+		}
+	}
+	/* samples that could not be published are not kept, the ring is sized for the next interval only */
+	for (i = 0; i < scan->num_tags; i++) {
+		if (scan->tags[i]->ring != NULL) {
+			sample_release(scan->tags[i]->ring);
+		}
+	}
+}
+
+void publish_tag_data(struct plc_t *plc, struct scan_t *scan)
+{
+	struct mosquitto *mosq = plc->mosq;
+	struct mqtt_t *mqtt = plc->mqtt;
+	struct payload_t *payload = NULL;
+	int i = 0, rc = 0, full = 1, count = 0, connects = 0, requality = 0;
+	int num_tags = 0;
+	quality_t q = QUALITY_GOOD;
+	int64_t now = 0;
+	struct tag_t *tag = NULL;
+
+	/* aggregating scans only publish when a window closes, their windows keep filling while disconnected */
+	if (mosq != NULL && mqtt != NULL && scan != NULL && scan->window > 0) {
+		aggregate_scan(plc, scan);
+		return;
+	}
+	if (mosq == NULL || mqtt == NULL || scan == NULL || (!mqtt->connected && mqtt->spool == NULL) || scan->num_tags < 0) {
+		return;
+	}
+	num_tags = scan->num_tags;
+	payload = &scan->payload;
+
+	/* decide between a change only and a full integrity publish */
+	now = mono_ms();
+	connects = __atomic_load_n(&mqtt->connects, __ATOMIC_ACQUIRE);
+	if (mqtt->pubchanges || mqtt->pubmode == PUB_MODE_TAG) {
+		full = (scan->last_full == 0 || scan->connects != connects ||
+			(mqtt->integrity > 0 && now-scan->last_full >= (int64_t)mqtt->integrity*1000));
+	}
+
+	/* aliases mean nothing to a host that has not seen this controller's birth since it last connected */
+	if (mqtt->pubformat == PUB_FORMAT_SPARKPLUG && plc->births != connects) {
+		if (sparkplug_birth(plc, scan) != MOSQ_ERR_SUCCESS) {
+			return;
+		}
+		plc->births = connects;
+	}
+
+	if (scan->publish > 0) {
+		publish_samples(plc, scan, connects);
+		return;
+	}
+
+	if (mqtt->pubmode == PUB_MODE_TAG) {
+		publish_tag_topics(plc, scan, full);
+		if (full) {
+			scan->last_full = now;
+			scan->connects = connects;
+		}
 		return;
 	}
-	val = cJSON_CreateNumber((double)time_ms());
-	if (val != NULL) {
-		cJSON_AddItemToObject(obj, "stamp", val);
+
+	if (payload->buf == NULL) {
+		fprintf(stderr, "Payload buffer has not been compiled\n");
+		return;
 	}
+
+	/* format into the preallocated payload buffer */
+	payload_begin(payload, scan->stamp);
 	for (i = 0; i < num_tags; i++) {
-		if (tags[i].plctag > 0 && tags[i].data != NULL) {
-			val = NULL;
-			switch (tags[i].data_type) {
-			case BIT:
-				val = cJSON_CreateNumber((double)plc_tag_get_bit(tags[i].plctag, 0));
-				break;
-			case BOOL:
-			case SINT:
-				val = cJSON_CreateNumber((double)*(int8_t *)tags[i].data);
-				break;
-			case INT:
-				val = cJSON_CreateNumber((double)*(int16_t *)tags[i].data);
-				break;
-			case DINT:
-				val = cJSON_CreateNumber((double)*(int32_t *)tags[i].data);
-				break;
-			case LINT:
-				val = cJSON_CreateNumber((double)*(int64_t *)tags[i].data);
-				break;
-			case STRING:
-				val = cJSON_CreateString((const char *)tags[i].data+4);
-				break;
-			case UNKNOWN:
-			default:
-				break;
+		tag = scan->tags[i];
+		tag->changed = 0;
+		q = tag_quality(tag);
+		requality |= (q != tag->pub_quality);
+		/* a tag that never read successfully has no value, only its quality goes out */
+		if (tag->data != NULL && q != QUALITY_BAD) {
+			/* sparkplug quality lives on the metric, so a recovered tag is sent again to clear it */
+			if (!full && !tag_changed(tag) && !(payload->format == PUB_FORMAT_SPARKPLUG && q != tag->pub_quality)) {
+				continue;
 			}
-			if (val != NULL) {
-				cJSON_AddItemToObject(obj, tags[i].name, val);
+			if (payload_add(payload, tag)) {
+				tag->changed = 1;
+				count++;
 			}
 		}
 	}
-	str = cJSON_PrintUnformatted(obj);
-	cJSON_Delete(obj);
-	if (str == NULL) {
-		fprintf(stderr, "Failed to format json object\n");
-	} else {
-		fprintf(stderr, "%s\n", str);
-		rc = mosquitto_publish(mosq, NULL, mqtt->pubtopic, strlen(str), str, mqtt->pubqos, mqtt->pubretain);
-		if (rc != MOSQ_ERR_SUCCESS) {
-			fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
+	if (count == 0 && !full && !requality) {
+		/* nothing changed since the last publish */
+		return;
+	}
+	payload_quality(payload, scan->tags, num_tags);
+	/* sparkplug messages take their sequence number and go out under one lock shared by all controllers */
+	if (payload->format == PUB_FORMAT_SPARKPLUG) {
+		pthread_mutex_lock(&mqtt->splock);
+		payload->seq = sparkplug_seq(mqtt);
+	}
+	payload_end(payload);
+
+	rc = publish_payload(plc, payload, connects);
+	if (payload->format == PUB_FORMAT_SPARKPLUG) {
+		pthread_mutex_unlock(&mqtt->splock);
+	}
+	if (rc == MOSQ_ERR_SUCCESS) {
+		for (i = 0; i < num_tags; i++) {
+			scan->tags[i]->pub_quality = tag_quality(scan->tags[i]);
+		}
+	}
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
+	} else if (mqtt->pubchanges) {
+		/* remember what subscribers have seen */
+		for (i = 0; i < num_tags; i++) {
+			tag = scan->tags[i];
+			if (tag->changed && tag->shadow != NULL) {
+				memcpy(tag->shadow, tag->data, get_tag_value_size(tag));
+				get_tag_number(tag, &tag->last_value);
+				tag->published = 1;
+			}
+		}
+		if (full) {
+			scan->last_full = now;
+			scan->connects = connects;
+		}
+	}
+}
+
+/* re-read the config file and hand each controller its new tag set, broker and controller addresses need a restart */
+static void reload_config(const char *fn, struct plc_t *plcs, int num_plcs)
+{
+	struct mqtt_t conf = {0};
+	struct plc_t *next = NULL, *p = NULL;
+	int num_next = 0, i = 0, j = 0;
+
+	fprintf(stderr, "Reloading %s\n", fn);
+	next = read_conf_file(fn, &conf, &num_next);
+	if (next == NULL || check_config(&conf, next, num_next) != 0 || discover_config(next, num_next) != 0) {
+		fprintf(stderr, "Keeping current configuration\n");
+		num_next = (next != NULL) ? num_next : 0;
+		goto cleanup;
+	}
+
+	for (j = 0; j < num_next; j++) {
+		for (i = 0; i < num_plcs; i++) {
+			if (strcmp(plcs[i].name, next[j].name) == 0) {
+				break;
+			}
+		}
+		if (i == num_plcs) {
+			fprintf(stderr, "%s: Adding a controller requires a restart\n", next[j].name);
+			continue;
+		}
+		if (strcmp(plcs[i].gateway, next[j].gateway) != 0 || strcmp(plcs[i].path, next[j].path) != 0) {
+			fprintf(stderr, "%s: Gateway or path changed, restart to apply\n", plcs[i].name);
+			continue;
+		}
+		if (__atomic_load_n(&plcs[i].next, __ATOMIC_ACQUIRE) != NULL) {
+			fprintf(stderr, "%s: Previous reload still pending\n", plcs[i].name);
+			continue;
+		}
+
+		/* move the parsed controller out of the array so it can be handed over */
+		p = my_malloc(sizeof(struct plc_t));
+		if (p == NULL) {
+			fprintf(stderr, "%s: Failed to allocate memory for reload\n", plcs[i].name);
+			continue;
 		}
-		free(str);
+		*p = next[j];
+		memset(&next[j], 0, sizeof(struct plc_t));
+		if (plc_prepare(&plcs[i], p) != 0) {
+			fprintf(stderr, "%s: Reload failed, keeping current tags\n", plcs[i].name);
+			plc_free(p);
+			free(p);
+			continue;
+		}
+		pthread_mutex_lock(&plcs[i].lock);
+		plcs[i].next = p;
+		pthread_mutex_unlock(&plcs[i].lock);
+	}
+
+cleanup:
+	for (j = 0; j < num_next; j++) {
+		plc_free(&next[j]);
 	}
+	free(next);
+	free(conf.broker);
+	free(conf.username);
+	free(conf.password);
+	free(conf.pubtopic);
+	free(conf.spoolfile);
+	free(conf.statstopic);
+	free(conf.metricslisten);
+	free(conf.cmdtopic);
+	free(conf.replytopic);
+	free(conf.spgroup);
+	free(conf.spnode);
+	free(conf.dicttopic);
+	free(conf.aggtopic);
 }
 
 int main(int argc, char **argv)
@@ -121,17 +424,12 @@ int main(int argc, char **argv)
 	int i = 0;
 	int rc = 0;
 	int exit_code = 0;
-	int delay = 0;
-	int done = 0;
-	int num_tags = 0;
-	int valid_tags = 0;
-	int64_t timeout = 0;
-	int64_t start = 0;
-	int64_t end = 0;
+	int num_plcs = 0;
 	struct mosquitto *mosq = NULL;
-	struct tag_t *tags = NULL;
+	struct plc_t *plcs = NULL;
 	struct mqtt_t mqtt = {0};
-	struct plc_t plc = {0};
+	struct spool_t spool = {0};
+	struct metrics_srv_t metrics = {0};
 
 	/* check usage */
 	if (argc < 2) {
@@ -148,6 +446,9 @@ int main(int argc, char **argv)
 	signal(SIGQUIT, sig_handler);
 	signal(SIGTERM, sig_handler);
 
+	/* serializes sparkplug sequence numbers across controller threads */
+	pthread_mutex_init(&mqtt.splock, NULL);
+
 	/* initialize libmosquitto */
 	mosquitto_lib_init();
 	mosq = mosquitto_new(program, true, (void *)&mqtt);
@@ -157,18 +458,50 @@ int main(int argc, char **argv)
 	}
 	mosquitto_connect_callback_set(mosq, on_connect);
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
+	mosquitto_message_callback_set(mosq, on_message);
+	mosquitto_publish_callback_set(mosq, on_publish);
 
-	/* read json conf file and create tag structure */
-	tags = read_conf_file(argv[1], &mqtt, &plc, &num_tags);
-	if (check_config(&mqtt, &plc, tags, num_tags) != 0) {
+	/* read json conf file and create controller and tag structures */
+	plcs = read_conf_file(argv[1], &mqtt, &num_plcs);
+	if (plcs == NULL || check_config(&mqtt, plcs, num_plcs) != 0) {
+		exit_code = 1;
+		goto cleanup;
+	}
+
+	/* build tag sets from the controllers' symbol tables where asked */
+	if (discover_config(plcs, num_plcs) != 0) {
 		exit_code = 1;
 		goto cleanup;
 	}
 	/* dump config for debugging purposes */
-	dump_config(&mqtt, &plc, tags, num_tags);
+	dump_config(&mqtt, plcs, num_plcs);
+
+	/* group tags into scan classes */
+	for (i = 0; i < num_plcs; i++) {
+		plcs[i].number = i;
+		if (plc_init(&plcs[i], mosq, &mqtt) != 0) {
+			exit_code = 1;
+			goto cleanup;
+		}
+	}
+	mqtt.plcs = plcs;
+	mqtt.num_plcs = num_plcs;
+
+	/* open store and forward spool */
+	if (mqtt.spoolfile != NULL) {
+		if (spool_open(&spool, mqtt.spoolfile, (uint64_t)mqtt.spoolsize*1024*1024, mqtt.replayrate) != 0) {
+			exit_code = 1;
+			goto cleanup;
+		}
+		mqtt.spool = &spool;
+	}
 
-	/* connect to mqtt broker */
+	/* connect to mqtt broker, a sparkplug node registers its death certificate first */
 	mosquitto_username_pw_set(mosq, mqtt.username, mqtt.password);
+	if (mqtt.pubformat == PUB_FORMAT_SPARKPLUG && sparkplug_will(mosq, &mqtt) != 0) {
+		exit_code = 1;
+		goto cleanup;
+	}
 	rc = mosquitto_connect(mosq, mqtt.broker, mqtt.port, mqtt.keepalive);
 	if (rc != MOSQ_ERR_SUCCESS) {
 		fprintf(stderr, "Failed to connect to mqtt broker: %s\n", mosquitto_strerror(rc));
@@ -177,196 +510,88 @@ int main(int argc, char **argv)
 	}
 
 	/* start mqtt network loop */
-	mosquitto_loop_start(mosq);
+	rc = mosquitto_loop_start(mosq);
 	if (rc != MOSQ_ERR_SUCCESS) {
 		fprintf(stderr, "Failed to start mqtt network loop: %s\n", mosquitto_strerror(rc));
 		exit_code = 1;
 		goto cleanup;
 	}
 
-	/* set timeout for tag create and initial read */
-	timeout = time_ms() + plc.timeout;
-
-	/* create plc tags */
-	for (i = 0; i < num_tags; i++) {
-		if (tags[i].name != NULL && strlen(tags[i].name) > 0) {
-			if (tags[i].path != NULL) {
-				free(tags[i].path);
-				tags[i].path = NULL;
-			}
-			tags[i].path = my_malloc(TAG_PATH_MAX_LEN);
-			snprintf(tags[i].path, TAG_PATH_MAX_LEN-1, TAG_PATH_BASE, plc.gateway, plc.path, tags[i].name);
-			//printf("%s\n", tags[i].path);
-			tags[i].plctag = plc_tag_create(tags[i].path, 0);
-			if (tags[i].plctag > 0) {
-				valid_tags++;
-			} else {
-				fprintf(stderr, "Could not create tag [%d]: %s\n", tags[i].plctag, plc_tag_decode_error(tags[i].plctag));
-			}
-		}
-	}
-
-	/* wait for tags to be created */
-	do {
-		done = 1;
-		if (valid_tags > 0) {
-			for (i = 0; i < num_tags; i++) {
-				if (tags[i].plctag > 0) {
-					rc = plc_tag_status(tags[i].plctag);
-					if (rc != PLCTAG_STATUS_OK) {
-						done = 0;
-					}
-				}
-			}
-
-			if (!done) {
-				sleep_ms(1);
-			}
-		}
-	} while (timeout > time_ms() && !done) ;
-
-	if (!done) {
-		fprintf(stderr, "Timeout waiting for tags to be ready\n");
+	/* start spool replay */
+	if (mqtt.spool != NULL && spool_start(&spool, mosq, &mqtt) != 0) {
 		exit_code = 1;
 		goto cleanup;
 	}
 
-	for (i = 0; i < num_tags; i++) {
-		if (tags[i].plctag > 0) {
-			rc = plc_tag_read(tags[i].plctag, 0);
-			if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
-				fprintf(stderr, "Unable to read tag data [%d]: %s\n", rc, plc_tag_decode_error(rc));
-			}
-		}
-	}
-
-	do {
-		done = 1;
-		if (valid_tags > 0) {
-			for (i = 0; i < num_tags; i++) {
-				if (tags[i].plctag > 0) {
-					rc = plc_tag_status(tags[i].plctag);
-					if (rc != PLCTAG_STATUS_OK) {
-						done = 0;
-					}
-				}
-			}
-			if (!done) {
-				sleep_ms(1);
-			}
-		}
-	} while (timeout > time_ms() && !done);
-
-	if (!done) {
-		fprintf(stderr, "Timeout waiting for initial tag read\n");
+	/* serve prometheus metrics */
+	if (mqtt.metricslisten != NULL && metrics_start(&metrics, mqtt.metricslisten, plcs, num_plcs) != 0) {
 		exit_code = 1;
 		goto cleanup;
 	}
 
-	/* allocate memory for tag storage */
-	for (i = 0; i < num_tags; i++) {
-		if (tags[i].plctag > 0) {
-			tags[i].elem_size = plc_tag_get_int_attribute(tags[i].plctag, "elem_size", 0);
-			tags[i].elem_count = plc_tag_get_int_attribute(tags[i].plctag, "elem_count", 0);
-			if (tags[i].data_type == BIT) {
-				tags[i].data_size = sizeof(int);
-			} else {
-				tags[i].data_size = tags[i].elem_size*tags[i].elem_count;
-			}
-			//fprintf(stderr, "tag %d elem size %d, elem count %d, data size %d\n", i, tags[i].elem_size, tags[i].elem_count, tags[i].data_size);
-			tags[i].data = my_malloc(tags[i].data_size);
-			if (tags[i].data == NULL) {
-				fprintf(stderr, "Failed to allocate memory for tag data\n");
-				exit_code = 1;
-				goto cleanup;
-			}
+	/* start one polling thread per controller */
+	for (i = 0; i < num_plcs; i++) {
+		rc = pthread_create(&plcs[i].thread, NULL, plc_thread, &plcs[i]);
+		if (rc != 0) {
+			fprintf(stderr, "%s: Failed to start polling thread [%d]: %s\n", plcs[i].name, rc, strerror(rc));
+			run = 0;
+			exit_code = 1;
+			break;
 		}
+		plcs[i].started = 1;
 	}
 
-	/* read loop */
-	do {
-		start = time_ms();
-		timeout = start + plc.timeout;
-		for (i = 0; i < num_tags; i++) {
-			if (tags[i].plctag > 0) {
-				rc = plc_tag_read(tags[i].plctag, 0);
-				if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
-					fprintf(stderr, "Unable to read tag data [%d]: %s\n", rc, plc_tag_decode_error(rc));
-				}
-			}
+	/* wait for shutdown, reload tags on SIGHUP */
+	while (run) {
+		if (reload) {
+			reload = 0;
+			reload_config(argv[1], plcs, num_plcs);
 		}
+		sleep_ms(200);
+	}
 
-		do {
-			done = 1;
-			if (valid_tags > 0) {
-				for (i = 0; i < num_tags; i++) {
-					if (tags[i].plctag > 0) {
-						rc = plc_tag_status(tags[i].plctag);
-		                if (rc != PLCTAG_STATUS_OK) {
-                 		   done = 0;
-		                }
-					}
-				}
-				if (!done) {
-					sleep_ms(1);
-				}
-			}
-		} while (timeout > time_ms() && !done);
-
-		if (!done) {
-			fprintf(stderr, "Timeout waiting for tag read\n");
-		} else {
-			/* get tag data from read */
-			for (i = 0; i < num_tags; i++) {
-				if (tags[i].plctag > 0 && tags[i].data != NULL) {
-					if (tags[i].data_type == BIT) {
-						plc_tag_get_bit(tags[i].plctag, 0);
-					} else {
-						plc_tag_get_raw_bytes(tags[i].plctag, 0, tags[i].data, tags[i].data_size);
-					}
-				}
-			}
-			publish_tag_data(mosq, &mqtt, tags, num_tags);
+cleanup:
+	/* stop polling threads */
+	run = 0;
+	for (i = 0; i < num_plcs && plcs != NULL; i++) {
+		if (plcs[i].started) {
+			pthread_join(plcs[i].thread, NULL);
+			plcs[i].started = 0;
 		}
+	}
 
-		end = time_ms();
-		delay = plc.interval-(end-start);
-		//printf("delay: %d\n", delay);
-		if (delay > 0) {
-			sleep_ms(delay);
-		}
-	} while (run); /* run */
+	/* stop metrics endpoint and write commands before controller data goes away */
+	metrics_stop(&metrics);
+	if (mosq != NULL) {
+		mosquitto_message_callback_set(mosq, NULL);
+	}
+	mqtt.plcs = NULL;
+	mqtt.num_plcs = 0;
 
-cleanup:
-	/* destroy tags and cleanup data */
-	if (tags != NULL) {
-		for (i = 0; i < num_tags; i++) {
-			if (tags[i].plctag > 0) {
-				plc_tag_destroy(tags[i].plctag);
-				tags[i].plctag = 0;
-			}
-			if (tags[i].name != NULL) {
-				free(tags[i].name);
-				tags[i].name = NULL;
-			}
-			if (tags[i].path != NULL) {
-				free(tags[i].path);
-				tags[i].path = NULL;
-			}
-			if (tags[i].data != NULL) {
-				free(tags[i].data);
-				tags[i].data = NULL;
-			}
+	/* destroy tags and cleanup controller data */
+	if (plcs != NULL) {
+		for (i = 0; i < num_plcs; i++) {
+			plc_free(&plcs[i]);
 		}
-		free(tags);
-		tags = NULL;
+		free(plcs);
+		plcs = NULL;
 	}
 
 	/* cleanup libplctag */
 	plc_tag_shutdown();
 
-	/* disconnect from broker */
+	/* flush and close spool, acks arriving after this are for records that will be replayed next run */
+	if (mosq != NULL) {
+		mosquitto_publish_callback_set(mosq, NULL);
+	}
+	spool_close(&spool);
+	mqtt.spool = NULL;
+
+	/* disconnect from broker, a clean disconnect does not trigger the will */
 	if (mosq != NULL && mqtt.connected) {
+		if (mqtt.pubformat == PUB_FORMAT_SPARKPLUG) {
+			sparkplug_node_death(mosq, &mqtt);
+		}
 		mosquitto_disconnect(mosq);
 	}
 
@@ -397,14 +622,34 @@ cleanup:
 	if (mqtt.pubtopic != NULL) {
 		free(mqtt.pubtopic);
 	}
-
-	/* cleanup plc data */
-	if (plc.gateway != NULL) {
-		free(plc.gateway);
+	if (mqtt.spoolfile != NULL) {
+		free(mqtt.spoolfile);
+	}
+	if (mqtt.statstopic != NULL) {
+		free(mqtt.statstopic);
+	}
+	if (mqtt.metricslisten != NULL) {
+		free(mqtt.metricslisten);
+	}
+	if (mqtt.cmdtopic != NULL) {
+		free(mqtt.cmdtopic);
+	}
+	if (mqtt.replytopic != NULL) {
+		free(mqtt.replytopic);
+	}
+	if (mqtt.spgroup != NULL) {
+		free(mqtt.spgroup);
+	}
+	if (mqtt.spnode != NULL) {
+		free(mqtt.spnode);
+	}
+	if (mqtt.dicttopic != NULL) {
+		free(mqtt.dicttopic);
 	}
-	if (plc.path != NULL) {
-		free(plc.path);
+	if (mqtt.aggtopic != NULL) {
+		free(mqtt.aggtopic);
 	}
+	pthread_mutex_destroy(&mqtt.splock);
 
 	return exit_code;
 }
@@ -0,0 +1,393 @@
+#include "logix2mqtt.h"
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* the polling thread is the only writer, relaxed atomics keep exporters from seeing torn values */
+void metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_get(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* values below HIST_SUB get a bucket each, above that HIST_SUB buckets per power of two */
+static int hist_bucket(uint64_t v)
+{
+	int e = 0, ix = 0;
+
+	if (v < HIST_SUB) {
+		return (int)v;
+	}
+	e = 63-__builtin_clzll(v);
+	ix = (e-HIST_SUB_BITS+1)*HIST_SUB + (int)((v >> (e-HIST_SUB_BITS)) & (HIST_SUB-1));
+	return (ix < HIST_BUCKETS) ? ix : HIST_BUCKETS-1;
+}
+
+/* highest value that falls into a bucket */
+static int64_t hist_bucket_value(int ix)
+{
+	int e = 0;
+
+	if (ix < HIST_SUB) {
+		return ix;
+	}
+	e = ix/HIST_SUB+HIST_SUB_BITS-1;
+	return ((int64_t)(HIST_SUB+ix % HIST_SUB) << (e-HIST_SUB_BITS)) + ((int64_t)1 << (e-HIST_SUB_BITS))-1;
+}
+
+void hist_record(struct hist_t *h, int64_t us)
+{
+	uint64_t v = (us > 0) ? (uint64_t)us : 0;
+
+	__atomic_fetch_add(&h->counts[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+	if (v > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t hist_count(struct hist_t *h)
+{
+	uint64_t n = 0;
+	int i = 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += metrics_get(&h->counts[i]);
+	}
+	return n;
+}
+
+/* value at or below which pct percent of the samples fall, within bucket resolution */
+int64_t hist_percentile(struct hist_t *h, double pct)
+{
+	uint64_t total = hist_count(h), want = 0, n = 0;
+	int i = 0;
+
+	if (total == 0) {
+		return 0;
+	}
+	want = (uint64_t)ceil(total*pct/100.0);
+	if (want == 0) {
+		want = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += metrics_get(&h->counts[i]);
+		if (n >= want) {
+			return hist_bucket_value(i);
+		}
+	}
+	return (int64_t)metrics_get(&h->max);
+}
+
+static cJSON *hist_json(struct hist_t *h)
+{
+	cJSON *node = cJSON_CreateObject();
+	uint64_t count = hist_count(h);
+
+	cJSON_AddNumberToObject(node, "count", count);
+	cJSON_AddNumberToObject(node, "mean", (count > 0) ? (double)metrics_get(&h->sum)/count : 0);
+	cJSON_AddNumberToObject(node, "p50", hist_percentile(h, 50));
+	cJSON_AddNumberToObject(node, "p90", hist_percentile(h, 90));
+	cJSON_AddNumberToObject(node, "p99", hist_percentile(h, 99));
+	cJSON_AddNumberToObject(node, "max", metrics_get(&h->max));
+	return node;
+}
+
+/* publish a stats summary for the controller every stats_interval seconds */
+void metrics_publish(struct plc_t *plc, int64_t now)
+{
+	struct mqtt_t *mqtt = plc->mqtt;
+	struct metrics_t *m = &plc->metrics;
+	char topic[512];
+	cJSON *json = NULL;
+	char *buf = NULL;
+	int rc = 0;
+
+	if (mqtt->statstopic == NULL || now-m->last_stats < (int64_t)mqtt->statsinterval*1000) {
+		return;
+	}
+	m->last_stats = now;
+	if (!mqtt->connected) {
+		return;
+	}
+
+	json = cJSON_CreateObject();
+	cJSON_AddNumberToObject(json, "timestamp", time_ms());
+	cJSON_AddNumberToObject(json, "cycles", metrics_get(&m->cycles));
+	cJSON_AddNumberToObject(json, "overruns", metrics_get(&m->overruns));
+	cJSON_AddNumberToObject(json, "missed", metrics_get(&m->missed));
+	cJSON_AddNumberToObject(json, "timeouts", metrics_get(&m->timeouts));
+	cJSON_AddNumberToObject(json, "read_errors", metrics_get(&m->read_errors));
+	cJSON_AddNumberToObject(json, "dropped", metrics_get(&m->dropped));
+	cJSON_AddNumberToObject(json, "quarantines", metrics_get(&m->quarantines));
+	cJSON_AddNumberToObject(json, "samples_dropped", metrics_get(&m->samples_dropped));
+	if (mqtt->compress) {
+		cJSON_AddNumberToObject(json, "raw_bytes", metrics_get(&m->raw_bytes));
+		cJSON_AddNumberToObject(json, "compressed_bytes", metrics_get(&m->compressed_bytes));
+		cJSON_AddItemToObject(json, "compress_us", hist_json(&m->compress));
+	}
+	cJSON_AddItemToObject(json, "cycle_us", hist_json(&m->cycle));
+	cJSON_AddItemToObject(json, "first_us", hist_json(&m->first));
+	cJSON_AddItemToObject(json, "last_us", hist_json(&m->last));
+	cJSON_AddItemToObject(json, "read_us", hist_json(&m->read));
+	cJSON_AddItemToObject(json, "publish_us", hist_json(&m->publish));
+	buf = cJSON_PrintUnformatted(json);
+	cJSON_Delete(json);
+	if (buf == NULL) {
+		return;
+	}
+
+	snprintf(topic, sizeof(topic), "%s/%s", mqtt->statstopic, plc->name);
+	rc = mosquitto_publish(plc->mosq, NULL, topic, strlen(buf), buf, 0, 0);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "%s: Failed to publish stats: %s\n", plc->name, mosquitto_strerror(rc));
+	}
+	free(buf);
+}
+
+/* label values may not contain raw quotes, backslashes or newlines */
+static void write_label(FILE *fd, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fd, "\\%c", *s);
+		} else if (*s == '\n') {
+			fprintf(fd, "\\n");
+		} else {
+			fputc(*s, fd);
+		}
+	}
+}
+
+static void write_counter(FILE *fd, struct plc_t *plcs, int num_plcs, const char *name, const char *help, size_t offset)
+{
+	int i = 0;
+
+	fprintf(fd, "# HELP logix2mqtt_%s %s\n# TYPE logix2mqtt_%s counter\n", name, help, name);
+	for (i = 0; i < num_plcs; i++) {
+		fprintf(fd, "logix2mqtt_%s{plc=\"", name);
+		write_label(fd, plcs[i].name);
+		fprintf(fd, "\"} %llu\n", (unsigned long long)metrics_get((uint64_t *)((char *)&plcs[i].metrics+offset)));
+	}
+}
+
+static void write_summary(FILE *fd, struct plc_t *plcs, int num_plcs, const char *name, const char *help, size_t offset)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+	struct hist_t *h = NULL;
+	int i = 0, q = 0;
+
+	fprintf(fd, "# HELP logix2mqtt_%s %s\n# TYPE logix2mqtt_%s summary\n", name, help, name);
+	for (i = 0; i < num_plcs; i++) {
+		h = (struct hist_t *)((char *)&plcs[i].metrics+offset);
+		for (q = 0; q < sizeof(quantiles)/sizeof(quantiles[0]); q++) {
+			fprintf(fd, "logix2mqtt_%s{plc=\"", name);
+			write_label(fd, plcs[i].name);
+			fprintf(fd, "\",quantile=\"%g\"} %g\n", quantiles[q], hist_percentile(h, quantiles[q]*100)/1e6);
+		}
+		fprintf(fd, "logix2mqtt_%s_sum{plc=\"", name);
+		write_label(fd, plcs[i].name);
+		fprintf(fd, "\"} %g\n", metrics_get(&h->sum)/1e6);
+		fprintf(fd, "logix2mqtt_%s_count{plc=\"", name);
+		write_label(fd, plcs[i].name);
+		fprintf(fd, "\"} %llu\n", (unsigned long long)hist_count(h));
+	}
+}
+
+/* slowest tags by worst read latency, a small insertion sorted list keeps this linear in tags */
+static void write_slow_tags(FILE *fd, struct plc_t *plcs, int num_plcs)
+{
+	struct tag_t *top[METRICS_TOP_TAGS];
+	struct tag_t *tag = NULL;
+	int64_t v = 0;
+	int i = 0, j = 0, k = 0, n = 0;
+
+	fprintf(fd, "# HELP logix2mqtt_tag_read_max_seconds Worst read latency of the slowest tags.\n");
+	fprintf(fd, "# TYPE logix2mqtt_tag_read_max_seconds gauge\n");
+	for (i = 0; i < num_plcs; i++) {
+		n = 0;
+		/* the tag set can be swapped by a reload */
+		pthread_mutex_lock(&plcs[i].lock);
+		for (j = 0; j < plcs[i].num_tags; j++) {
+			tag = &plcs[i].tags[j];
+			v = __atomic_load_n(&tag->read_max, __ATOMIC_RELAXED);
+			if (v <= 0 || (n == METRICS_TOP_TAGS && v <= top[n-1]->read_max)) {
+				continue;
+			}
+			if (n < METRICS_TOP_TAGS) {
+				n++;
+			}
+			for (k = n-1; k > 0 && top[k-1]->read_max < v; k--) {
+				top[k] = top[k-1];
+			}
+			top[k] = tag;
+		}
+		for (j = 0; j < n; j++) {
+			fprintf(fd, "logix2mqtt_tag_read_max_seconds{plc=\"");
+			write_label(fd, plcs[i].name);
+			fprintf(fd, "\",tag=\"");
+			write_label(fd, top[j]->name);
+			fprintf(fd, "\"} %g\n", top[j]->read_max/1e6);
+		}
+		pthread_mutex_unlock(&plcs[i].lock);
+	}
+}
+
+/* render all controllers in prometheus text exposition format */
+static char *metrics_text(struct plc_t *plcs, int num_plcs, size_t *len)
+{
+	char *buf = NULL;
+	FILE *fd = NULL;
+
+	fd = open_memstream(&buf, len);
+	if (fd == NULL) {
+		return NULL;
+	}
+	write_counter(fd, plcs, num_plcs, "cycles_total", "Completed read cycles.", offsetof(struct metrics_t, cycles));
+	write_counter(fd, plcs, num_plcs, "overruns_total", "Scans that missed their interval.", offsetof(struct metrics_t, overruns));
+	write_counter(fd, plcs, num_plcs, "missed_deadlines_total", "Scan deadlines that passed before the scan could run.", offsetof(struct metrics_t, missed));
+	write_counter(fd, plcs, num_plcs, "timeouts_total", "Scans with tags not read before the timeout.", offsetof(struct metrics_t, timeouts));
+	write_counter(fd, plcs, num_plcs, "read_errors_total", "Tag reads that did not complete successfully.", offsetof(struct metrics_t, read_errors));
+	write_counter(fd, plcs, num_plcs, "dropped_total", "Scans not published because the publisher was still busy with both snapshots.", offsetof(struct metrics_t, dropped));
+	write_counter(fd, plcs, num_plcs, "quarantines_total", "Tags taken out of the read cycle after repeated failures.", offsetof(struct metrics_t, quarantines));
+	write_summary(fd, plcs, num_plcs, "cycle_seconds", "Time from starting reads to queueing the snapshots for publishing.", offsetof(struct metrics_t, cycle));
+	write_summary(fd, plcs, num_plcs, "first_read_seconds", "Time from cycle start to the first tag completion.", offsetof(struct metrics_t, first));
+	write_summary(fd, plcs, num_plcs, "last_read_seconds", "Time from cycle start to the last tag completion.", offsetof(struct metrics_t, last));
+	write_summary(fd, plcs, num_plcs, "tag_read_seconds", "Per tag read latency.", offsetof(struct metrics_t, read));
+	write_summary(fd, plcs, num_plcs, "publish_seconds", "Time the publisher spent formatting and publishing a scan.", offsetof(struct metrics_t, publish));
+	write_counter(fd, plcs, num_plcs, "samples_dropped_total", "Samples lost because the ring of a sampled tag was full.", offsetof(struct metrics_t, samples_dropped));
+	write_counter(fd, plcs, num_plcs, "payload_bytes_total", "Payload bytes before compression.", offsetof(struct metrics_t, raw_bytes));
+	write_counter(fd, plcs, num_plcs, "compressed_bytes_total", "Payload bytes after compression.", offsetof(struct metrics_t, compressed_bytes));
+	write_summary(fd, plcs, num_plcs, "compress_seconds", "Time spent compressing a payload.", offsetof(struct metrics_t, compress));
+	write_slow_tags(fd, plcs, num_plcs);
+	fclose(fd);
+	return buf;
+}
+
+/* answer every request with the metrics page, the request itself is not inspected */
+static void metrics_serve(struct metrics_srv_t *s, int fd)
+{
+	struct timeval tv = { 1, 0 };
+	char req[1024], hdr[160];
+	char *body = NULL;
+	size_t len = 0, off = 0;
+	ssize_t n = 0;
+	int hdr_len = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (recv(fd, req, sizeof(req), 0) <= 0) {
+		return;
+	}
+	body = metrics_text(s->plcs, s->num_plcs, &len);
+	if (body == NULL) {
+		return;
+	}
+	hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	if (send(fd, hdr, hdr_len, MSG_NOSIGNAL) == hdr_len) {
+		while (off < len) {
+			n = send(fd, body+off, len-off, MSG_NOSIGNAL);
+			if (n <= 0) {
+				break;
+			}
+			off += n;
+		}
+	}
+	free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct metrics_srv_t *s = (struct metrics_srv_t *)arg;
+	struct timeval tv;
+	fd_set fds;
+	int fd = 0;
+
+	while (!s->stop) {
+		FD_ZERO(&fds);
+		FD_SET(s->fd, &fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 500000;
+		if (select(s->fd+1, &fds, NULL, NULL, &tv) <= 0) {
+			continue;
+		}
+		fd = accept(s->fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		metrics_serve(s, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* listen on [host:]port for prometheus scrapes, host defaults to loopback */
+int metrics_start(struct metrics_srv_t *s, const char *listen_addr, struct plc_t *plcs, int num_plcs)
+{
+	struct addrinfo hints = {0}, *res = NULL;
+	char host[256];
+	const char *port = NULL, *sep = NULL;
+	int rc = 0, on = 1;
+
+	memset(s, 0, sizeof(struct metrics_srv_t));
+	s->fd = -1;
+	s->plcs = plcs;
+	s->num_plcs = num_plcs;
+
+	sep = strrchr(listen_addr, ':');
+	if (sep != NULL) {
+		snprintf(host, sizeof(host), "%.*s", (int)(sep-listen_addr), listen_addr);
+		port = sep+1;
+	} else {
+		snprintf(host, sizeof(host), "%s", METRICS_HOST_DEFAULT);
+		port = listen_addr;
+	}
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	rc = getaddrinfo(host, port, &hints, &res);
+	if (rc != 0) {
+		fprintf(stderr, "Invalid metrics address %s: %s\n", listen_addr, gai_strerror(rc));
+		return 1;
+	}
+	s->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (s->fd < 0) {
+		fprintf(stderr, "Failed to create metrics socket [%d]: %s\n", errno, strerror(errno));
+		freeaddrinfo(res);
+		return 1;
+	}
+	setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(s->fd, res->ai_addr, res->ai_addrlen) != 0 || listen(s->fd, 8) != 0) {
+		fprintf(stderr, "Failed to listen on metrics address %s [%d]: %s\n", listen_addr, errno, strerror(errno));
+		freeaddrinfo(res);
+		close(s->fd);
+		s->fd = -1;
+		return 1;
+	}
+	freeaddrinfo(res);
+
+	rc = pthread_create(&s->thread, NULL, metrics_thread, s);
+	if (rc != 0) {
+		fprintf(stderr, "Failed to start metrics thread [%d]: %s\n", rc, strerror(rc));
+		close(s->fd);
+		s->fd = -1;
+		return 1;
+	}
+	s->started = 1;
+	return 0;
+}
+
+void metrics_stop(struct metrics_srv_t *s)
+{
+	if (s->started) {
+		s->stop = 1;
+		pthread_join(s->thread, NULL);
+		close(s->fd);
+		s->fd = -1;
+		s->started = 0;
+	}
+}
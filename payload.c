@@ -0,0 +1,835 @@
+#include "logix2mqtt.h"
+
+#define NUMBER_MAX_LEN (32)
+
+/* escape a string the same way cJSON_PrintUnformatted does, out must hold 6*len+2 bytes */
+static size_t write_string(char *out, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c = 0;
+	size_t i = 0, n = 0;
+
+	out[n++] = '"';
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)s[i];
+		switch (c) {
+		case '"':
+			out[n++] = '\\';
+			out[n++] = '"';
+			break;
+		case '\\':
+			out[n++] = '\\';
+			out[n++] = '\\';
+			break;
+		case '\b':
+			out[n++] = '\\';
+			out[n++] = 'b';
+			break;
+		case '\f':
+			out[n++] = '\\';
+			out[n++] = 'f';
+			break;
+		case '\n':
+			out[n++] = '\\';
+			out[n++] = 'n';
+			break;
+		case '\r':
+			out[n++] = '\\';
+			out[n++] = 'r';
+			break;
+		case '\t':
+			out[n++] = '\\';
+			out[n++] = 't';
+			break;
+		default:
+			if (c < 32) {
+				memcpy(out+n, "\\u00", 4);
+				n += 4;
+				out[n++] = hex[c >> 4];
+				out[n++] = hex[c & 0xf];
+			} else {
+				out[n++] = (char)c;
+			}
+			break;
+		}
+	}
+	out[n++] = '"';
+	return n;
+}
+
+static size_t write_int(char *out, int v)
+{
+	char tmp[12];
+	unsigned int u = (v < 0) ? -(unsigned int)v : (unsigned int)v;
+	size_t n = 0, i = 0;
+
+	do {
+		tmp[n++] = '0' + (u % 10);
+		u /= 10;
+	} while (u > 0);
+	if (v < 0) {
+		out[i++] = '-';
+	}
+	while (n > 0) {
+		out[i++] = tmp[--n];
+	}
+	return i;
+}
+
+static int compare_double(double a, double b)
+{
+	double max = (fabs(a) > fabs(b)) ? fabs(a) : fabs(b);
+
+	return (fabs(a-b) <= max*DBL_EPSILON);
+}
+
+/* format a double exactly like cJSON print_number */
+static size_t write_double(char *out, double d)
+{
+	double test = 0;
+	int len = 0;
+
+	if (isnan(d) || isinf(d)) {
+		memcpy(out, "null", 4);
+		return 4;
+	}
+	if (d >= INT_MIN && d <= INT_MAX && d == (double)(int)d) {
+		return write_int(out, (int)d);
+	}
+	len = snprintf(out, NUMBER_MAX_LEN, "%1.15g", d);
+	if (sscanf(out, "%lg", &test) != 1 || !compare_double(test, d)) {
+		len = snprintf(out, NUMBER_MAX_LEN, "%1.17g", d);
+	}
+	return len;
+}
+
+/* length of the characters in a logix string, bounded by the tag buffer */
+static size_t string_length(struct tag_t *tag)
+{
+	size_t cap = get_tag_value_size(tag);
+	int32_t len = 0;
+
+	if (cap <= 4) {
+		return 0;
+	}
+	cap -= 4;
+	memcpy(&len, tag->data, sizeof(len));
+	if (len < 0) {
+		len = 0;
+	}
+	if ((size_t)len < cap) {
+		cap = len;
+	}
+	return strnlen((const char *)tag->data+4, cap);
+}
+
+/* write the json value of a tag, returns 0 for tags that have no json representation */
+static size_t write_tag_value(char *out, struct tag_t *tag)
+{
+	switch (tag->data_type) {
+	case BIT:
+		return write_int(out, get_tag_bit(tag));
+	case BOOL:
+	case SINT:
+		return write_int(out, *(int8_t *)tag->data);
+	case INT:
+		return write_int(out, *(int16_t *)tag->data);
+	case DINT:
+		return write_int(out, *(int32_t *)tag->data);
+	case LINT:
+		return write_double(out, (double)*(int64_t *)tag->data);
+	case REAL:
+		return write_double(out, (double)*(float *)tag->data);
+	case STRING:
+		return write_string(out, (const char *)tag->data+4, string_length(tag));
+	case UNKNOWN:
+	default:
+		return 0;
+	}
+}
+
+static void put_be16(char *out, uint16_t v)
+{
+	out[0] = (char)(v >> 8);
+	out[1] = (char)v;
+}
+
+static void put_be32(char *out, uint32_t v)
+{
+	out[0] = (char)(v >> 24);
+	out[1] = (char)(v >> 16);
+	out[2] = (char)(v >> 8);
+	out[3] = (char)v;
+}
+
+static void put_be64(char *out, uint64_t v)
+{
+	put_be32(out, (uint32_t)(v >> 32));
+	put_be32(out+4, (uint32_t)v);
+}
+
+static size_t write_mp_str(char *out, const char *s, size_t len)
+{
+	size_t n = 0;
+
+	if (len < 32) {
+		out[n++] = (char)(0xa0 | len);
+	} else if (len < 256) {
+		out[n++] = (char)0xd9;
+		out[n++] = (char)len;
+	} else if (len < 65536) {
+		out[n++] = (char)0xda;
+		put_be16(out+n, (uint16_t)len);
+		n += 2;
+	} else {
+		out[n++] = (char)0xdb;
+		put_be32(out+n, (uint32_t)len);
+		n += 4;
+	}
+	memcpy(out+n, s, len);
+	return n+len;
+}
+
+static size_t write_mp_uint(char *out, uint32_t v)
+{
+	if (v < 128) {
+		out[0] = (char)v;
+		return 1;
+	} else if (v < 65536) {
+		out[0] = (char)0xcd;
+		put_be16(out+1, (uint16_t)v);
+		return 3;
+	}
+	out[0] = (char)0xce;
+	put_be32(out+1, v);
+	return 5;
+}
+
+/* write the messagepack value of a tag keeping the native plc width */
+static size_t write_mp_value(char *out, struct tag_t *tag)
+{
+	union { float f; uint32_t u; } real;
+
+	switch (tag->data_type) {
+	case BIT:
+		out[0] = (char)(get_tag_bit(tag) ? 0xc3 : 0xc2);
+		return 1;
+	case BOOL:
+		out[0] = (char)(*(int8_t *)tag->data ? 0xc3 : 0xc2);
+		return 1;
+	case SINT:
+		out[0] = (char)0xd0;
+		out[1] = *(int8_t *)tag->data;
+		return 2;
+	case INT:
+		out[0] = (char)0xd1;
+		put_be16(out+1, (uint16_t)*(int16_t *)tag->data);
+		return 3;
+	case DINT:
+		out[0] = (char)0xd2;
+		put_be32(out+1, (uint32_t)*(int32_t *)tag->data);
+		return 5;
+	case LINT:
+		out[0] = (char)0xd3;
+		put_be64(out+1, (uint64_t)*(int64_t *)tag->data);
+		return 9;
+	case REAL:
+		real.f = *(float *)tag->data;
+		out[0] = (char)0xca;
+		put_be32(out+1, real.u);
+		return 5;
+	case STRING:
+		return write_mp_str(out, (const char *)tag->data+4, string_length(tag));
+	case UNKNOWN:
+	default:
+		return 0;
+	}
+}
+
+/* sparkplug b protobuf keys, field number shifted over the wire type */
+#define SP_PAYLOAD_TIMESTAMP (0x08)
+#define SP_PAYLOAD_METRIC (0x12)
+#define SP_PAYLOAD_SEQ (0x18)
+#define SP_METRIC_NAME (0x0a)
+#define SP_METRIC_ALIAS (0x10)
+#define SP_METRIC_TIMESTAMP (0x18)
+#define SP_METRIC_DATATYPE (0x20)
+#define SP_METRIC_IS_NULL (0x38)
+#define SP_METRIC_PROPERTIES (0x4a)
+#define SP_METRIC_INT (0x50)
+#define SP_METRIC_LONG (0x58)
+#define SP_METRIC_FLOAT (0x65)
+#define SP_METRIC_BOOLEAN (0x70)
+#define SP_METRIC_STRING (0x7a)
+
+/* sparkplug data types used here */
+#define SP_TYPE_INT8 (1)
+#define SP_TYPE_INT16 (2)
+#define SP_TYPE_INT32 (3)
+#define SP_TYPE_INT64 (4)
+#define SP_TYPE_UINT64 (8)
+#define SP_TYPE_FLOAT (9)
+#define SP_TYPE_BOOLEAN (11)
+#define SP_TYPE_STRING (12)
+
+/* quality property codes as used by ignition */
+#define SP_QUALITY_GOOD (192)
+#define SP_QUALITY_STALE (500)
+#define SP_QUALITY_BAD (0)
+
+/* worst case bytes a metric adds around its key and value: length, name and type keys, quality property */
+#define SP_METRIC_OVERHEAD (48)
+
+static size_t write_pb_varint(char *out, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	out[n++] = (char)v;
+	return n;
+}
+
+static size_t write_pb_bytes(char *out, int key, const char *s, size_t len)
+{
+	size_t n = 0;
+
+	out[n++] = (char)key;
+	n += write_pb_varint(out+n, len);
+	memcpy(out+n, s, len);
+	return n+len;
+}
+
+/* prefix a nested message written at start+1 with its length, one byte was reserved for it */
+static size_t close_pb_message(char *buf, size_t start, size_t len)
+{
+	char tmp[10];
+	size_t n = write_pb_varint(tmp, len);
+
+	if (n > 1) {
+		memmove(buf+start+n, buf+start+1, len);
+	}
+	memcpy(buf+start, tmp, n);
+	return n+len;
+}
+
+static int sp_datatype(plc_data_type_t t)
+{
+	switch (t) {
+	case BIT:
+	case BOOL:
+		return SP_TYPE_BOOLEAN;
+	case SINT:
+		return SP_TYPE_INT8;
+	case INT:
+		return SP_TYPE_INT16;
+	case DINT:
+		return SP_TYPE_INT32;
+	case LINT:
+		return SP_TYPE_INT64;
+	case REAL:
+		return SP_TYPE_FLOAT;
+	case STRING:
+		return SP_TYPE_STRING;
+	case STRUCT:
+	case UNKNOWN:
+	default:
+		return 0;
+	}
+}
+
+/* write the sparkplug value field of a tag from data, which is either the tag's snapshot or its shadow
+ * signed values go out sign extended the way the sparkplug reference encoders do */
+static size_t write_sp_value(char *out, struct tag_t *tag, const void *data)
+{
+	union { float f; uint32_t u; } real;
+	int32_t len = 0;
+	size_t cap = 0;
+
+	switch (tag->data_type) {
+	case BIT:
+		out[0] = (char)SP_METRIC_BOOLEAN;
+		out[1] = (char)(tag->field ? (*(uint8_t *)data >> tag->bit) & 1 : (*(int *)data != 0));
+		return 2;
+	case BOOL:
+		out[0] = (char)SP_METRIC_BOOLEAN;
+		out[1] = (char)(*(int8_t *)data != 0);
+		return 2;
+	case SINT:
+		out[0] = (char)SP_METRIC_INT;
+		return 1+write_pb_varint(out+1, (uint32_t)(int32_t)*(int8_t *)data);
+	case INT:
+		out[0] = (char)SP_METRIC_INT;
+		return 1+write_pb_varint(out+1, (uint32_t)(int32_t)*(int16_t *)data);
+	case DINT:
+		out[0] = (char)SP_METRIC_INT;
+		return 1+write_pb_varint(out+1, (uint32_t)*(int32_t *)data);
+	case LINT:
+		out[0] = (char)SP_METRIC_LONG;
+		return 1+write_pb_varint(out+1, (uint64_t)*(int64_t *)data);
+	case REAL:
+		/* protobuf fixed32 is little endian */
+		real.f = *(float *)data;
+		out[0] = (char)SP_METRIC_FLOAT;
+		out[1] = (char)real.u;
+		out[2] = (char)(real.u >> 8);
+		out[3] = (char)(real.u >> 16);
+		out[4] = (char)(real.u >> 24);
+		return 5;
+	case STRING:
+		cap = get_tag_value_size(tag);
+		cap = (cap > 4) ? cap-4 : 0;
+		memcpy(&len, data, sizeof(len));
+		if (len >= 0 && (size_t)len < cap) {
+			cap = len;
+		}
+		return write_pb_bytes(out, SP_METRIC_STRING, (const char *)data+4, strnlen((const char *)data+4, cap));
+	case STRUCT:
+	case UNKNOWN:
+	default:
+		return 0;
+	}
+}
+
+/* quality property set, only written while a tag is or just was anything but good */
+static size_t write_sp_quality(char *out, quality_t q)
+{
+	int code = (q == QUALITY_GOOD) ? SP_QUALITY_GOOD : (q == QUALITY_STALE) ? SP_QUALITY_STALE : SP_QUALITY_BAD;
+	size_t n = 0, vlen = 0;
+	char val[16];
+
+	/* property value: type int32 and the code */
+	val[vlen++] = 0x08;
+	val[vlen++] = SP_TYPE_INT32;
+	val[vlen++] = 0x18;
+	vlen += write_pb_varint(val+vlen, (uint64_t)code);
+
+	out[n++] = (char)SP_METRIC_PROPERTIES;
+	out[n++] = (char)(2+7+2+vlen);
+	n += write_pb_bytes(out+n, 0x0a, "Quality", 7);
+	out[n++] = 0x12;
+	out[n++] = (char)vlen;
+	memcpy(out+n, val, vlen);
+	return n+vlen;
+}
+
+/* write one metric: births carry name and type, data messages only the alias key
+ * data is NULL for tags without a value, which go out as null */
+static size_t write_sp_metric(char *out, struct tag_t *tag, const void *data, int birth)
+{
+	quality_t q = tag_quality(tag);
+	size_t n = 2, v = 0;
+
+	out[0] = (char)SP_PAYLOAD_METRIC;
+	if (birth) {
+		n += write_pb_bytes(out+n, SP_METRIC_NAME, tag->name, strlen(tag->name));
+	}
+	memcpy(out+n, tag->key, tag->key_len);
+	n += tag->key_len;
+	if (birth) {
+		out[n++] = (char)SP_METRIC_DATATYPE;
+		out[n++] = (char)sp_datatype(tag->data_type);
+	}
+	if (data != NULL) {
+		v = write_sp_value(out+n, tag, data);
+		if (v == 0) {
+			return 0;
+		}
+		n += v;
+	} else {
+		out[n++] = (char)SP_METRIC_IS_NULL;
+		out[n++] = 1;
+	}
+	if (q != QUALITY_GOOD || tag->pub_quality != QUALITY_GOOD) {
+		n += write_sp_quality(out+n, q);
+	}
+	return 1+close_pb_message(out, 1, n-2);
+}
+
+/* write a bare tag value in the payload format, used for per tag topics */
+size_t payload_write_value(char *out, struct tag_t *tag, int format)
+{
+	if (format == PUB_FORMAT_MSGPACK) {
+		return write_mp_value(out, tag);
+	}
+	return write_tag_value(out, tag);
+}
+
+/* precompute the encoded key of a tag for the payload format, sparkplug keys are the metric alias */
+static int compile_key(struct tag_t *tag, int format, int keys, uint64_t alias)
+{
+	char num[16];
+	const char *name = tag->name;
+	size_t len = 0;
+
+	if (keys == PUB_KEYS_INDEX) {
+		snprintf(num, sizeof(num), "%d", tag->index);
+		name = num;
+	}
+	if (tag->key != NULL) {
+		free(tag->key);
+		tag->key = NULL;
+	}
+	if (tag->hidden) {
+		return 0;
+	}
+	len = strlen(name);
+	tag->key = my_malloc(6*len+8);
+	if (tag->key == NULL) {
+		fprintf(stderr, "Failed to allocate memory for payload key\n");
+		return 1;
+	}
+	if (format == PUB_FORMAT_SPARKPLUG) {
+		tag->key[0] = (char)SP_METRIC_ALIAS;
+		tag->key_len = 1+write_pb_varint(tag->key+1, alias+(uint64_t)tag->index);
+	} else if (format == PUB_FORMAT_MSGPACK) {
+		if (keys == PUB_KEYS_INDEX) {
+			tag->key_len = write_mp_uint(tag->key, (uint32_t)tag->index);
+		} else {
+			tag->key_len = write_mp_str(tag->key, name, len);
+		}
+	} else {
+		tag->key_len = write_string(tag->key, name, len);
+		tag->key[tag->key_len++] = ':';
+	}
+	return 0;
+}
+
+/* worst case length of a tag value in the payload format */
+size_t payload_value_max(struct tag_t *tag)
+{
+	if (tag->data_type == STRING) {
+		return 6*get_tag_value_size(tag)+5;
+	}
+	return NUMBER_MAX_LEN;
+}
+
+/* build encoded keys and size the payload buffer for a scan class, called once tag sizes are known
+ * alias is added to the tag indexes to give sparkplug metrics aliases unique across controllers */
+int payload_compile(struct payload_t *p, struct tag_t **tags, int num_tags, int format, int keys, uint64_t alias)
+{
+	struct tag_t *tag = NULL;
+	size_t size = 0;
+	int i = 0;
+
+	payload_free(p);
+	p->format = format;
+	size = strlen("{\"stamp\":,\"quality\":{}}")+NUMBER_MAX_LEN+16;
+	for (i = 0; i < num_tags; i++) {
+		tag = tags[i];
+		if (tag->name != NULL && compile_key(tag, format, keys, alias) != 0) {
+			return 1;
+		}
+		if (tag->key != NULL && tag->data != NULL) {
+			/* value and a possible quality entry */
+			size += 1+tag->key_len+payload_value_max(tag);
+			size += 1+tag->key_len+8;
+			if (format == PUB_FORMAT_SPARKPLUG) {
+				size += SP_METRIC_OVERHEAD;
+			}
+			/* sampled tags publish up to a full ring, sparkplug repeats the key for every sample */
+			if (tag->ring != NULL) {
+				size += tag->ring->cap*(2*NUMBER_MAX_LEN+tag->key_len+payload_value_max(tag))+16;
+			}
+		}
+	}
+	p->buf = my_malloc(size);
+	if (p->buf == NULL) {
+		fprintf(stderr, "Failed to allocate memory for payload buffer\n");
+		return 1;
+	}
+	p->size = size;
+	p->len = 0;
+	return 0;
+}
+
+/* size a sparkplug birth certificate holding every tag of a controller, keys must already be compiled */
+int payload_compile_birth(struct payload_t *p, struct tag_t *tags, int num_tags)
+{
+	size_t size = 0;
+	int i = 0;
+
+	payload_free(p);
+	p->format = PUB_FORMAT_SPARKPLUG;
+	size = 2*NUMBER_MAX_LEN;
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i].key != NULL && sp_datatype(tags[i].data_type) != 0) {
+			size += strlen(tags[i].name)+tags[i].key_len+payload_value_max(&tags[i])+SP_METRIC_OVERHEAD;
+		}
+	}
+	p->buf = my_malloc(size);
+	if (p->buf == NULL) {
+		fprintf(stderr, "Failed to allocate memory for birth certificate\n");
+		return 1;
+	}
+	p->size = size;
+	p->len = 0;
+	return 0;
+}
+
+void payload_free(struct payload_t *p)
+{
+	if (p->buf != NULL) {
+		free(p->buf);
+	}
+	memset(p, 0, sizeof(struct payload_t));
+}
+
+void payload_begin(struct payload_t *p, int64_t stamp)
+{
+	p->count = 1;
+	if (p->format == PUB_FORMAT_SPARKPLUG) {
+		p->buf[0] = (char)SP_PAYLOAD_TIMESTAMP;
+		p->len = 1+write_pb_varint(p->buf+1, (uint64_t)stamp);
+		return;
+	}
+	if (p->format == PUB_FORMAT_MSGPACK) {
+		/* map32 header, the entry count is patched in payload_end */
+		p->buf[0] = (char)0xdf;
+		p->len = 5;
+		p->len += write_mp_str(p->buf+p->len, "stamp", 5);
+		p->buf[p->len++] = (char)0xd3;
+		put_be64(p->buf+p->len, (uint64_t)stamp);
+		p->len += 8;
+		return;
+	}
+	memcpy(p->buf, "{\"stamp\":", 9);
+	p->len = 9;
+	p->len += write_double(p->buf+p->len, (double)stamp);
+}
+
+/* append a tag, returns 0 when the tag type cannot be published */
+int payload_add(struct payload_t *p, struct tag_t *tag)
+{
+	size_t start = p->len, n = 0;
+
+	if (tag->key == NULL) {
+		return 0;
+	}
+	if (p->format == PUB_FORMAT_SPARKPLUG) {
+		n = write_sp_metric(p->buf+p->len, tag, tag->data, 0);
+		p->len += n;
+		p->count += (n > 0);
+		return (n > 0);
+	}
+	if (p->format != PUB_FORMAT_MSGPACK) {
+		p->buf[p->len++] = ',';
+	}
+	memcpy(p->buf+p->len, tag->key, tag->key_len);
+	p->len += tag->key_len;
+	if (p->format == PUB_FORMAT_MSGPACK) {
+		n = write_mp_value(p->buf+p->len, tag);
+	} else {
+		n = write_tag_value(p->buf+p->len, tag);
+	}
+	if (n == 0) {
+		p->len = start;
+		return 0;
+	}
+	p->len += n;
+	p->count++;
+	return 1;
+}
+
+/* append a tag with its name and type to a sparkplug birth, data NULL sends the metric without a value */
+int payload_birth_add(struct payload_t *p, struct tag_t *tag, const void *data)
+{
+	size_t n = 0;
+
+	if (tag->key == NULL || sp_datatype(tag->data_type) == 0) {
+		return 0;
+	}
+	n = write_sp_metric(p->buf+p->len, tag, data, 1);
+	p->len += n;
+	p->count += (n > 0);
+	return (n > 0);
+}
+
+/* append the samples claimed from a tag's ring as a timestamp column and a value column
+ * sparkplug has no columns, every sample becomes a metric with its own timestamp */
+int payload_add_samples(struct payload_t *p, struct tag_t *tag)
+{
+	struct ring_t *r = tag->ring;
+	struct tag_t view = *tag;
+	unsigned int i = 0, slot = 0;
+	size_t start = 0;
+
+	if (tag->key == NULL || r == NULL || r->taken == 0) {
+		return 0;
+	}
+	if (p->format == PUB_FORMAT_SPARKPLUG) {
+		for (i = 0; i < r->taken; i++) {
+			slot = (r->tail+i) % r->cap;
+			p->buf[p->len++] = (char)SP_PAYLOAD_METRIC;
+			start = p->len++;
+			memcpy(p->buf+p->len, tag->key, tag->key_len);
+			p->len += tag->key_len;
+			p->buf[p->len++] = (char)SP_METRIC_TIMESTAMP;
+			p->len += write_pb_varint(p->buf+p->len, (uint64_t)r->stamps[slot]);
+			p->len += write_sp_value(p->buf+p->len, tag, r->values+slot*r->size);
+			p->len = start+close_pb_message(p->buf, start, p->len-start-1);
+			p->count++;
+		}
+		return 1;
+	}
+
+	if (p->format == PUB_FORMAT_MSGPACK) {
+		memcpy(p->buf+p->len, tag->key, tag->key_len);
+		p->len += tag->key_len;
+		p->buf[p->len++] = (char)0x82;
+		p->len += write_mp_str(p->buf+p->len, "t", 1);
+		p->buf[p->len++] = (char)0xdd;
+		put_be32(p->buf+p->len, r->taken);
+		p->len += 4;
+		for (i = 0; i < r->taken; i++) {
+			p->buf[p->len++] = (char)0xd3;
+			put_be64(p->buf+p->len, (uint64_t)r->stamps[(r->tail+i) % r->cap]);
+			p->len += 8;
+		}
+		p->len += write_mp_str(p->buf+p->len, "v", 1);
+		p->buf[p->len++] = (char)0xdd;
+		put_be32(p->buf+p->len, r->taken);
+		p->len += 4;
+		for (i = 0; i < r->taken; i++) {
+			view.data = r->values+((r->tail+i) % r->cap)*r->size;
+			p->len += write_mp_value(p->buf+p->len, &view);
+		}
+		p->count++;
+		return 1;
+	}
+
+	p->buf[p->len++] = ',';
+	memcpy(p->buf+p->len, tag->key, tag->key_len);
+	p->len += tag->key_len;
+	memcpy(p->buf+p->len, "{\"t\":[", 6);
+	p->len += 6;
+	for (i = 0; i < r->taken; i++) {
+		if (i > 0) {
+			p->buf[p->len++] = ',';
+		}
+		p->len += write_double(p->buf+p->len, (double)r->stamps[(r->tail+i) % r->cap]);
+	}
+	memcpy(p->buf+p->len, "],\"v\":[", 7);
+	p->len += 7;
+	for (i = 0; i < r->taken; i++) {
+		if (i > 0) {
+			p->buf[p->len++] = ',';
+		}
+		view.data = r->values+((r->tail+i) % r->cap)*r->size;
+		p->len += write_tag_value(p->buf+p->len, &view);
+	}
+	memcpy(p->buf+p->len, "]}", 2);
+	p->len += 2;
+	p->count++;
+	return 1;
+}
+
+/* append a quality object listing the tags whose last read failed, returns the number listed
+ * healthy scans carry no quality entry at all */
+int payload_quality(struct payload_t *p, struct tag_t **tags, int num_tags)
+{
+	const char *str = NULL;
+	size_t head = 0;
+	quality_t q = QUALITY_GOOD;
+	int i = 0, n = 0;
+
+	for (i = 0; i < num_tags; i++) {
+		q = tag_quality(tags[i]);
+		/* structures are only published through their fields, which carry the leader's quality */
+		if (q == QUALITY_GOOD || tags[i]->key == NULL || tags[i]->data == NULL || tags[i]->data_type == STRUCT) {
+			continue;
+		}
+		if (p->format == PUB_FORMAT_SPARKPLUG) {
+			/* stale values already carry their quality, bad ones go out as null metrics */
+			if (q == QUALITY_BAD && sp_datatype(tags[i]->data_type) != 0) {
+				p->len += write_sp_metric(p->buf+p->len, tags[i], NULL, 0);
+				n++;
+			}
+			continue;
+		}
+		if (n == 0) {
+			if (p->format == PUB_FORMAT_MSGPACK) {
+				p->len += write_mp_str(p->buf+p->len, "quality", 7);
+				/* map32 header, patched once the entries are counted */
+				head = p->len;
+				p->buf[p->len] = (char)0xdf;
+				p->len += 5;
+			} else {
+				memcpy(p->buf+p->len, ",\"quality\":{", 12);
+				p->len += 12;
+			}
+		} else if (p->format != PUB_FORMAT_MSGPACK) {
+			p->buf[p->len++] = ',';
+		}
+		memcpy(p->buf+p->len, tags[i]->key, tags[i]->key_len);
+		p->len += tags[i]->key_len;
+		str = get_quality_str(q);
+		if (p->format == PUB_FORMAT_MSGPACK) {
+			p->len += write_mp_str(p->buf+p->len, str, strlen(str));
+		} else {
+			p->len += write_string(p->buf+p->len, str, strlen(str));
+		}
+		n++;
+	}
+	if (n == 0 || p->format == PUB_FORMAT_SPARKPLUG) {
+		return n;
+	}
+	if (p->format == PUB_FORMAT_MSGPACK) {
+		put_be32(p->buf+head+1, (uint32_t)n);
+		p->count++;
+	} else {
+		p->buf[p->len++] = '}';
+	}
+	return n;
+}
+
+size_t payload_end(struct payload_t *p)
+{
+	if (p->format == PUB_FORMAT_SPARKPLUG) {
+		p->buf[p->len++] = (char)SP_PAYLOAD_SEQ;
+		p->len += write_pb_varint(p->buf+p->len, p->seq);
+		return p->len;
+	}
+	if (p->format == PUB_FORMAT_MSGPACK) {
+		put_be32(p->buf+1, (uint32_t)p->count);
+		return p->len;
+	}
+	p->buf[p->len++] = '}';
+	p->buf[p->len] = '\0';
+	return p->len;
+}
+
+/* sparkplug node birth or death certificate, both carry the session's bdSeq
+ * a birth also offers the rebirth command and always starts the sequence at 0 */
+size_t payload_node(char *out, int64_t stamp, uint64_t bdseq, int birth)
+{
+	size_t n = 0, start = 0;
+
+	if (birth) {
+		out[n++] = (char)SP_PAYLOAD_TIMESTAMP;
+		n += write_pb_varint(out+n, (uint64_t)stamp);
+	}
+	out[n++] = (char)SP_PAYLOAD_METRIC;
+	start = n++;
+	n += write_pb_bytes(out+n, SP_METRIC_NAME, "bdSeq", 5);
+	out[n++] = (char)SP_METRIC_DATATYPE;
+	out[n++] = SP_TYPE_UINT64;
+	out[n++] = (char)SP_METRIC_LONG;
+	n += write_pb_varint(out+n, bdseq);
+	n = start+close_pb_message(out, start, n-start-1);
+	if (birth) {
+		out[n++] = (char)SP_PAYLOAD_METRIC;
+		start = n++;
+		n += write_pb_bytes(out+n, SP_METRIC_NAME, "Node Control/Rebirth", 20);
+		out[n++] = (char)SP_METRIC_DATATYPE;
+		out[n++] = SP_TYPE_BOOLEAN;
+		out[n++] = (char)SP_METRIC_BOOLEAN;
+		out[n++] = 0;
+		n = start+close_pb_message(out, start, n-start-1);
+		out[n++] = (char)SP_PAYLOAD_SEQ;
+		out[n++] = 0;
+	}
+	return n;
+}
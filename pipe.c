@@ -0,0 +1,163 @@
+#include "logix2mqtt.h"
+
+/* point the publisher's view of a scan's tags at one snapshot of the value slab and the qualities taken with it */
+static void pipe_view(struct plc_t *plc, struct scan_t *scan, int slot)
+{
+	uint8_t *base = plc->slab + slot*plc->slab_len;
+	uint8_t *q = scan->qualities + slot*scan->num_tags;
+	struct tag_t *tag = NULL;
+	int i = 0;
+
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = scan->tags[i];
+		tag->data = (tag->data_size > 0) ? base + tag->offset : NULL;
+		tag->view_quality = (quality_t)q[i];
+	}
+}
+
+static void *pipe_thread(void *arg)
+{
+	struct plc_t *plc = (struct plc_t *)arg;
+	struct pipe_t *p = &plc->pipe;
+	struct pipe_job_t *job = NULL;
+	unsigned int tail = 0;
+	int64_t start = 0;
+
+	while (1) {
+		sem_wait(&p->sem);
+		tail = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+		if (tail == __atomic_load_n(&p->head, __ATOMIC_ACQUIRE)) {
+			/* woken without a job, only happens on stop */
+			if (p->stop) {
+				break;
+			}
+			continue;
+		}
+		job = &p->jobs[tail % PIPE_RING_SIZE];
+		start = time_us();
+		pipe_view(plc, job->scan, job->slot);
+		job->scan->stamp = job->stamp;
+		derive_scan(job->scan);
+		publish_tag_data(plc, job->scan);
+		hist_record(&plc->metrics.publish, time_us()-start);
+
+		/* hand the snapshot back to the polling thread */
+		__atomic_store_n(&job->scan->busy[job->slot], 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&p->tail, tail+1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&p->lock);
+		p->done++;
+		pthread_cond_broadcast(&p->idle);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+int pipe_start(struct plc_t *plc)
+{
+	struct pipe_t *p = &plc->pipe;
+	int rc = 0;
+
+	memset(p, 0, sizeof(struct pipe_t));
+	if (sem_init(&p->sem, 0, 0) != 0) {
+		fprintf(stderr, "%s: Failed to initialize publish queue\n", plc->name);
+		return 1;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	rc = pthread_create(&p->thread, NULL, pipe_thread, plc);
+	if (rc != 0) {
+		fprintf(stderr, "%s: Failed to start publishing thread [%d]: %s\n", plc->name, rc, strerror(rc));
+		pthread_cond_destroy(&p->idle);
+		pthread_mutex_destroy(&p->lock);
+		sem_destroy(&p->sem);
+		return 1;
+	}
+	p->started = 1;
+	return 0;
+}
+
+/* copy a scan's last read values and their qualities into one snapshot of the value slab
+ * the scan's values are contiguous in the slab, copy them straight from the flat handle arrays */
+void pipe_fill(struct plc_t *plc, struct scan_t *scan, int slot)
+{
+	uint8_t *base = plc->slab + slot*plc->slab_len;
+	uint8_t *q = scan->qualities + slot*scan->num_tags;
+	struct tag_t *tag = NULL;
+	int i = 0;
+
+	for (i = 0; i < scan->num_hot; i++) {
+		if (scan->types[i] == BIT) {
+			*(int *)(base + scan->offsets[i]) = plc_tag_get_bit(scan->handles[i], 0);
+		} else {
+			plc_tag_get_raw_bytes(scan->handles[i], 0, base + scan->offsets[i], scan->sizes[i]);
+		}
+	}
+	/* elements and fields share their parent's quality */
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = (scan->tags[i]->parent != NULL) ? scan->tags[i]->parent : scan->tags[i];
+		q[i] = (uint8_t)__atomic_load_n(&tag->quality, __ATOMIC_RELAXED);
+	}
+}
+
+/* copy a completed scan into a free snapshot buffer and queue it, returns 1 when the publisher is too far behind */
+int pipe_push(struct plc_t *plc, struct scan_t *scan, int64_t stamp)
+{
+	struct pipe_t *p = &plc->pipe;
+	struct pipe_job_t *job = NULL;
+	unsigned int head = p->head;
+	int slot = scan->slot;
+
+	if (__atomic_load_n(&scan->busy[slot], __ATOMIC_ACQUIRE)) {
+		slot ^= 1;
+	}
+	if (__atomic_load_n(&scan->busy[slot], __ATOMIC_ACQUIRE) ||
+	    head-__atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) >= PIPE_RING_SIZE) {
+		/* both snapshots are still being published, never make the reads wait */
+		metrics_add(&plc->metrics.dropped, 1);
+		return 1;
+	}
+
+	pipe_fill(plc, scan, slot);
+	scan->busy[slot] = 1;
+	scan->slot = slot^1;
+	job = &p->jobs[head % PIPE_RING_SIZE];
+	job->scan = scan;
+	job->slot = slot;
+	job->stamp = stamp;
+	__atomic_store_n(&p->head, head+1, __ATOMIC_RELEASE);
+	p->pushed++;
+	sem_post(&p->sem);
+	return 0;
+}
+
+/* wait until everything queued has been published, needed before the tag set changes */
+void pipe_drain(struct plc_t *plc)
+{
+	struct pipe_t *p = &plc->pipe;
+
+	if (!p->started) {
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	while (p->done != p->pushed) {
+		pthread_cond_wait(&p->idle, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pipe_stop(struct plc_t *plc)
+{
+	struct pipe_t *p = &plc->pipe;
+
+	if (!p->started) {
+		return;
+	}
+	pipe_drain(plc);
+	p->stop = 1;
+	sem_post(&p->sem);
+	pthread_join(p->thread, NULL);
+	pthread_cond_destroy(&p->idle);
+	pthread_mutex_destroy(&p->lock);
+	sem_destroy(&p->sem);
+	p->started = 0;
+}
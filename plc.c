@@ -0,0 +1,737 @@
+#include "logix2mqtt.h"
+
+static int compare_tag_name(const void *a, const void *b)
+{
+	return strcmp((*(struct tag_t * const *)a)->name, (*(struct tag_t * const *)b)->name);
+}
+
+/* tag list sorted by name for lookups while diffing tag sets */
+static struct tag_t **index_tags(struct plc_t *plc)
+{
+	struct tag_t **index = NULL;
+	int i = 0;
+
+	index = my_malloc(sizeof(struct tag_t *)*(plc->num_tags > 0 ? plc->num_tags : 1));
+	if (index == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < plc->num_tags; i++) {
+		index[i] = &plc->tags[i];
+	}
+	qsort(index, plc->num_tags, sizeof(struct tag_t *), compare_tag_name);
+	return index;
+}
+
+static struct tag_t *find_tag(struct tag_t **index, int num_tags, const char *name)
+{
+	struct tag_t key = {0}, *k = &key, **found = NULL;
+
+	key.name = (char *)name;
+	found = bsearch(&k, index, num_tags, sizeof(struct tag_t *), compare_tag_name);
+	return (found != NULL) ? *found : NULL;
+}
+
+/* look up a configured tag by name, the index only changes when the polling thread swaps in a reload */
+struct tag_t *plc_find_tag(struct plc_t *plc, const char *name)
+{
+	if (plc->index == NULL) {
+		return NULL;
+	}
+	return find_tag(plc->index, plc->num_tags, name);
+}
+
+/* prepare completion tracking, scan classes and the full tag list for a controller */
+int plc_init(struct plc_t *plc, struct mosquitto *mosq, struct mqtt_t *mqtt)
+{
+	struct scan_t *scan = NULL;
+	int i = 0, j = 0;
+
+	plc->mosq = mosq;
+	plc->mqtt = mqtt;
+	if (waiter_init(&plc->waiter) != 0) {
+		fprintf(stderr, "%s: Failed to initialize tag completion tracking\n", plc->name);
+		return 1;
+	}
+	if (pthread_mutex_init(&plc->lock, NULL) != 0) {
+		fprintf(stderr, "%s: Failed to initialize lock\n", plc->name);
+		waiter_destroy(&plc->waiter);
+		return 1;
+	}
+	if (cond_init_mono(&plc->wcond) != 0) {
+		fprintf(stderr, "%s: Failed to initialize write queue\n", plc->name);
+		pthread_mutex_destroy(&plc->lock);
+		waiter_destroy(&plc->waiter);
+		return 1;
+	}
+	/* derived tags join the scan class of their inputs */
+	if (derive_compile(plc) != 0 || sched_init(&plc->sched, plc->tags, plc->num_tags, plc->interval) != 0) {
+		return 1;
+	}
+	plc->sched.catchup = plc->catchup;
+	/* a read is due back within its scan period unless the tag sets its own timeout */
+	for (j = 0; j < plc->sched.num_scans; j++) {
+		scan = &plc->sched.scans[j];
+		for (i = 0; i < scan->num_tags; i++) {
+			if (scan->tags[i]->timeout <= 0) {
+				scan->tags[i]->timeout = (scan->rate < plc->timeout) ? scan->rate : plc->timeout;
+			}
+		}
+	}
+	plc->all = my_malloc(sizeof(struct tag_t *)*plc->num_tags);
+	if (plc->all == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for tag list\n", plc->name);
+		return 1;
+	}
+	for (i = 0; i < plc->num_tags; i++) {
+		plc->all[i] = &plc->tags[i];
+		plc->tags[i].index = i;
+		plc->tags[i].waiter = &plc->waiter;
+	}
+	plc->index = index_tags(plc);
+	plc->wq = my_malloc(sizeof(struct write_t)*WRITE_QUEUE_MAX);
+	plc->wbatch = my_malloc(sizeof(struct write_t)*WRITE_QUEUE_MAX);
+	plc->wtags = my_malloc(sizeof(struct tag_t *)*WRITE_QUEUE_MAX);
+	if (plc->index == NULL || plc->wq == NULL || plc->wbatch == NULL || plc->wtags == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for tag index\n", plc->name);
+		return 1;
+	}
+	return 0;
+}
+
+/* destroy tags that failed to create or read so one bad tag does not hold up the controller, returns tags left */
+static int drop_failed_tags(struct plc_t *plc, const char *what)
+{
+	struct tag_t *tags = plc->tags;
+	int i = 0, valid = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		if (tags[i].plctag > 0 && tags[i].status != PLCTAG_STATUS_OK) {
+			fprintf(stderr, "%s: Could not %s tag %s [%d]: %s\n", plc->name, what, tags[i].name, tags[i].status, plc_tag_decode_error(tags[i].status));
+			plc_tag_destroy(tags[i].plctag);
+			tags[i].plctag = 0;
+		} else if (tags[i].plctag > 0) {
+			valid++;
+		}
+	}
+	return valid;
+}
+
+/* create plc tags that do not have a handle yet, failed tags are dropped
+ * the attribute string is only needed for the create call, so it is built on the stack */
+static int create_tags(struct plc_t *plc, int64_t timeout)
+{
+	struct tag_t *tags = plc->tags;
+	char path[TAG_PATH_MAX_LEN];
+	int i = 0, rc = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		if (tags[i].name != NULL && strlen(tags[i].name) > 0 && tags[i].parent == NULL && tags[i].expr == NULL && tags[i].plctag <= 0 && !tags[i].keep) {
+			rc = snprintf(path, TAG_PATH_MAX_LEN-1, TAG_PATH_BASE, plc->gateway, plc->path, tags[i].name);
+			if (tags[i].elem_count > 1 && rc > 0 && rc < TAG_PATH_MAX_LEN-1) {
+				snprintf(path+rc, TAG_PATH_MAX_LEN-1-rc, "&elem_count=%d", tags[i].elem_count);
+			}
+			tags[i].quality = QUALITY_BAD;
+			waiter_arm(&plc->waiter, &tags[i]);
+			tags[i].plctag = plc_tag_create_ex(path, waiter_callback, &tags[i], 0);
+			if (tags[i].plctag <= 0) {
+				fprintf(stderr, "%s: Could not create tag [%d]: %s\n", plc->name, tags[i].plctag, plc_tag_decode_error(tags[i].plctag));
+				waiter_done(&plc->waiter, &tags[i], tags[i].plctag);
+			}
+		}
+	}
+
+	/* wait for tags to be created, tags still pending time out and are dropped with the failed ones */
+	if (waiter_wait(&plc->waiter, plc->all, plc->num_tags, timeout) > 0) {
+		fprintf(stderr, "%s: Timeout waiting for tags to be ready\n", plc->name);
+		waiter_reset(&plc->waiter, plc->all, plc->num_tags);
+	}
+
+	/* drop tags that failed during creation */
+	drop_failed_tags(plc, "create");
+	return 0;
+}
+
+static size_t slab_align(size_t n)
+{
+	return (n + SLAB_ALIGN-1) & ~(size_t)(SLAB_ALIGN-1);
+}
+
+/* lay out tag values in one slab per controller: two read snapshots followed by the change detection shadows
+ * values are packed scan class by scan class, so snapshotting, comparing and serializing a scan walks memory
+ * in order, and each scan gets its read handles, types and offsets as flat arrays for the snapshot copy */
+static int layout_tags(struct plc_t *plc)
+{
+	struct tag_t *tags = plc->tags, *tag = NULL;
+	struct scan_t *scan = NULL;
+	uint8_t *slab = NULL, *shadow = NULL;
+	size_t len = 0, shadows = 0;
+	int use_shadow = plc->mqtt->pubchanges || plc->mqtt->pubmode == PUB_MODE_TAG;
+	int i = 0, j = 0, n = 0;
+
+	/* sizes come from the handle, tags taken over from a reload already have theirs */
+	for (i = 0; i < plc->num_tags; i++) {
+		if (tags[i].parent != NULL) {
+			continue;
+		}
+		if (tags[i].expr != NULL) {
+			/* derived values are computed into the snapshots, they have no handle */
+			tags[i].data_size = (tags[i].code != NULL) ? get_plc_data_type_size(tags[i].data_type) : 0;
+			tags[i].elem_size = tags[i].data_size;
+			tags[i].elem_count = 1;
+		} else if (tags[i].plctag <= 0) {
+			tags[i].data_size = 0;
+		} else if (tags[i].data_size == 0) {
+			tags[i].elem_size = plc_tag_get_int_attribute(tags[i].plctag, "elem_size", 0);
+			tags[i].elem_count = plc_tag_get_int_attribute(tags[i].plctag, "elem_count", 0);
+			if (tags[i].data_type == BIT) {
+				tags[i].data_size = sizeof(int);
+			} else {
+				tags[i].data_size = tags[i].elem_size*tags[i].elem_count;
+			}
+			//fprintf(stderr, "tag %d elem size %d, elem count %d, data size %d\n", i, tags[i].elem_size, tags[i].elem_count, tags[i].data_size);
+		}
+	}
+	/* coalesced elements and structure fields are views into their parent's read */
+	for (i = 0; i < plc->num_tags; i++) {
+		if (tags[i].parent == NULL) {
+			continue;
+		}
+		if (tags[i].field) {
+			tags[i].data_size = get_plc_data_type_size(tags[i].data_type);
+			if (tags[i].field_offset+tags[i].data_size > tags[i].parent->data_size) {
+				tags[i].data_size = 0;
+			}
+			tags[i].elem_size = tags[i].data_size;
+			tags[i].elem_count = 1;
+		} else if (tags[i].parent->data_size > 0 && tags[i].elem_index < tags[i].parent->elem_count) {
+			tags[i].elem_size = tags[i].parent->elem_size;
+			tags[i].elem_count = 1;
+			tags[i].data_size = tags[i].elem_size;
+		} else {
+			tags[i].data_size = 0;
+		}
+	}
+
+	/* value offsets, scan by scan */
+	for (j = 0; j < plc->sched.num_scans; j++) {
+		scan = &plc->sched.scans[j];
+		n = 0;
+		for (i = 0; i < scan->num_tags; i++) {
+			tag = scan->tags[i];
+			if (tag->parent == NULL && tag->data_size > 0) {
+				tag->offset = len;
+				len += slab_align(tag->data_size);
+				n += (tag->expr == NULL);
+			}
+			/* structures are only published through their fields */
+			if (use_shadow && tag->data_size > 0 && tag->data_type != STRUCT) {
+				shadows += slab_align(get_tag_value_size(tag));
+			}
+		}
+		free(scan->handles);
+		scan->handles = my_malloc((sizeof(int32_t)+2*sizeof(uint32_t)+sizeof(uint8_t))*(n > 0 ? n : 1) + 2*scan->num_tags);
+		if (scan->handles == NULL) {
+			fprintf(stderr, "%s: Failed to allocate memory for scan class\n", plc->name);
+			return 1;
+		}
+		scan->offsets = (uint32_t *)(scan->handles + n);
+		scan->sizes = scan->offsets + n;
+		scan->types = (uint8_t *)(scan->sizes + n);
+		/* tag qualities of both snapshots, num_tags per slot */
+		scan->qualities = scan->types + (n > 0 ? n : 1);
+		scan->num_hot = 0;
+	}
+
+	slab = my_malloc(2*len + shadows + 1);
+	if (slab == NULL) {
+		fprintf(stderr, "%s: Failed to allocate memory for tag data\n", plc->name);
+		return 1;
+	}
+	shadow = slab + 2*len;
+	for (j = 0; j < plc->sched.num_scans; j++) {
+		scan = &plc->sched.scans[j];
+		for (i = 0; i < scan->num_tags; i++) {
+			tag = scan->tags[i];
+			if (tag->data_size == 0) {
+				tag->data = NULL;
+				tag->shadow = NULL;
+				continue;
+			}
+			if (tag->parent == NULL && tag->expr == NULL) {
+				scan->handles[scan->num_hot] = tag->plctag;
+				scan->offsets[scan->num_hot] = (uint32_t)tag->offset;
+				scan->sizes[scan->num_hot] = (uint32_t)tag->data_size;
+				scan->types[scan->num_hot] = (uint8_t)tag->data_type;
+				scan->num_hot++;
+			} else if (tag->field) {
+				tag->offset = tag->parent->offset + tag->field_offset;
+			} else if (tag->parent != NULL) {
+				tag->offset = tag->parent->offset + tag->elem_index*tag->elem_size;
+			}
+			tag->data = slab + tag->offset;
+			if (use_shadow && tag->data_type != STRUCT) {
+				/* last published values survive a reload */
+				if (tag->shadow != NULL) {
+					memcpy(shadow, tag->shadow, get_tag_value_size(tag));
+				}
+				tag->shadow = shadow;
+				shadow += slab_align(get_tag_value_size(tag));
+			}
+		}
+		scan->slot = 0;
+	}
+
+	free(plc->slab);
+	free(plc->slab_prev);
+	plc->slab = slab;
+	plc->slab_len = len;
+	plc->slab_prev = NULL;
+	return 0;
+}
+
+/* update read quality after a cycle and quarantine tags that keep failing, returns number of failed reads
+ * a tag is only blamed when other reads in the same cycle got through, so a lost connection quarantines nothing */
+static int plc_quality(struct plc_t *plc, struct tag_t **tags, int num_tags, int64_t now)
+{
+	struct tag_t *tag = NULL;
+	int i = 0, ok = 0, failed = 0;
+
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i]->plctag > 0 && tags[i]->status == PLCTAG_STATUS_OK) {
+			ok++;
+		}
+	}
+	for (i = 0; i < num_tags; i++) {
+		tag = tags[i];
+		if (tag->plctag <= 0) {
+			continue;
+		}
+		if (tag->status == PLCTAG_STATUS_OK) {
+			if (tag->fails >= QUARANTINE_FAILS) {
+				fprintf(stderr, "%s: %s recovered after %d failed reads\n", plc->name, tag->name, tag->fails);
+			}
+			__atomic_store_n(&tag->quality, QUALITY_GOOD, __ATOMIC_RELAXED);
+			tag->fails = 0;
+			tag->backoff = 0;
+			tag->retry_at = 0;
+			continue;
+		}
+		/* the handle still holds the last good value */
+		failed++;
+		if (tag->quality == QUALITY_GOOD) {
+			__atomic_store_n(&tag->quality, QUALITY_STALE, __ATOMIC_RELAXED);
+		}
+		if (ok == 0) {
+			continue;
+		}
+		tag->fails++;
+		if (tag->fails >= QUARANTINE_FAILS) {
+			tag->backoff = (tag->backoff > 0) ? tag->backoff*2 : QUARANTINE_BACKOFF_MIN;
+			if (tag->backoff > QUARANTINE_BACKOFF_MAX) {
+				tag->backoff = QUARANTINE_BACKOFF_MAX;
+			}
+			tag->retry_at = now+tag->backoff;
+			fprintf(stderr, "%s: Quarantining %s for %ld ms after %d failed reads [%d]: %s\n", plc->name, tag->name,
+				tag->backoff, tag->fails, tag->status, plc_tag_decode_error(tag->status));
+			metrics_add(&plc->metrics.quarantines, 1);
+		}
+	}
+	return failed;
+}
+
+/* create plc tags, do the initial read and lay out tag storage, tags that already have a handle are kept */
+int plc_setup(struct plc_t *plc)
+{
+	int64_t timeout = 0;
+	int i = 0, handles = 0, failed = 0;
+
+	/* set timeout for tag create and initial read */
+	timeout = mono_ms() + plc->timeout;
+
+	if (create_tags(plc, timeout) != 0) {
+		return 1;
+	}
+
+	/* single tags that cannot be read are quarantined, only a controller that answers nothing is retried */
+	failed = read_tags(&plc->waiter, plc->all, plc->num_tags, timeout, NULL);
+	for (i = 0; i < plc->num_tags; i++) {
+		handles += (plc->tags[i].plctag > 0);
+	}
+	if (handles == 0 || failed == handles) {
+		fprintf(stderr, "%s: Timeout waiting for initial tag read\n", plc->name);
+		return 1;
+	}
+	plc_quality(plc, plc->all, plc->num_tags, mono_ms());
+
+	/* place tag values and shadows, sampled tags get their rings before payloads are sized */
+	if (layout_tags(plc) != 0 || sample_setup(plc) != 0 || aggregate_setup(plc) != 0) {
+		return 1;
+	}
+
+	/* precompile payload layout or per tag topics for each scan class, samples always go out as one blob */
+	for (i = 0; i < plc->sched.num_scans; i++) {
+		if (plc->mqtt->pubmode == PUB_MODE_TAG && plc->sched.scans[i].publish == 0) {
+			if (batch_compile(&plc->sched.scans[i].batch, plc->sched.scans[i].tags, plc->sched.scans[i].num_tags, plc->pubtopic) != 0) {
+				return 1;
+			}
+		} else if (payload_compile(&plc->sched.scans[i].payload, plc->sched.scans[i].tags, plc->sched.scans[i].num_tags,
+			   plc->mqtt->pubformat, plc->mqtt->pubkeys, (uint64_t)plc->number << 24) != 0) {
+			return 1;
+		}
+	}
+	/* sparkplug births list every tag of the controller at once */
+	if (plc->mqtt->pubformat == PUB_FORMAT_SPARKPLUG && payload_compile_birth(&plc->birth, plc->tags, plc->num_tags) != 0) {
+		return 1;
+	}
+	/* the compression dictionary is trained on these payloads */
+	if (compress_train(plc) != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+/* destroy plc tags and free the value slab, keeps the configured tag list */
+void plc_release(struct plc_t *plc)
+{
+	struct tag_t *tags = plc->tags;
+	int i = 0;
+
+	if (tags == NULL) {
+		return;
+	}
+	for (i = 0; i < plc->num_tags; i++) {
+		if (tags[i].plctag > 0) {
+			plc_tag_destroy(tags[i].plctag);
+			tags[i].plctag = 0;
+		}
+		write_release(&tags[i]);
+		tags[i].data = NULL;
+		tags[i].shadow = NULL;
+		tags[i].data_size = 0;
+		tags[i].pending = 0;
+		tags[i].published = 0;
+		tags[i].fails = 0;
+		tags[i].backoff = 0;
+		tags[i].retry_at = 0;
+	}
+	sample_free(plc);
+	aggregate_free(plc);
+	free(plc->slab);
+	free(plc->slab_prev);
+	plc->slab = NULL;
+	plc->slab_prev = NULL;
+	plc->slab_len = 0;
+}
+
+/* free the configured tag list, scan classes and their publish buffers */
+static void free_tag_set(struct plc_t *plc)
+{
+	int i = 0;
+
+	if (plc->tags != NULL) {
+		derive_free(plc);
+		for (i = 0; i < plc->num_tags; i++) {
+			if (plc->tags[i].key != NULL) {
+				free(plc->tags[i].key);
+				plc->tags[i].key = NULL;
+			}
+			if (plc->tags[i].topic != NULL) {
+				free(plc->tags[i].topic);
+				plc->tags[i].topic = NULL;
+			}
+		}
+		free(plc->tags);
+		plc->tags = NULL;
+	}
+	if (plc->names != NULL) {
+		free(plc->names);
+		plc->names = NULL;
+	}
+	if (plc->all != NULL) {
+		free(plc->all);
+		plc->all = NULL;
+	}
+	if (plc->index != NULL) {
+		free(plc->index);
+		plc->index = NULL;
+	}
+	for (i = 0; i < plc->sched.num_scans; i++) {
+		payload_free(&plc->sched.scans[i].payload);
+		batch_free(&plc->sched.scans[i].batch);
+	}
+	payload_free(&plc->birth);
+	compress_free(&plc->compress);
+	sched_free(&plc->sched);
+}
+
+void plc_free(struct plc_t *plc)
+{
+	plc_release(plc);
+	/* queued writes point into the tag list */
+	if (plc->wq != NULL) {
+		write_discard(plc, "shutdown");
+	}
+	free_tag_set(plc);
+	if (plc->next != NULL) {
+		plc_free(plc->next);
+		free(plc->next);
+		plc->next = NULL;
+	}
+	/* waiter, lock and write queue are only initialized once plc_init has run */
+	if (plc->mqtt != NULL) {
+		waiter_destroy(&plc->waiter);
+		pthread_cond_destroy(&plc->wcond);
+		pthread_mutex_destroy(&plc->lock);
+	}
+	free(plc->wq);
+	free(plc->wbatch);
+	free(plc->wtags);
+	plc->wq = NULL;
+	plc->wbatch = NULL;
+	plc->wtags = NULL;
+	config_free(plc);
+}
+
+/* build a reloaded tag set next to the running one, called from the main thread while no swap is pending
+ * tags that already exist are marked to be taken over, only new tags are created and read here */
+int plc_prepare(struct plc_t *plc, struct plc_t *next)
+{
+	int64_t timeout = 0;
+	int i = 0, created = 0;
+
+	if (plc_init(next, plc->mosq, plc->mqtt) != 0) {
+		return 1;
+	}
+	for (i = 0; i < next->num_tags; i++) {
+		if (next->tags[i].parent == NULL && plc_find_tag(plc, next->tags[i].name) != NULL) {
+			next->tags[i].keep = 1;
+		} else if (next->tags[i].parent == NULL) {
+			created++;
+		}
+	}
+	if (created == 0) {
+		return 0;
+	}
+
+	timeout = mono_ms() + next->timeout;
+	if (create_tags(next, timeout) != 0) {
+		return 1;
+	}
+	/* new tags that cannot be read are quarantined once the sets are swapped */
+	read_tags(&next->waiter, next->all, next->num_tags, timeout, NULL);
+	/* values are laid out by the polling thread once the sets are swapped */
+	return 0;
+}
+
+/* move handles from the running tag set into a prepared one, shadows are copied out when the new set is laid out */
+static int take_over_tags(struct plc_t *plc, struct plc_t *next)
+{
+	struct tag_t *tag = NULL, *old = NULL;
+	int i = 0, kept = 0;
+
+	for (i = 0; i < next->num_tags; i++) {
+		tag = &next->tags[i];
+		tag->waiter = &plc->waiter;
+		if (!tag->keep) {
+			continue;
+		}
+		tag->keep = 0;
+		old = plc_find_tag(plc, tag->name);
+		/* same name is not enough, the read itself has to be identical */
+		if (old == NULL || old->plctag <= 0 || old->parent != NULL || old->data_type != tag->data_type ||
+		    old->elem_count != ((tag->elem_count > 1) ? tag->elem_count : 1)) {
+			continue;
+		}
+		tag->plctag = old->plctag;
+		tag->data_size = old->data_size;
+		tag->elem_size = old->elem_size;
+		tag->elem_count = old->elem_count;
+		tag->shadow = old->shadow;
+		tag->published = old->published;
+		tag->last_value = old->last_value;
+		tag->read_max = old->read_max;
+		tag->status = old->status;
+		tag->quality = old->quality;
+		tag->view_quality = old->view_quality;
+		tag->pub_quality = old->pub_quality;
+		tag->fails = old->fails;
+		tag->backoff = old->backoff;
+		tag->retry_at = old->retry_at;
+		old->plctag = 0;
+		old->shadow = NULL;
+		/* completion events now belong to the new tag structure */
+		plc_tag_unregister_callback(tag->plctag);
+		plc_tag_register_callback_ex(tag->plctag, waiter_callback, tag);
+		kept++;
+	}
+	return kept;
+}
+
+/* swap in a pending reloaded tag set, runs on the polling thread between cycles */
+static int plc_swap(struct plc_t *plc)
+{
+	struct plc_t *next = NULL;
+	uint8_t *slab = NULL;
+	int kept = 0;
+
+	pthread_mutex_lock(&plc->lock);
+	next = plc->next;
+	plc->next = NULL;
+	pthread_mutex_unlock(&plc->lock);
+	if (next == NULL) {
+		return 0;
+	}
+
+	/* queued writes and publishes refer to the old tag set */
+	write_flush(plc);
+	pipe_drain(plc);
+	kept = take_over_tags(plc, next);
+
+	/* destroy tags that were removed or changed, then drop the old set
+	 * the old slab still holds the shadows of kept tags until the new set is laid out */
+	slab = plc->slab;
+	plc->slab = NULL;
+	plc_release(plc);
+	plc->slab_prev = slab;
+	pthread_mutex_lock(&plc->lock);
+	write_discard(plc, "reloaded");
+	free_tag_set(plc);
+	plc->tags = next->tags;
+	plc->num_tags = next->num_tags;
+	plc->names = next->names;
+	plc->all = next->all;
+	plc->index = next->index;
+	plc->sched = next->sched;
+	plc->timeout = next->timeout;
+	plc->interval = next->interval;
+	plc->catchup = next->catchup;
+	/* aliases follow the tag set, hosts need a new birth */
+	plc->births = -1;
+	pthread_mutex_unlock(&plc->lock);
+	fprintf(stderr, "%s: Reloaded configuration, %d tags, %d handles kept\n", plc->name, plc->num_tags, kept);
+
+	next->tags = NULL;
+	next->num_tags = 0;
+	next->names = NULL;
+	next->all = NULL;
+	next->index = NULL;
+	memset(&next->sched, 0, sizeof(struct sched_t));
+	plc_free(next);
+	free(next);
+	return 1;
+}
+
+/* wait up to ms milliseconds, waking early on shutdown */
+static void plc_sleep(int64_t ms)
+{
+	while (run && ms > 0) {
+		sleep_ms(ms > 1000 ? 1000 : ms);
+		ms -= 1000;
+	}
+}
+
+/* poll one controller until shutdown, a failed setup is retried so other controllers keep running */
+void *plc_thread(void *arg)
+{
+	struct plc_t *plc = (struct plc_t *)arg;
+	struct sched_t *sched = &plc->sched;
+	struct scan_t *scan = NULL;
+	struct metrics_t *m = &plc->metrics;
+	int64_t start = 0, cycle = 0, stamp = 0, clock = 0;
+	int missed = 0;
+	int i = 0, j = 0, read = 0, failed = 0;
+
+	/* formatting and publishing run on their own thread so reads never wait for the broker */
+	if (pipe_start(plc) != 0) {
+		return NULL;
+	}
+
+	while (run) {
+		/* a reload that arrived while disconnected is simply adopted before the next attempt */
+		plc_swap(plc);
+		if (plc_setup(plc) != 0) {
+			plc_release(plc);
+			if (plc->mqtt->pubformat == PUB_FORMAT_SPARKPLUG) {
+				sparkplug_death(plc);
+			}
+			fprintf(stderr, "%s: Retrying in %d ms\n", plc->name, PLC_RETRY_DELAY);
+			plc_sleep(PLC_RETRY_DELAY);
+			continue;
+		}
+
+		/* read loop, only scan classes that are due get read */
+		sched_start(sched, mono_ms());
+		while (run) {
+			/* take over a reloaded tag set between cycles, only added or changed tags need creating */
+			if (__atomic_load_n(&plc->next, __ATOMIC_ACQUIRE) != NULL && plc_swap(plc)) {
+				if (plc_setup(plc) != 0) {
+					pipe_drain(plc);
+					plc_release(plc);
+					break;
+				}
+				sched_start(sched, mono_ms());
+			}
+			/* writes go out between reads, waiting for the next scan wakes up for new writes */
+			write_flush(plc);
+			start = mono_ms();
+			scan = sched_peek(sched);
+			if (scan->next > start) {
+				/* absolute monotonic deadline, wall clock steps and wakeup jitter do not shift the schedule */
+				write_wait(plc, scan->next);
+				continue;
+			}
+			cycle = time_us();
+			sched_collect(sched, start);
+			read_tags(&plc->waiter, sched->due, sched->num_due, start + plc->timeout, m);
+			plc_quality(plc, sched->due, sched->num_due, mono_ms());
+			/* publish stamps come from the wall clock when the reads completed, samples convert their own completion times */
+			stamp = time_ms();
+			clock = stamp*1000-time_us();
+
+			for (j = 0; j < sched->num_ready; j++) {
+				scan = sched->ready[j];
+				read = 0;
+				failed = 0;
+				for (i = 0; i < scan->num_tags; i++) {
+					/* quarantined tags were not read this cycle */
+					if (scan->tags[i]->plctag > 0 && scan->tags[i]->read_start >= cycle) {
+						read++;
+						failed += (scan->tags[i]->status != PLCTAG_STATUS_OK);
+					}
+				}
+				if (failed > 0) {
+					metrics_add(&m->timeouts, 1);
+				}
+				if (scan->publish > 0) {
+					/* sampled scans keep every read and only publish at their publish interval */
+					sample_push(plc, scan, cycle, clock);
+					scan->failures += (failed > 0 && failed == read);
+					if (start >= scan->next_publish) {
+						scan->next_publish += scan->publish*((start-scan->next_publish)/scan->publish+1);
+						pipe_push(plc, scan, stamp);
+					}
+				} else {
+					if (failed > 0 && failed == read) {
+						fprintf(stderr, "%s: Timeout waiting for tag read\n", plc->name);
+						scan->failures++;
+					}
+					/* snapshot tag data and hand it to the publisher, failed tags go out flagged stale */
+					pipe_push(plc, scan, stamp);
+				}
+				missed = sched_done(sched, scan, mono_ms());
+				if (missed > 0) {
+					metrics_add(&m->overruns, 1);
+					metrics_add(&m->missed, missed);
+				}
+			}
+			hist_record(&m->cycle, time_us()-cycle);
+			metrics_add(&m->cycles, 1);
+			sched_report(sched, plc->name, mono_ms());
+			metrics_publish(plc, mono_ms());
+		}
+	}
+
+	pipe_stop(plc);
+	plc_release(plc);
+	return NULL;
+}
@@ -0,0 +1,107 @@
+#include "logix2mqtt.h"
+
+/* give every tag of a sampled scan class a ring holding two publish intervals of samples
+ * stamps and values share the ring's allocation */
+int sample_setup(struct plc_t *plc)
+{
+	struct scan_t *scan = NULL;
+	struct tag_t *tag = NULL;
+	struct ring_t *r = NULL;
+	unsigned int cap = 0;
+	size_t size = 0;
+	int i = 0, j = 0;
+
+	for (j = 0; j < plc->sched.num_scans; j++) {
+		scan = &plc->sched.scans[j];
+		if (scan->publish <= 0) {
+			continue;
+		}
+		cap = (unsigned int)(2*(scan->publish/scan->rate)+2);
+		for (i = 0; i < scan->num_tags; i++) {
+			tag = scan->tags[i];
+			if (tag->data_size == 0 || tag->data_type == STRUCT || tag->ring != NULL) {
+				continue;
+			}
+			size = get_tag_value_size(tag);
+			r = my_malloc(sizeof(struct ring_t)+cap*(sizeof(int64_t)+size));
+			if (r == NULL) {
+				fprintf(stderr, "%s: Failed to allocate memory for samples of %s\n", plc->name, tag->name);
+				return 1;
+			}
+			r->stamps = (int64_t *)(r+1);
+			r->values = (uint8_t *)(r->stamps+cap);
+			r->size = size;
+			r->cap = cap;
+			tag->ring = r;
+		}
+	}
+	return 0;
+}
+
+void sample_free(struct plc_t *plc)
+{
+	int i = 0;
+
+	for (i = 0; i < plc->num_tags; i++) {
+		free(plc->tags[i].ring);
+		plc->tags[i].ring = NULL;
+	}
+}
+
+/* copy a tag's freshly read value out of its handle, views take theirs from the parent's read */
+static void sample_read(struct tag_t *tag, uint8_t *dst, size_t size)
+{
+	struct tag_t *root = (tag->parent != NULL) ? tag->parent : tag;
+	int offset = 0;
+
+	if (tag->parent != NULL) {
+		offset = tag->field ? tag->field_offset : tag->elem_index*tag->elem_size;
+	}
+	if (tag->data_type == BIT && !tag->field) {
+		*(int *)dst = plc_tag_get_bit(root->plctag, 0);
+	} else {
+		plc_tag_get_raw_bytes(root->plctag, offset, dst, (int)size);
+	}
+}
+
+/* keep the values read this cycle as samples stamped with their read completion, runs on the polling thread
+ * clock is the wall clock minus the monotonic clock in microseconds, a full ring drops the new sample */
+void sample_push(struct plc_t *plc, struct scan_t *scan, int64_t cycle, int64_t clock)
+{
+	struct tag_t *tag = NULL, *root = NULL;
+	struct ring_t *r = NULL;
+	unsigned int head = 0, slot = 0;
+	int i = 0;
+
+	for (i = 0; i < scan->num_tags; i++) {
+		tag = scan->tags[i];
+		root = (tag->parent != NULL) ? tag->parent : tag;
+		r = tag->ring;
+		if (r == NULL || root->plctag <= 0 || root->read_start < cycle || root->status != PLCTAG_STATUS_OK) {
+			continue;
+		}
+		head = r->head;
+		if (head-__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->cap) {
+			metrics_add(&plc->metrics.samples_dropped, 1);
+			continue;
+		}
+		slot = head % r->cap;
+		r->stamps[slot] = (root->read_done+clock)/1000;
+		sample_read(tag, r->values+slot*r->size, r->size);
+		__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+	}
+}
+
+/* claim the samples taken so far for one publish, returns how many */
+unsigned int sample_take(struct ring_t *r)
+{
+	r->taken = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)-r->tail;
+	return r->taken;
+}
+
+/* hand the published samples' slots back to the polling thread */
+void sample_release(struct ring_t *r)
+{
+	__atomic_store_n(&r->tail, r->tail+r->taken, __ATOMIC_RELEASE);
+	r->taken = 0;
+}
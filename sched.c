@@ -0,0 +1,283 @@
+#include "logix2mqtt.h"
+
+/* a scan class reads at rate, sampled classes keep every read and publish them at their publish interval
+ * aggregating classes publish statistics once per window instead of their values */
+struct rate_t {
+	int64_t rate;
+	int64_t publish;
+	int64_t window;
+};
+
+static int compare_rate(const void *a, const void *b)
+{
+	const struct rate_t *x = (const struct rate_t *)a;
+	const struct rate_t *y = (const struct rate_t *)b;
+
+	if (x->rate != y->rate) {
+		return (x->rate > y->rate) - (x->rate < y->rate);
+	}
+	if (x->publish != y->publish) {
+		return (x->publish > y->publish) - (x->publish < y->publish);
+	}
+	return (x->window > y->window) - (x->window < y->window);
+}
+
+static struct rate_t tag_rate(struct tag_t *tag)
+{
+	struct rate_t r = {tag->scan, 0, tag->aggregate};
+
+	if (tag->sample > 0) {
+		r.rate = tag->sample;
+		r.publish = tag->scan;
+	}
+	return r;
+}
+
+/* group tags into scan classes by their scan rate, keeping config order within each class */
+int sched_init(struct sched_t *s, struct tag_t *tags, int num_tags, int64_t interval)
+{
+	struct rate_t *rates = NULL, r;
+	int i = 0, j = 0, n = 0;
+
+	if (s == NULL || tags == NULL || num_tags <= 0) {
+		return 1;
+	}
+	memset(s, 0, sizeof(struct sched_t));
+
+	/* find the distinct scan rates */
+	rates = my_malloc(sizeof(struct rate_t)*num_tags);
+	if (rates == NULL) {
+		fprintf(stderr, "Failed to allocate memory for scan rates\n");
+		return 1;
+	}
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i].scan <= 0) {
+			tags[i].scan = interval;
+		}
+		if (tags[i].sample >= tags[i].scan) {
+			fprintf(stderr, "Tag %s samples no faster than it publishes, sampling disabled\n", tags[i].name);
+			tags[i].sample = 0;
+		}
+		if (tags[i].aggregate > 0 && tags[i].aggregate < tags[i].scan) {
+			fprintf(stderr, "Tag %s aggregates over less than its scan, aggregation disabled\n", tags[i].name);
+			tags[i].aggregate = 0;
+		}
+		rates[i] = tag_rate(&tags[i]);
+	}
+	qsort(rates, num_tags, sizeof(struct rate_t), compare_rate);
+	for (i = 0; i < num_tags; i++) {
+		if (n == 0 || compare_rate(&rates[n-1], &rates[i]) != 0) {
+			rates[n++] = rates[i];
+		}
+	}
+
+	s->scans = my_malloc(sizeof(struct scan_t)*n);
+	s->heap = my_malloc(sizeof(struct scan_t *)*n);
+	s->ready = my_malloc(sizeof(struct scan_t *)*n);
+	s->due = my_malloc(sizeof(struct tag_t *)*num_tags);
+	if (s->scans == NULL || s->heap == NULL || s->ready == NULL || s->due == NULL) {
+		fprintf(stderr, "Failed to allocate memory for scan classes\n");
+		free(rates);
+		sched_free(s);
+		return 1;
+	}
+	s->num_scans = n;
+
+	/* fill each class with its tags */
+	for (j = 0; j < n; j++) {
+		s->scans[j].rate = rates[j].rate;
+		s->scans[j].publish = rates[j].publish;
+		s->scans[j].window = rates[j].window;
+		for (i = 0; i < num_tags; i++) {
+			r = tag_rate(&tags[i]);
+			if (compare_rate(&r, &rates[j]) == 0) {
+				s->scans[j].num_tags++;
+			}
+		}
+		/* derived tags are listed again after the class's tags, in config order */
+		s->scans[j].tags = my_malloc(2*sizeof(struct tag_t *)*s->scans[j].num_tags);
+		if (s->scans[j].tags == NULL) {
+			fprintf(stderr, "Failed to allocate memory for scan class\n");
+			free(rates);
+			sched_free(s);
+			return 1;
+		}
+		s->scans[j].derived = s->scans[j].tags+s->scans[j].num_tags;
+		s->scans[j].num_tags = 0;
+		for (i = 0; i < num_tags; i++) {
+			r = tag_rate(&tags[i]);
+			if (compare_rate(&r, &rates[j]) == 0) {
+				s->scans[j].tags[s->scans[j].num_tags++] = &tags[i];
+				if (tags[i].code != NULL) {
+					s->scans[j].derived[s->scans[j].num_derived++] = &tags[i];
+				}
+			}
+		}
+	}
+
+	free(rates);
+	return 0;
+}
+
+void sched_free(struct sched_t *s)
+{
+	int i = 0;
+
+	if (s == NULL) {
+		return;
+	}
+	if (s->scans != NULL) {
+		for (i = 0; i < s->num_scans; i++) {
+			if (s->scans[i].tags != NULL) {
+				free(s->scans[i].tags);
+			}
+			/* hot arrays share one allocation */
+			free(s->scans[i].handles);
+		}
+		free(s->scans);
+	}
+	if (s->heap != NULL) {
+		free(s->heap);
+	}
+	if (s->ready != NULL) {
+		free(s->ready);
+	}
+	if (s->due != NULL) {
+		free(s->due);
+	}
+	memset(s, 0, sizeof(struct sched_t));
+}
+
+/* min-heap of scan classes ordered by next due time */
+void sched_push(struct sched_t *s, struct scan_t *scan)
+{
+	int i = s->count++, parent = 0;
+
+	while (i > 0) {
+		parent = (i-1)/2;
+		if (s->heap[parent]->next <= scan->next) {
+			break;
+		}
+		s->heap[i] = s->heap[parent];
+		i = parent;
+	}
+	s->heap[i] = scan;
+}
+
+struct scan_t *sched_peek(struct sched_t *s)
+{
+	return (s->count > 0) ? s->heap[0] : NULL;
+}
+
+struct scan_t *sched_pop(struct sched_t *s)
+{
+	struct scan_t *top = NULL, *last = NULL;
+	int i = 0, child = 0;
+
+	if (s->count == 0) {
+		return NULL;
+	}
+	top = s->heap[0];
+	last = s->heap[--s->count];
+	while ((child = 2*i+1) < s->count) {
+		if (child+1 < s->count && s->heap[child+1]->next < s->heap[child]->next) {
+			child++;
+		}
+		if (last->next <= s->heap[child]->next) {
+			break;
+		}
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	if (s->count > 0) {
+		s->heap[i] = last;
+	}
+	return top;
+}
+
+/* make every scan class due now */
+void sched_start(struct sched_t *s, int64_t now)
+{
+	int i = 0;
+
+	s->count = 0;
+	s->last_report = now;
+	for (i = 0; i < s->num_scans; i++) {
+		s->scans[i].next = now;
+		s->scans[i].next_publish = now+s->scans[i].publish;
+		s->scans[i].stat_start = now;
+		s->scans[i].cycles = 0;
+		s->scans[i].overruns = 0;
+		s->scans[i].missed = 0;
+		s->scans[i].failures = 0;
+		sched_push(s, &s->scans[i]);
+	}
+}
+
+/* pop every scan class that is due and build the list of tags to read, returns number of classes */
+int sched_collect(struct sched_t *s, int64_t now)
+{
+	struct scan_t *scan = NULL;
+	int i = 0;
+
+	s->num_ready = 0;
+	s->num_due = 0;
+	while ((scan = sched_peek(s)) != NULL && scan->next <= now) {
+		s->ready[s->num_ready++] = sched_pop(s);
+		for (i = 0; i < scan->num_tags; i++) {
+			/* quarantined tags sit out until their backoff expires */
+			if (scan->tags[i]->plctag > 0 && scan->tags[i]->retry_at <= now) {
+				s->due[s->num_due++] = scan->tags[i];
+			}
+		}
+	}
+	return s->num_ready;
+}
+
+/* account for a finished scan and queue its next deadline, returns the number of deadlines missed
+ * skip keeps the original grid and drops missed slots, immediate runs again now and re-anchors the grid */
+int sched_done(struct sched_t *s, struct scan_t *scan, int64_t end)
+{
+	int missed = 0;
+
+	scan->cycles++;
+	scan->next += scan->rate;
+	if (scan->next <= end) {
+		missed = (int)((end-scan->next)/scan->rate+1);
+		scan->overruns++;
+		scan->missed += missed;
+		if (s->catchup == CATCHUP_IMMEDIATE) {
+			scan->next = end;
+		} else {
+			scan->next += (int64_t)missed*scan->rate;
+		}
+	}
+	sched_push(s, scan);
+	return missed;
+}
+
+/* periodically log achieved against requested scan rates */
+void sched_report(struct sched_t *s, const char *name, int64_t now)
+{
+	struct scan_t *scan = NULL;
+	int i = 0;
+
+	if (now-s->last_report < SCHED_REPORT_INTERVAL) {
+		return;
+	}
+	for (i = 0; i < s->num_scans; i++) {
+		scan = &s->scans[i];
+		if (scan->cycles > 0) {
+			fprintf(stderr, "%s: scan %ld ms: %d tags, %d cycles, achieved %.1f ms, %d overruns, %d missed, %d failed\n",
+				name, scan->rate, scan->num_tags, scan->cycles, (double)(now-scan->stat_start)/scan->cycles, scan->overruns, scan->missed, scan->failures);
+		} else {
+			fprintf(stderr, "%s: scan %ld ms: %d tags, no cycles\n", name, scan->rate, scan->num_tags);
+		}
+		scan->stat_start = now;
+		scan->cycles = 0;
+		scan->overruns = 0;
+		scan->missed = 0;
+		scan->failures = 0;
+	}
+	s->last_report = now;
+}
@@ -0,0 +1,247 @@
+#include "logix2mqtt.h"
+
+/* the edge node is this process, every controller is one of its devices */
+#define SP_NAMESPACE "spBv1.0"
+#define SP_REBIRTH "Node Control/Rebirth"
+
+int sparkplug_topic(char *buf, size_t size, struct mqtt_t *mqtt, const char *type, const char *device)
+{
+	if (device != NULL) {
+		return snprintf(buf, size, "%s/%s/%s/%s/%s", SP_NAMESPACE, mqtt->spgroup, type, mqtt->spnode, device);
+	}
+	return snprintf(buf, size, "%s/%s/%s/%s", SP_NAMESPACE, mqtt->spgroup, type, mqtt->spnode);
+}
+
+/* message sequence shared by every device of the node, wraps at 256
+ * callers hold mqtt->splock until the message is published, so messages leave in sequence order */
+uint64_t sparkplug_seq(struct mqtt_t *mqtt)
+{
+	return mqtt->spseq++ & 0xff;
+}
+
+/* register the node death certificate for the next connect, called before connecting and after every disconnect */
+int sparkplug_will(struct mosquitto *mosq, struct mqtt_t *mqtt)
+{
+	char topic[512], buf[64];
+	size_t len = 0;
+	int rc = 0;
+
+	sparkplug_topic(topic, sizeof(topic), mqtt, "NDEATH", NULL);
+	len = payload_node(buf, 0, mqtt->bdseq, 0);
+	rc = mosquitto_will_set(mosq, topic, (int)len, buf, 1, false);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Failed to set sparkplug death certificate: %s\n", mosquitto_strerror(rc));
+		return 1;
+	}
+	return 0;
+}
+
+/* publish the node birth certificate, the sequence restarts with it */
+int sparkplug_node_birth(struct mosquitto *mosq, struct mqtt_t *mqtt)
+{
+	char topic[512], buf[128];
+	size_t len = 0;
+	int rc = 0;
+
+	sparkplug_topic(topic, sizeof(topic), mqtt, "NBIRTH", NULL);
+	len = payload_node(buf, time_ms(), mqtt->bdseq, 1);
+	pthread_mutex_lock(&mqtt->splock);
+	mqtt->spseq = 1;
+	rc = mosquitto_publish(mosq, NULL, topic, (int)len, buf, 0, false);
+	pthread_mutex_unlock(&mqtt->splock);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error publishing sparkplug node birth: %s\n", mosquitto_strerror(rc));
+		return 1;
+	}
+	return 0;
+}
+
+/* publish the node death certificate ahead of a clean disconnect, the broker only sends the will when the connection drops */
+int sparkplug_node_death(struct mosquitto *mosq, struct mqtt_t *mqtt)
+{
+	char topic[512], buf[64];
+	size_t len = 0;
+	int rc = 0;
+
+	sparkplug_topic(topic, sizeof(topic), mqtt, "NDEATH", NULL);
+	len = payload_node(buf, 0, mqtt->bdseq, 0);
+	rc = mosquitto_publish(mosq, NULL, topic, (int)len, buf, 1, false);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error publishing sparkplug node death: %s\n", mosquitto_strerror(rc));
+		return 1;
+	}
+	return 0;
+}
+
+/* publish a controller's birth certificate with every tag, runs on the publishing thread
+ * only the scan being published has a fresh snapshot, other tags carry their last published value or null */
+int sparkplug_birth(struct plc_t *plc, struct scan_t *scan)
+{
+	struct payload_t *p = &plc->birth;
+	struct scan_t *s = NULL;
+	struct tag_t *tag = NULL;
+	const void *data = NULL;
+	char topic[512];
+	int i = 0, j = 0, rc = 0;
+
+	if (p->buf == NULL) {
+		fprintf(stderr, "%s: Birth certificate has not been compiled\n", plc->name);
+		return MOSQ_ERR_INVAL;
+	}
+	payload_begin(p, scan->stamp);
+	for (j = 0; j < plc->sched.num_scans; j++) {
+		s = &plc->sched.scans[j];
+		for (i = 0; i < s->num_tags; i++) {
+			tag = s->tags[i];
+			if (tag_quality(tag) == QUALITY_BAD) {
+				data = NULL;
+			} else if (s == scan) {
+				data = tag->data;
+			} else {
+				data = tag->published ? tag->shadow : NULL;
+			}
+			payload_birth_add(p, tag, data);
+		}
+	}
+	sparkplug_topic(topic, sizeof(topic), plc->mqtt, "DBIRTH", plc->name);
+	pthread_mutex_lock(&plc->mqtt->splock);
+	p->seq = sparkplug_seq(plc->mqtt);
+	payload_end(p);
+	rc = mosquitto_publish(plc->mosq, NULL, topic, (int)p->len, p->buf, 0, false);
+	pthread_mutex_unlock(&plc->mqtt->splock);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "%s: Error publishing sparkplug birth: %s\n", plc->name, mosquitto_strerror(rc));
+	} else {
+		fprintf(stderr, "%s: Published sparkplug birth, %d metrics, %zu bytes\n", plc->name, p->count-1, p->len);
+	}
+	return rc;
+}
+
+/* tell the host a born controller has gone away, its next birth follows once it is set up again */
+void sparkplug_death(struct plc_t *plc)
+{
+	struct payload_t p = {0};
+	char topic[512], buf[32];
+	int rc = 0;
+
+	if (plc->births <= 0 || !plc->mqtt->connected) {
+		return;
+	}
+	p.buf = buf;
+	p.size = sizeof(buf);
+	p.format = PUB_FORMAT_SPARKPLUG;
+	payload_begin(&p, time_ms());
+	sparkplug_topic(topic, sizeof(topic), plc->mqtt, "DDEATH", plc->name);
+	pthread_mutex_lock(&plc->mqtt->splock);
+	p.seq = sparkplug_seq(plc->mqtt);
+	payload_end(&p);
+	rc = mosquitto_publish(plc->mosq, NULL, topic, (int)p.len, p.buf, 0, false);
+	pthread_mutex_unlock(&plc->mqtt->splock);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "%s: Error publishing sparkplug death: %s\n", plc->name, mosquitto_strerror(rc));
+	}
+	plc->births = -1;
+}
+
+static int read_pb_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*pos < len && shift < 64) {
+		*v |= (uint64_t)(buf[*pos] & 0x7f) << shift;
+		if ((buf[(*pos)++] & 0x80) == 0) {
+			return 0;
+		}
+		shift += 7;
+	}
+	return 1;
+}
+
+/* step over a field of the given wire type, length delimited fields return their body */
+static int skip_pb_field(const uint8_t *buf, size_t len, size_t *pos, int wire, const uint8_t **body, size_t *body_len)
+{
+	uint64_t v = 0;
+
+	switch (wire) {
+	case 0:
+		return read_pb_varint(buf, len, pos, &v);
+	case 1:
+		*pos += 8;
+		break;
+	case 2:
+		if (read_pb_varint(buf, len, pos, &v) != 0 || v > len-*pos) {
+			return 1;
+		}
+		*body = buf+*pos;
+		*body_len = (size_t)v;
+		*pos += (size_t)v;
+		break;
+	case 5:
+		*pos += 4;
+		break;
+	default:
+		return 1;
+	}
+	return (*pos > len);
+}
+
+/* true when a command metric is the rebirth request set to true */
+static int metric_rebirth(const uint8_t *buf, size_t len)
+{
+	const uint8_t *body = NULL;
+	size_t pos = 0, body_len = 0;
+	uint64_t key = 0, v = 0;
+	int named = 0, value = 0;
+
+	while (pos < len) {
+		if (read_pb_varint(buf, len, &pos, &key) != 0) {
+			return 0;
+		}
+		if (key == 0x70) {
+			if (read_pb_varint(buf, len, &pos, &v) != 0) {
+				return 0;
+			}
+			value = (v != 0);
+			continue;
+		}
+		if (skip_pb_field(buf, len, &pos, (int)(key & 7), &body, &body_len) != 0) {
+			return 0;
+		}
+		if ((key >> 3) == 1 && (key & 7) == 2) {
+			named = (body_len == strlen(SP_REBIRTH) && memcmp(body, SP_REBIRTH, body_len) == 0);
+		}
+	}
+	return named && value;
+}
+
+/* handle a node command, returns 0 when the topic is not this node's command topic
+ * a rebirth request births the node again and makes every controller send its birth and a full publish */
+int sparkplug_command(struct mosquitto *mosq, struct mqtt_t *mqtt, const char *topic, const void *payload, int len)
+{
+	const uint8_t *buf = (const uint8_t *)payload, *body = NULL;
+	char ncmd[512];
+	size_t pos = 0, body_len = 0;
+	uint64_t key = 0;
+	int rebirth = 0;
+
+	sparkplug_topic(ncmd, sizeof(ncmd), mqtt, "NCMD", NULL);
+	if (strcmp(topic, ncmd) != 0) {
+		return 0;
+	}
+	while (pos < (size_t)len) {
+		if (read_pb_varint(buf, len, &pos, &key) != 0 || skip_pb_field(buf, len, &pos, (int)(key & 7), &body, &body_len) != 0) {
+			fprintf(stderr, "Malformed sparkplug command\n");
+			return 1;
+		}
+		if ((key >> 3) == 2 && (key & 7) == 2 && metric_rebirth(body, body_len)) {
+			rebirth = 1;
+		}
+	}
+	if (rebirth) {
+		fprintf(stderr, "Sparkplug rebirth requested\n");
+		sparkplug_node_birth(mosq, mqtt);
+		__atomic_add_fetch(&mqtt->connects, 1, __ATOMIC_RELEASE);
+	}
+	return 1;
+}
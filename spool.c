@@ -0,0 +1,367 @@
+#include "logix2mqtt.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define SPOOL_MAGIC (0x4c58534bU)
+#define SPOOL_VERSION (1)
+#define SPOOL_REC_MAGIC (0x52454331U)
+#define SPOOL_WRAP_MAGIC (0x57524150U)
+#define SPOOL_HDR_SIZE (4096)
+#define SPOOL_ALIGN(n) (((n)+7) & ~(uint64_t)7)
+
+/* file header, head and tail are logical byte offsets that only ever grow */
+struct spool_hdr_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+};
+
+struct spool_rec_t {
+	uint32_t magic;
+	uint32_t crc;
+	uint32_t topic_len;
+	uint32_t payload_len;
+};
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t c = 0;
+	int i = 0, k = 0;
+
+	for (i = 0; i < 256; i++) {
+		c = (uint32_t)i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+
+	crc = ~crc;
+	for (i = 0; i < len; i++) {
+		crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static uint32_t record_crc(struct spool_rec_t *rec)
+{
+	uint32_t crc = crc32_update(0, (const uint8_t *)&rec->topic_len, sizeof(uint32_t)*2);
+
+	return crc32_update(crc, (const uint8_t *)(rec+1), rec->topic_len+rec->payload_len);
+}
+
+static struct spool_rec_t *record_at(struct spool_t *s, uint64_t off)
+{
+	return (struct spool_rec_t *)(s->data + off % s->hdr->capacity);
+}
+
+/* size a record occupies at the given offset, including a wrap to the start of the ring */
+static uint64_t record_span(struct spool_t *s, uint64_t off)
+{
+	struct spool_rec_t *rec = record_at(s, off);
+	uint64_t left = s->hdr->capacity - off % s->hdr->capacity;
+
+	if (left < sizeof(struct spool_rec_t) || rec->magic == SPOOL_WRAP_MAGIC) {
+		return left;
+	}
+	return SPOOL_ALIGN(sizeof(struct spool_rec_t)+rec->topic_len+rec->payload_len);
+}
+
+/* flush part of the mapping to disk, msync works on whole pages */
+static void sync_range(void *addr, size_t len)
+{
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page-1);
+
+	msync((void *)start, (uintptr_t)addr+len-start, MS_SYNC);
+}
+
+/* move the tail past replayed records the broker has acknowledged, everything before sent is done once none are pending */
+static void advance_tail(struct spool_t *s)
+{
+	struct spool_pending_t *p = NULL;
+
+	while (s->num_pending > 0 && s->pending[s->first_pending].acked) {
+		p = &s->pending[s->first_pending];
+		if (p->end > s->hdr->tail) {
+			s->hdr->tail = p->end;
+		}
+		s->first_pending = (s->first_pending+1) % SPOOL_INFLIGHT;
+		s->num_pending--;
+	}
+	if (s->num_pending == 0 && s->sent > s->hdr->tail) {
+		s->hdr->tail = s->sent;
+	}
+}
+
+/* map the spool file, keeping any backlog left by a previous run */
+int spool_open(struct spool_t *s, const char *fn, uint64_t capacity, int rate)
+{
+	struct stat st = {0};
+	size_t map_size = SPOOL_HDR_SIZE+SPOOL_ALIGN(capacity);
+	int fresh = 0;
+
+	memset(s, 0, sizeof(struct spool_t));
+	s->fd = -1;
+	s->rate = (rate > 0) ? rate : SPOOL_RATE_DEFAULT;
+	crc32_init();
+
+	s->fd = open(fn, O_RDWR | O_CREAT, 0640);
+	if (s->fd < 0) {
+		fprintf(stderr, "Failed to open spool file [%d]: %s\n", errno, strerror(errno));
+		return 1;
+	}
+	if (fstat(s->fd, &st) != 0 || (size_t)st.st_size != map_size) {
+		fresh = 1;
+		if (ftruncate(s->fd, map_size) != 0) {
+			fprintf(stderr, "Failed to size spool file [%d]: %s\n", errno, strerror(errno));
+			close(s->fd);
+			s->fd = -1;
+			return 1;
+		}
+	}
+	s->map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map spool file [%d]: %s\n", errno, strerror(errno));
+		s->map = NULL;
+		close(s->fd);
+		s->fd = -1;
+		return 1;
+	}
+	s->map_size = map_size;
+	s->hdr = (struct spool_hdr_t *)s->map;
+	s->data = s->map+SPOOL_HDR_SIZE;
+
+	if (!fresh && (s->hdr->magic != SPOOL_MAGIC || s->hdr->version != SPOOL_VERSION || s->hdr->capacity != SPOOL_ALIGN(capacity) ||
+	    s->hdr->tail > s->hdr->head || s->hdr->head-s->hdr->tail > s->hdr->capacity)) {
+		fprintf(stderr, "Spool file header is invalid, discarding backlog\n");
+		fresh = 1;
+	}
+	if (fresh) {
+		memset(s->hdr, 0, sizeof(struct spool_hdr_t));
+		s->hdr->magic = SPOOL_MAGIC;
+		s->hdr->version = SPOOL_VERSION;
+		s->hdr->capacity = SPOOL_ALIGN(capacity);
+		msync(s->map, SPOOL_HDR_SIZE, MS_SYNC);
+	} else if (s->hdr->head > s->hdr->tail) {
+		fprintf(stderr, "Spool has %lu bytes of backlog to replay\n", (unsigned long)(s->hdr->head-s->hdr->tail));
+	}
+	s->sent = s->hdr->tail;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->open = 1;
+	return 0;
+}
+
+/* append one message, the oldest records are dropped when the ring is full
+ * the record is on disk before the head that covers it, a crash loses at most the message being appended */
+int spool_append(struct spool_t *s, const char *topic, const void *payload, int payload_len)
+{
+	struct spool_rec_t *rec = NULL;
+	uint64_t size = 0, left = 0, skip = 0, head = 0;
+	uint32_t topic_len = 0;
+
+	if (s == NULL || !s->open || topic == NULL || payload_len < 0) {
+		return 1;
+	}
+	topic_len = strlen(topic);
+	size = SPOOL_ALIGN(sizeof(struct spool_rec_t)+topic_len+payload_len);
+	if (size > s->hdr->capacity/2 || topic_len >= sizeof(s->topic)) {
+		fprintf(stderr, "Message of %d bytes is too large to spool\n", payload_len);
+		return 1;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	head = s->hdr->head;
+	left = s->hdr->capacity - head % s->hdr->capacity;
+	skip = (left < size) ? left : 0;
+
+	/* make room by dropping the oldest records */
+	while (head+skip+size-s->hdr->tail > s->hdr->capacity) {
+		if (s->hdr->capacity - s->hdr->tail % s->hdr->capacity >= sizeof(struct spool_rec_t) &&
+		    record_at(s, s->hdr->tail)->magic == SPOOL_REC_MAGIC) {
+			s->hdr->dropped++;
+		}
+		s->hdr->tail += record_span(s, s->hdr->tail);
+	}
+	if (s->sent < s->hdr->tail) {
+		s->sent = s->hdr->tail;
+	}
+
+	/* mark the unused end of the ring and start again at the beginning */
+	if (skip > 0) {
+		if (skip >= sizeof(uint32_t)) {
+			record_at(s, head)->magic = SPOOL_WRAP_MAGIC;
+			sync_range(record_at(s, head), sizeof(uint32_t));
+		}
+		head += skip;
+	}
+
+	/* write the record body before publishing the new head */
+	rec = record_at(s, head);
+	rec->topic_len = topic_len;
+	rec->payload_len = payload_len;
+	memcpy(rec+1, topic, topic_len);
+	memcpy((uint8_t *)(rec+1)+topic_len, payload, payload_len);
+	rec->crc = record_crc(rec);
+	__sync_synchronize();
+	rec->magic = SPOOL_REC_MAGIC;
+	sync_range(rec, size);
+	s->hdr->head = head+size;
+	sync_range(s->hdr, sizeof(struct spool_hdr_t));
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/* replay backlog in order at a bounded rate while the broker is connected
+ * records stay in the spool until on_publish reports them delivered, at qos 1 and 2 that is the broker's ack
+ * and a crash or disconnect replays them again, at qos 0 it is the write to the socket so replay is at most once */
+static void *spool_thread(void *arg)
+{
+	struct spool_t *s = (struct spool_t *)arg;
+	struct spool_rec_t *rec = NULL;
+	struct spool_pending_t *p = NULL;
+	struct timespec ts;
+	int burst = (s->rate >= 10) ? s->rate/10 : 1;
+	int n = 0, rc = 0, mid = 0, replayed = 0;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop) {
+		if (!s->mqtt->connected || s->hdr->head == s->sent || s->num_pending == SPOOL_INFLIGHT) {
+			if (replayed > 0 && s->hdr->head == s->hdr->tail) {
+				fprintf(stderr, "Spool replay complete, %d messages\n", replayed);
+				msync(s->map, SPOOL_HDR_SIZE, MS_ASYNC);
+				replayed = 0;
+			}
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+			continue;
+		}
+
+		for (n = 0; n < burst && s->mqtt->connected && s->hdr->head != s->sent && s->num_pending < SPOOL_INFLIGHT; n++) {
+			if (s->hdr->capacity - s->sent % s->hdr->capacity < sizeof(struct spool_rec_t) ||
+			    record_at(s, s->sent)->magic == SPOOL_WRAP_MAGIC) {
+				s->sent += record_span(s, s->sent);
+				advance_tail(s);
+				continue;
+			}
+			rec = record_at(s, s->sent);
+			if (rec->magic != SPOOL_REC_MAGIC || rec->topic_len+rec->payload_len > s->hdr->capacity || record_crc(rec) != rec->crc) {
+				fprintf(stderr, "Spool record is corrupt, discarding remaining backlog\n");
+				s->sent = s->hdr->head;
+				s->hdr->tail = s->hdr->head;
+				s->num_pending = 0;
+				break;
+			}
+			if (rec->topic_len >= sizeof(s->topic)) {
+				s->sent += record_span(s, s->sent);
+				advance_tail(s);
+				continue;
+			}
+			memcpy(s->topic, rec+1, rec->topic_len);
+			s->topic[rec->topic_len] = '\0';
+			rc = mosquitto_publish(s->mosq, &mid, s->topic, rec->payload_len, (uint8_t *)(rec+1)+rec->topic_len, s->mqtt->pubqos, false);
+			if (rc != MOSQ_ERR_SUCCESS) {
+				break;
+			}
+			/* the lock is held, so the ack cannot arrive before the record is pending */
+			s->sent += record_span(s, s->sent);
+			p = &s->pending[(s->first_pending+s->num_pending) % SPOOL_INFLIGHT];
+			p->mid = mid;
+			p->acked = 0;
+			p->end = s->sent;
+			s->num_pending++;
+			replayed++;
+		}
+
+		/* leave room for live traffic between bursts */
+		pthread_mutex_unlock(&s->lock);
+		sleep_ms(100);
+		pthread_mutex_lock(&s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+int spool_start(struct spool_t *s, struct mosquitto *mosq, struct mqtt_t *mqtt)
+{
+	s->mosq = mosq;
+	s->mqtt = mqtt;
+	if (pthread_create(&s->thread, NULL, spool_thread, s) != 0) {
+		fprintf(stderr, "Failed to start spool replay thread\n");
+		return 1;
+	}
+	s->started = 1;
+	return 0;
+}
+
+/* wake the replay thread, called when the broker connection comes up
+ * records that were in flight on the old connection have no ack coming and are replayed again from the tail */
+void spool_wake(struct spool_t *s)
+{
+	if (s != NULL && s->open) {
+		pthread_mutex_lock(&s->lock);
+		s->sent = s->hdr->tail;
+		s->num_pending = 0;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/* a message has been delivered, live publishes share the callback and are not found among the pending records */
+void spool_ack(struct spool_t *s, int mid)
+{
+	int i = 0;
+
+	if (s == NULL || !s->open) {
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < s->num_pending; i++) {
+		if (s->pending[(s->first_pending+i) % SPOOL_INFLIGHT].mid == mid) {
+			s->pending[(s->first_pending+i) % SPOOL_INFLIGHT].acked = 1;
+			advance_tail(s);
+			/* a full window is waiting for room */
+			pthread_cond_signal(&s->cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void spool_close(struct spool_t *s)
+{
+	if (s == NULL || !s->open) {
+		return;
+	}
+	if (s->started) {
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+		s->started = 0;
+	}
+	if (s->hdr->dropped > 0) {
+		fprintf(stderr, "Spool dropped %lu messages on overflow\n", (unsigned long)s->hdr->dropped);
+	}
+	msync(s->map, s->map_size, MS_SYNC);
+	munmap(s->map, s->map_size);
+	close(s->fd);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	s->open = 0;
+}
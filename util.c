@@ -20,6 +20,26 @@ int64_t time_ms(void)
 	return ((int64_t)tv.tv_sec*1000) + ((int64_t)tv.tv_usec/1000);
 }
 
+/* monotonic clock for deadlines, unaffected by wall clock steps */
+int64_t mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t)ts.tv_sec*1000) + ((int64_t)ts.tv_nsec/1000000);
+}
+
+/* monotonic clock for measuring durations */
+int64_t time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t)ts.tv_sec*1000000) + ((int64_t)ts.tv_nsec/1000);
+}
+
 void *my_malloc(size_t size)
 {
 	void *ptr = malloc(size);
@@ -39,26 +59,61 @@ char *strlower(char * s)
 
 plc_data_type_t get_plc_data_type(const char * s)
 {
-	plc_data_type_t r = UNKNOWN;
-
-	if (strcmp(s, "lint") == 0) {
-		r = LINT;
-	} else if (strcmp(s, "dint") == 0) {
-		r = DINT;
-	} else if (strcmp(s, "int") == 0) {
-		r = INT;
-	} else if (strcmp(s, "sint") == 0) {
-		r = SINT;
-	} else if (strcmp(s, "real") == 0) {
-		r = REAL;
-	} else if (strcmp(s, "string") == 0) {
-		r = STRING;
-	} else if (strcmp(s, "bool") == 0) {
-		r = BOOL;
-	} else if (strcmp(s, "bit") == 0) {
-		r = BIT;
+	/* dispatch on the first character so each lookup is at most two strcmp calls */
+	switch (s[0]) {
+	case 'b':
+		if (strcmp(s, "bool") == 0) {
+			return BOOL;
+		} else if (strcmp(s, "bit") == 0) {
+			return BIT;
+		}
+		break;
+	case 'c':
+		if (strcmp(s, "counter") == 0) {
+			return STRUCT;
+		}
+		break;
+	case 'd':
+		if (strcmp(s, "dint") == 0) {
+			return DINT;
+		}
+		break;
+	case 'i':
+		if (strcmp(s, "int") == 0) {
+			return INT;
+		}
+		break;
+	case 'l':
+		if (strcmp(s, "lint") == 0) {
+			return LINT;
+		}
+		break;
+	case 'r':
+		if (strcmp(s, "real") == 0) {
+			return REAL;
+		}
+		break;
+	case 's':
+		if (strcmp(s, "sint") == 0) {
+			return SINT;
+		} else if (strcmp(s, "string") == 0) {
+			return STRING;
+		}
+		break;
+	case 't':
+		if (strcmp(s, "timer") == 0) {
+			return STRUCT;
+		}
+		break;
+	case 'u':
+		if (strcmp(s, "udt") == 0) {
+			return STRUCT;
+		}
+		break;
+	default:
+		break;
 	}
-	return r;
+	return UNKNOWN;
 }
 
 const char *get_plc_data_type_str(plc_data_type_t t)
@@ -83,12 +138,163 @@ const char *get_plc_data_type_str(plc_data_type_t t)
 		return "bool";
 	case BIT:
 		return "bit";
+	case STRUCT:
+		return "struct";
+	}
+}
+
+/* size of one element of an atomic type, structures have no fixed size */
+size_t get_plc_data_type_size(plc_data_type_t t)
+{
+	switch (t) {
+	case LINT:
+		return 8;
+	case DINT:
+	case REAL:
+		return 4;
+	case INT:
+		return 2;
+	case SINT:
+	case BOOL:
+	case BIT:
+		return 1;
+	case STRING:
+		/* length word, 82 characters and padding */
+		return 88;
+	default:
+		return 0;
 	}
 }
 
+/* value of a bit tag, structure fields pick their bit out of the raw structure bytes */
+int get_tag_bit(struct tag_t *tag)
+{
+	if (tag->field) {
+		return (*(uint8_t *)tag->data >> tag->bit) & 1;
+	}
+	return *(int *)tag->data;
+}
+
 void pad_spaces(FILE *fd, int n)
 {
 	for (int i = 0; i < n; i++) {
 		fprintf(fd, " ");
 	}
 }
+
+/* decode a numeric tag value from its data buffer, returns 0 for non numeric tags */
+int get_tag_number(struct tag_t *tag, double *value)
+{
+	if (tag == NULL || tag->data == NULL || value == NULL) {
+		return 0;
+	}
+	switch (tag->data_type) {
+	case BIT:
+		*value = (double)get_tag_bit(tag);
+		break;
+	case BOOL:
+	case SINT:
+		*value = (double)*(int8_t *)tag->data;
+		break;
+	case INT:
+		*value = (double)*(int16_t *)tag->data;
+		break;
+	case DINT:
+		*value = (double)*(int32_t *)tag->data;
+		break;
+	case LINT:
+		*value = (double)*(int64_t *)tag->data;
+		break;
+	case REAL:
+		*value = (double)*(float *)tag->data;
+		break;
+	case STRING:
+	case UNKNOWN:
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/* size of the published value, bulk reads only publish their first element */
+size_t get_tag_value_size(struct tag_t *tag)
+{
+	if (tag->data_type == BIT) {
+		return tag->field ? 1 : sizeof(int);
+	}
+	if (tag->elem_size > 0 && tag->elem_size < tag->data_size) {
+		return tag->elem_size;
+	}
+	return tag->data_size;
+}
+
+/* compare tag data with the last published value, honouring deadbands on numeric tags */
+int tag_changed(struct tag_t *tag)
+{
+	double v = 0, delta = 0;
+
+	if (tag->shadow == NULL || !tag->published) {
+		return 1;
+	}
+	if ((tag->deadband > 0 || tag->deadband_pct > 0) && get_tag_number(tag, &v)) {
+		delta = v-tag->last_value;
+		if (delta < 0) {
+			delta = -delta;
+		}
+		if (tag->deadband > 0 && delta > tag->deadband) {
+			return 1;
+		}
+		if (tag->deadband_pct > 0 && delta > (tag->last_value < 0 ? -tag->last_value : tag->last_value)*tag->deadband_pct/100.0) {
+			return 1;
+		}
+		return 0;
+	}
+	if (tag->field && tag->data_type == BIT) {
+		/* neighbouring bits share the byte */
+		return ((*(uint8_t *)tag->data ^ *(uint8_t *)tag->shadow) >> tag->bit) & 1;
+	}
+	return memcmp(tag->data, tag->shadow, get_tag_value_size(tag)) != 0;
+}
+
+pub_format_t get_pub_format(const char * s)
+{
+	if (strcmp(s, "msgpack") == 0) {
+		return PUB_FORMAT_MSGPACK;
+	}
+	if (strcmp(s, "sparkplug") == 0) {
+		return PUB_FORMAT_SPARKPLUG;
+	}
+	return PUB_FORMAT_JSON;
+}
+
+const char *get_pub_format_str(pub_format_t f)
+{
+	switch (f) {
+	case PUB_FORMAT_MSGPACK:
+		return "msgpack";
+	case PUB_FORMAT_SPARKPLUG:
+		return "sparkplug";
+	case PUB_FORMAT_JSON:
+	default:
+		return "json";
+	}
+}
+
+/* quality of the snapshot the publisher is looking at, taken together with the values by pipe_fill */
+quality_t tag_quality(struct tag_t *tag)
+{
+	return tag->view_quality;
+}
+
+const char *get_quality_str(quality_t q)
+{
+	switch (q) {
+	case QUALITY_GOOD:
+		return "good";
+	case QUALITY_STALE:
+		return "stale";
+	case QUALITY_BAD:
+	default:
+		return "bad";
+	}
+}
@@ -0,0 +1,218 @@
+#include "logix2mqtt.h"
+
+/* condition variable that times out against CLOCK_MONOTONIC, deadlines are mono_ms() values */
+int cond_init_mono(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	int rc = 0;
+
+	if (pthread_condattr_init(&attr) != 0) {
+		return 1;
+	}
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	rc = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return (rc != 0);
+}
+
+int waiter_init(struct waiter_t *w)
+{
+	if (w == NULL) {
+		return 1;
+	}
+	memset(w, 0, sizeof(struct waiter_t));
+	if (pthread_mutex_init(&w->lock, NULL) != 0) {
+		return 1;
+	}
+	if (cond_init_mono(&w->cond) != 0) {
+		pthread_mutex_destroy(&w->lock);
+		return 1;
+	}
+	return 0;
+}
+
+void waiter_destroy(struct waiter_t *w)
+{
+	if (w != NULL) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+	}
+}
+
+/* mark a tag as outstanding, must be called before the operation is started */
+void waiter_arm(struct waiter_t *w, struct tag_t *tag)
+{
+	pthread_mutex_lock(&w->lock);
+	if (!tag->pending) {
+		tag->pending = 1;
+		tag->status = PLCTAG_STATUS_PENDING;
+		w->pending++;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* complete an outstanding tag, extra completions for the same operation are ignored */
+void waiter_done(struct waiter_t *w, struct tag_t *tag, int status)
+{
+	pthread_mutex_lock(&w->lock);
+	if (tag->pending) {
+		tag->pending = 0;
+		tag->status = status;
+		tag->read_done = time_us();
+		w->pending--;
+		if (w->pending == 0) {
+			pthread_cond_signal(&w->cond);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* wait until all armed tags have completed or the monotonic deadline passes, returns number still pending */
+int waiter_wait(struct waiter_t *w, struct tag_t **tags, int num_tags, int64_t deadline)
+{
+	struct timespec ts;
+	int i = 0, rc = 0, pending = 0;
+
+	ts.tv_sec = deadline/1000;
+	ts.tv_nsec = (deadline % 1000)*1000000;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->pending > 0 && rc != ETIMEDOUT) {
+		rc = pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+	}
+	pending = w->pending;
+	pthread_mutex_unlock(&w->lock);
+
+	/* sweep status once in case a completion event was missed */
+	if (pending > 0) {
+		for (i = 0; i < num_tags; i++) {
+			if (tags[i]->pending && tags[i]->plctag > 0) {
+				rc = plc_tag_status(tags[i]->plctag);
+				if (rc != PLCTAG_STATUS_PENDING) {
+					waiter_done(w, tags[i], rc);
+				}
+			}
+		}
+		pthread_mutex_lock(&w->lock);
+		pending = w->pending;
+		pthread_mutex_unlock(&w->lock);
+	}
+	return pending;
+}
+
+/* clear any tags left outstanding after a timeout so the next cycle starts fresh */
+void waiter_reset(struct waiter_t *w, struct tag_t **tags, int num_tags)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i]->pending) {
+			tags[i]->pending = 0;
+			tags[i]->status = PLCTAG_ERR_TIMEOUT;
+		}
+	}
+	w->pending = 0;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* libplctag event callback, userdata is the tag structure */
+void waiter_callback(int32_t tag_id, int event, int status, void *userdata)
+{
+	struct tag_t *tag = (struct tag_t *)userdata;
+
+	if (tag == NULL || tag->waiter == NULL) {
+		return;
+	}
+	switch (event) {
+	case PLCTAG_EVENT_CREATED:
+	case PLCTAG_EVENT_READ_COMPLETED:
+	case PLCTAG_EVENT_WRITE_COMPLETED:
+	case PLCTAG_EVENT_ABORTED:
+		waiter_done(tag->waiter, tag, status);
+		break;
+	default:
+		break;
+	}
+}
+
+/* earliest deadline of the reads still outstanding */
+static int64_t next_deadline(struct tag_t **tags, int num_tags, int64_t deadline)
+{
+	int64_t next = deadline;
+	int i = 0;
+
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i]->pending && tags[i]->deadline < next) {
+			next = tags[i]->deadline;
+		}
+	}
+	return next;
+}
+
+/* start reads on all valid tags and wait for them to complete, returns number not read successfully
+ * every read has its own deadline, a read that runs past it is aborted without holding up the others */
+int read_tags(struct waiter_t *w, struct tag_t **tags, int num_tags, int64_t deadline, struct metrics_t *m)
+{
+	int64_t start = time_us(), first = INT64_MAX, last = 0, latency = 0, now = mono_ms(), next = 0;
+	int i = 0, rc = 0, failed = 0;
+
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i]->plctag > 0) {
+			tags[i]->deadline = (tags[i]->timeout > 0 && now+tags[i]->timeout < deadline) ? now+tags[i]->timeout : deadline;
+			tags[i]->read_start = time_us();
+			waiter_arm(w, tags[i]);
+			rc = plc_tag_read(tags[i]->plctag, 0);
+			if (rc != PLCTAG_STATUS_PENDING) {
+				if (rc != PLCTAG_STATUS_OK) {
+					fprintf(stderr, "Unable to read tag data [%d]: %s\n", rc, plc_tag_decode_error(rc));
+				}
+				waiter_done(w, tags[i], rc);
+			}
+		}
+	}
+
+	next = next_deadline(tags, num_tags, deadline);
+	while (waiter_wait(w, tags, num_tags, next) > 0) {
+		/* abort only the reads whose own deadline has passed */
+		now = mono_ms();
+		for (i = 0; i < num_tags; i++) {
+			if (tags[i]->pending && tags[i]->plctag > 0 && tags[i]->deadline <= now) {
+				plc_tag_abort(tags[i]->plctag);
+				waiter_done(w, tags[i], PLCTAG_ERR_TIMEOUT);
+			}
+		}
+		if (now >= deadline) {
+			waiter_reset(w, tags, num_tags);
+			break;
+		}
+		next = next_deadline(tags, num_tags, deadline);
+	}
+
+	for (i = 0; i < num_tags; i++) {
+		if (tags[i]->plctag > 0 && tags[i]->status != PLCTAG_STATUS_OK) {
+			failed++;
+		} else if (tags[i]->plctag > 0 && m != NULL) {
+			/* per tag latency and spread of completions across the cycle */
+			latency = tags[i]->read_done-tags[i]->read_start;
+			hist_record(&m->read, latency);
+			if (latency > tags[i]->read_max) {
+				__atomic_store_n(&tags[i]->read_max, latency, __ATOMIC_RELAXED);
+			}
+			if (tags[i]->read_done < first) {
+				first = tags[i]->read_done;
+			}
+			if (tags[i]->read_done > last) {
+				last = tags[i]->read_done;
+			}
+		}
+	}
+	if (m != NULL) {
+		if (last > 0) {
+			hist_record(&m->first, first-start);
+			hist_record(&m->last, last-start);
+		}
+		metrics_add(&m->read_errors, failed);
+	}
+	return failed;
+}
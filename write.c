@@ -0,0 +1,396 @@
+#include "logix2mqtt.h"
+
+/* report the outcome of one tag write on <reply_topic>/<plc> */
+static void write_ack(struct plc_t *plc, const char *id, const char *name, const char *status)
+{
+	struct mqtt_t *mqtt = plc->mqtt;
+	char topic[512];
+	cJSON *json = NULL;
+	char *buf = NULL;
+
+	if (mqtt->replytopic == NULL || !mqtt->connected) {
+		return;
+	}
+	json = cJSON_CreateObject();
+	if (id != NULL) {
+		cJSON_AddStringToObject(json, "id", id);
+	}
+	cJSON_AddStringToObject(json, "tag", name);
+	cJSON_AddStringToObject(json, "status", status);
+	buf = cJSON_PrintUnformatted(json);
+	cJSON_Delete(json);
+	if (buf == NULL) {
+		return;
+	}
+	snprintf(topic, sizeof(topic), "%s/%s", mqtt->replytopic, plc->name);
+	mosquitto_publish(plc->mosq, NULL, topic, strlen(buf), buf, mqtt->pubqos, 0);
+	free(buf);
+}
+
+static void write_clear(struct write_t *w)
+{
+	if (w->str != NULL) {
+		free(w->str);
+		w->str = NULL;
+	}
+	if (w->id != NULL) {
+		free(w->id);
+		w->id = NULL;
+	}
+	w->tag = NULL;
+}
+
+/* check a requested value against the tag type, returns NULL or the reason it was rejected */
+static const char *write_check(struct tag_t *tag, cJSON *val, double *value, char **str)
+{
+	double v = 0, lo = 0, hi = 0;
+
+	*str = NULL;
+	if (tag->data_type == STRING) {
+		if (!cJSON_IsString(val)) {
+			return "value must be a string";
+		}
+		*str = strdup(val->valuestring);
+		return (*str != NULL) ? NULL : "out of memory";
+	}
+	if (cJSON_IsBool(val)) {
+		v = cJSON_IsTrue(val) ? 1 : 0;
+	} else if (cJSON_IsNumber(val)) {
+		v = val->valuedouble;
+	} else {
+		return "value must be a number";
+	}
+	switch (tag->data_type) {
+	case LINT:
+		lo = -9223372036854775808.0;
+		hi = 9223372036854775808.0;
+		break;
+	case DINT:
+		lo = INT32_MIN;
+		hi = INT32_MAX+1.0;
+		break;
+	case INT:
+		lo = INT16_MIN;
+		hi = INT16_MAX+1.0;
+		break;
+	case SINT:
+		lo = INT8_MIN;
+		hi = INT8_MAX+1.0;
+		break;
+	case REAL:
+		if (fabs(v) > FLT_MAX) {
+			return "value out of range";
+		}
+		*value = v;
+		return NULL;
+	case BOOL:
+	case BIT:
+		*value = (v != 0) ? 1 : 0;
+		return NULL;
+	default:
+		return "unsupported tag type";
+	}
+	if (v != floor(v)) {
+		return "value must be an integer";
+	}
+	/* upper bounds are exclusive, INT64_MAX has no exact double but 2^63 does */
+	if (v < lo || v >= hi) {
+		return "value out of range";
+	}
+	*value = v;
+	return NULL;
+}
+
+/* queue one write, a value already queued for the same tag is replaced, called with the controller locked */
+static void write_queue(struct plc_t *plc, cJSON *entry)
+{
+	struct tag_t *tag = NULL;
+	struct write_t *w = NULL;
+	cJSON *name = NULL, *val = NULL, *id = NULL;
+	const char *err = NULL;
+	char idbuf[32];
+	char *str = NULL;
+	const char *idstr = NULL;
+	double value = 0;
+
+	name = cJSON_GetObjectItemCaseSensitive(entry, "tag");
+	val = cJSON_GetObjectItemCaseSensitive(entry, "value");
+	id = cJSON_GetObjectItemCaseSensitive(entry, "id");
+	if (cJSON_IsString(id)) {
+		idstr = id->valuestring;
+	} else if (cJSON_IsNumber(id)) {
+		snprintf(idbuf, sizeof(idbuf), "%.17g", id->valuedouble);
+		idstr = idbuf;
+	}
+	if (!cJSON_IsString(name) || val == NULL) {
+		write_ack(plc, idstr, cJSON_IsString(name) ? name->valuestring : "", "missing tag or value");
+		return;
+	}
+	tag = plc_find_tag(plc, name->valuestring);
+	if (tag == NULL) {
+		write_ack(plc, idstr, name->valuestring, "unknown tag");
+		return;
+	}
+	if (tag->expr != NULL) {
+		write_ack(plc, idstr, tag->name, "derived tags are read only");
+		return;
+	}
+	err = write_check(tag, val, &value, &str);
+	if (err != NULL) {
+		write_ack(plc, idstr, tag->name, err);
+		return;
+	}
+
+	if (tag->wslot > 0) {
+		/* last value wins within one window */
+		w = &plc->wq[tag->wslot-1];
+		write_ack(plc, w->id, tag->name, "superseded");
+		write_clear(w);
+	} else if (plc->wq_count < WRITE_QUEUE_MAX) {
+		w = &plc->wq[plc->wq_count++];
+		tag->wslot = plc->wq_count;
+	} else {
+		write_ack(plc, idstr, tag->name, "write queue full");
+		free(str);
+		return;
+	}
+	w->tag = tag;
+	w->value = value;
+	w->str = str;
+	w->id = (idstr != NULL) ? strdup(idstr) : NULL;
+}
+
+/* handle a command on <cmd_topic>/<plc>, the payload is one write object or an array of them
+ * {"tag":"Setpoint","value":12.5,"id":"42"} */
+void write_message(struct mqtt_t *mqtt, const char *topic, const void *payload, int len)
+{
+	struct plc_t *plc = NULL;
+	const char *name = NULL;
+	cJSON *json = NULL, *entry = NULL;
+	size_t n = 0;
+	int i = 0;
+
+	if (mqtt->cmdtopic == NULL || mqtt->plcs == NULL) {
+		return;
+	}
+	n = strlen(mqtt->cmdtopic);
+	if (strncmp(topic, mqtt->cmdtopic, n) != 0 || topic[n] != '/') {
+		return;
+	}
+	name = topic+n+1;
+	for (i = 0; i < mqtt->num_plcs; i++) {
+		if (strcmp(mqtt->plcs[i].name, name) == 0) {
+			plc = &mqtt->plcs[i];
+			break;
+		}
+	}
+	if (plc == NULL) {
+		fprintf(stderr, "Write for unknown controller '%s'\n", name);
+		return;
+	}
+
+	json = cJSON_ParseWithLength(payload, len);
+	if (json == NULL || !(cJSON_IsObject(json) || cJSON_IsArray(json))) {
+		fprintf(stderr, "%s: Failed to parse write command\n", plc->name);
+		cJSON_Delete(json);
+		return;
+	}
+	pthread_mutex_lock(&plc->lock);
+	if (cJSON_IsArray(json)) {
+		cJSON_ArrayForEach(entry, json) {
+			if (cJSON_IsObject(entry)) {
+				write_queue(plc, entry);
+			}
+		}
+	} else {
+		write_queue(plc, json);
+	}
+	if (plc->wq_count > 0) {
+		pthread_cond_signal(&plc->wcond);
+	}
+	pthread_mutex_unlock(&plc->lock);
+	cJSON_Delete(json);
+}
+
+/* sleep until the monotonic deadline of the next scan, returning early when writes are queued */
+int write_wait(struct plc_t *plc, int64_t deadline)
+{
+	struct timespec ts;
+	int count = 0;
+
+	ts.tv_sec = deadline/1000;
+	ts.tv_nsec = (deadline % 1000)*1000000;
+	pthread_mutex_lock(&plc->lock);
+	if (plc->wq_count == 0) {
+		pthread_cond_timedwait(&plc->wcond, &plc->lock, &ts);
+	}
+	count = plc->wq_count;
+	pthread_mutex_unlock(&plc->lock);
+	return count;
+}
+
+/* bulk read handles cover neighbouring elements, so those tags write through their own single element handle
+ * returns NULL with the reason for the ack in err when there is no handle to write through */
+static struct tag_t *write_handle(struct plc_t *plc, struct tag_t *tag, const char **err)
+{
+	struct tag_t *writer = NULL;
+	char path[TAG_PATH_MAX_LEN];
+	int rc = 0;
+
+	*err = "not connected";
+	if (tag->parent == NULL && tag->elem_count <= 1) {
+		return (tag->plctag > 0) ? tag : NULL;
+	}
+	if (tag->writer != NULL) {
+		return tag->writer;
+	}
+	/* a truncated path would address a different tag */
+	rc = snprintf(path, TAG_PATH_MAX_LEN-1, TAG_PATH_BASE, plc->gateway, plc->path, tag->name);
+	if (rc < 0 || rc >= TAG_PATH_MAX_LEN-1) {
+		fprintf(stderr, "%s: Tag path for %s is too long to write\n", plc->name, tag->name);
+		*err = "tag path too long";
+		return NULL;
+	}
+	writer = my_malloc(sizeof(struct tag_t));
+	if (writer == NULL) {
+		*err = "out of memory";
+		return NULL;
+	}
+	writer->name = tag->name;
+	writer->data_type = tag->data_type;
+	writer->waiter = &plc->waiter;
+	waiter_arm(&plc->waiter, writer);
+	writer->plctag = plc_tag_create_ex(path, waiter_callback, writer, 0);
+	if (writer->plctag <= 0) {
+		waiter_done(&plc->waiter, writer, writer->plctag);
+	}
+	if (waiter_wait(&plc->waiter, &writer, 1, mono_ms() + plc->timeout) > 0) {
+		waiter_reset(&plc->waiter, &writer, 1);
+	}
+	if (writer->plctag <= 0 || writer->status != PLCTAG_STATUS_OK) {
+		fprintf(stderr, "%s: Could not create write handle for %s [%d]: %s\n", plc->name, tag->name, writer->status, plc_tag_decode_error(writer->status));
+		tag->writer = writer;
+		write_release(tag);
+		return NULL;
+	}
+	tag->writer = writer;
+	return writer;
+}
+
+/* put a value into the tag buffer with the accessor for its type */
+static int write_encode(struct tag_t *t, struct write_t *w)
+{
+	switch (t->data_type) {
+	case LINT:
+		return plc_tag_set_int64(t->plctag, 0, (int64_t)w->value);
+	case DINT:
+		return plc_tag_set_int32(t->plctag, 0, (int32_t)w->value);
+	case INT:
+		return plc_tag_set_int16(t->plctag, 0, (int16_t)w->value);
+	case SINT:
+		return plc_tag_set_int8(t->plctag, 0, (int8_t)w->value);
+	case REAL:
+		return plc_tag_set_float32(t->plctag, 0, (float)w->value);
+	case BOOL:
+	case BIT:
+		return plc_tag_set_bit(t->plctag, 0, (int)w->value);
+	case STRING:
+		return plc_tag_set_string(t->plctag, 0, w->str);
+	default:
+		return PLCTAG_ERR_UNSUPPORTED;
+	}
+}
+
+/* issue every queued write at once, wait for them together and acknowledge each one */
+void write_flush(struct plc_t *plc)
+{
+	struct write_t *batch = NULL, *w = NULL;
+	struct tag_t *t = NULL;
+	const char *err = NULL;
+	int i = 0, n = 0, k = 0, rc = 0;
+
+	if (__atomic_load_n(&plc->wq_count, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	/* take the queue so new commands can be accepted while these are written */
+	pthread_mutex_lock(&plc->lock);
+	batch = plc->wq;
+	plc->wq = plc->wbatch;
+	plc->wbatch = batch;
+	n = plc->wq_count;
+	plc->wq_count = 0;
+	for (i = 0; i < n; i++) {
+		batch[i].tag->wslot = 0;
+	}
+	pthread_mutex_unlock(&plc->lock);
+
+	for (i = 0; i < n; i++) {
+		w = &batch[i];
+		t = write_handle(plc, w->tag, &err);
+		if (t == NULL) {
+			write_ack(plc, w->id, w->tag->name, err);
+			write_clear(w);
+			continue;
+		}
+		rc = write_encode(t, w);
+		if (rc != PLCTAG_STATUS_OK) {
+			write_ack(plc, w->id, w->tag->name, plc_tag_decode_error(rc));
+			write_clear(w);
+			continue;
+		}
+		waiter_arm(&plc->waiter, t);
+		rc = plc_tag_write(t->plctag, 0);
+		if (rc != PLCTAG_STATUS_PENDING) {
+			waiter_done(&plc->waiter, t, rc);
+		}
+		w->tag = t;
+		plc->wtags[k++] = t;
+	}
+
+	if (k > 0 && waiter_wait(&plc->waiter, plc->wtags, k, mono_ms() + plc->timeout) > 0) {
+		for (i = 0; i < k; i++) {
+			if (plc->wtags[i]->pending) {
+				plc_tag_abort(plc->wtags[i]->plctag);
+			}
+		}
+		waiter_reset(&plc->waiter, plc->wtags, k);
+	}
+
+	for (i = 0; i < n; i++) {
+		w = &batch[i];
+		if (w->tag != NULL) {
+			if (w->tag->status != PLCTAG_STATUS_OK) {
+				fprintf(stderr, "%s: Write to %s failed [%d]: %s\n", plc->name, w->tag->name, w->tag->status, plc_tag_decode_error(w->tag->status));
+			}
+			write_ack(plc, w->id, w->tag->name, (w->tag->status == PLCTAG_STATUS_OK) ? "ok" : plc_tag_decode_error(w->tag->status));
+		}
+		write_clear(w);
+	}
+}
+
+/* drop queued writes that can no longer be issued, the caller holds the controller lock */
+void write_discard(struct plc_t *plc, const char *reason)
+{
+	int i = 0;
+
+	for (i = 0; i < plc->wq_count; i++) {
+		write_ack(plc, plc->wq[i].id, plc->wq[i].tag->name, reason);
+		plc->wq[i].tag->wslot = 0;
+		write_clear(&plc->wq[i]);
+	}
+	plc->wq_count = 0;
+}
+
+/* destroy a tag's separate write handle */
+void write_release(struct tag_t *tag)
+{
+	if (tag->writer == NULL) {
+		return;
+	}
+	if (tag->writer->plctag > 0) {
+		plc_tag_destroy(tag->writer->plctag);
+	}
+	free(tag->writer);
+	tag->writer = NULL;
+}